@@ -334,6 +334,18 @@ static inline int ilog2(uint64_t n)
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
 	
+/* same as contigmalloc(), on a given NUMA node (-1 for any node) */
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node) ({	\
+	unsigned int order_ =					\
+		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
+	struct page *p_ = alloc_pages_node((node),		\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
+	if (p_ != NULL) 					\
+		split_page(p_, order_);				\
+	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
+#define nm_numa_node_ok(n)	((n) >= 0 && (n) < MAX_NUMNODES && node_online(n))
+
 #define contigfree(va, sz, ty)					\
 	do {							\
 		unsigned int npages_ =				\
@@ -354,6 +366,8 @@ struct nm_linux_selrecord_t;
 // #define	wakeup(sw)				// XXX double check
 
 #define microtime		do_gettimeofday		// debugging
+#define nm_os_gettime_ns()	((uint64_t)ktime_to_ns(ktime_get()))	/* monotonic */
+#define nm_os_cycles()		((uint64_t)get_cycles())	/* WITH_VALE_PROF */
 
 
 /*
@@ -35,6 +35,11 @@
 
 #include "netmap_linux_config.h"
 
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+#include <linux/huge_mm.h>
+#include <linux/pfn_t.h>
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
+
 #ifdef NETMAP_LINUX_HAVE_IOMMU
 #include <linux/iommu.h>
 
@@ -505,7 +510,8 @@ linux_netmap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	struct netmap_priv_d *priv = vma->vm_private_data;
 	struct netmap_adapter *na = priv->np_na;
 	struct page *page;
-	unsigned long off = (vma->vm_pgoff + vmf->pgoff) << PAGE_SHIFT;
+	/* vmf->pgoff already includes vma->vm_pgoff */
+	unsigned long off = vmf->pgoff << PAGE_SHIFT;
 	unsigned long pa, pfn;
 
 	pa = netmap_mem_ofstophys(na->nm_mem, off);
@@ -525,6 +531,96 @@ static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
 };
 
+/*
+ * Insert all the pages of the mapping now (dev.netmap.mmap_prefault),
+ * so that the process does not take one page fault per page while it
+ * warms up. If something goes wrong we stop, and the remaining pages
+ * are served by linux_netmap_fault() as usual.
+ */
+static void
+linux_netmap_prefault(struct vm_area_struct *vma, struct netmap_mem_d *nmd)
+{
+	uint64_t t0 = nm_os_gettime_ns();
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long addr, pa, n = 0, lazy = 0;
+	int error = 0;
+
+	for (addr = vma->vm_start; addr < vma->vm_end;
+	     addr += PAGE_SIZE, off += PAGE_SIZE) {
+		pa = netmap_mem_ofstophys(nmd, off);
+		if (pa == 0) {
+			/* not populated yet (buf_prealloc_num) */
+			lazy++;
+			continue;
+		}
+		if (!pfn_valid(pa >> PAGE_SHIFT)) {
+			error = EINVAL;
+			break;
+		}
+		error = -vm_insert_page(vma, addr, pfn_to_page(pa >> PAGE_SHIFT));
+		if (error)
+			break;
+		if ((++n & 1023) == 0)
+			cond_resched();
+	}
+	netmap_mmap_prefault_us = div_u64(nm_os_gettime_ns() - t0, 1000);
+	if (error)
+		D("stopped at offset %lx, error %d", off, error);
+	else if (netmap_verbose)
+		D("%lu pages in %d us, %lu left to the fault handler", n,
+			netmap_mmap_prefault_us, lazy);
+}
+
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+/*
+ * Allocators made of hugepage clusters (NETMAP_MEM_HUGE) are
+ * mapped by pfn, so that every 2 MB aligned range of the mapping
+ * can be served by a single pmd (and a single TLB entry).
+ * Ranges that do not qualify fall back to 4 KB pages.
+ */
+static vm_fault_t
+linux_netmap_pfn_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	unsigned long pa;
+
+	pa = netmap_mem_ofstophys(priv->np_na->nm_mem,
+			vmf->pgoff << PAGE_SHIFT);
+	if (pa == 0)
+		return VM_FAULT_SIGBUS;
+	return vmf_insert_pfn(vma, vmf->address, pa >> PAGE_SHIFT);
+}
+
+static vm_fault_t
+linux_netmap_huge_fault(struct vm_fault *vmf, enum page_entry_size pe_size)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	unsigned long addr = vmf->address & ~(NM_HUGE_CLUSTSIZE - 1UL);
+	unsigned long off, pa;
+
+	if (pe_size != PE_SIZE_PMD || PMD_SIZE != NM_HUGE_CLUSTSIZE)
+		return VM_FAULT_FALLBACK;
+	if (addr < vma->vm_start || addr + NM_HUGE_CLUSTSIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	off = (addr - vma->vm_start) + (vma->vm_pgoff << PAGE_SHIFT);
+	pa = netmap_mem_ofstophys(priv->np_na->nm_mem, off);
+	/* we need a whole cluster, at the same alignment */
+	if (pa == 0 || ((off | pa) & (NM_HUGE_CLUSTSIZE - 1)))
+		return VM_FAULT_FALLBACK;
+	ND("huge fault off %lx -> phys addr %lx", off, pa);
+	return vmf_insert_pfn_pmd(vmf,
+		__pfn_to_pfn_t(pa >> PAGE_SHIFT, PFN_DEV),
+		vmf->flags & FAULT_FLAG_WRITE);
+}
+
+static struct vm_operations_struct linux_netmap_huge_mmap_ops = {
+	.fault = linux_netmap_pfn_fault,
+	.huge_fault = linux_netmap_huge_fault,
+};
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
+
 static int
 linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 {
@@ -565,12 +661,24 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 				pa >> PAGE_SHIFT,
 				vma->vm_end - vma->vm_start,
 				vma->vm_page_prot);
+#ifdef NETMAP_LINUX_HAVE_HUGE_FAULT
+	} else if (memflags & NETMAP_MEM_HUGE) {
+		/* pfn-mapped pmds cannot be copied on write */
+		if (!(vma->vm_flags & VM_SHARED))
+			return -EINVAL;
+		vma->vm_flags |= VM_PFNMAP | VM_HUGEPAGE |
+			VM_DONTEXPAND | VM_DONTDUMP;
+		vma->vm_private_data = priv;
+		vma->vm_ops = &linux_netmap_huge_mmap_ops;
+#endif /* NETMAP_LINUX_HAVE_HUGE_FAULT */
 	} else {
 		/* non contiguous memory, we serve 
 		 * page faults as they come
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+		if (netmap_mmap_prefault)
+			linux_netmap_prefault(vma, na->nm_mem);
 	}
 	return 0;
 }
@@ -629,6 +737,7 @@ linux_netmap_ioctl(struct file *file, u_int cmd, u_long data /* arg */)
 	case NIOCRXSYNC:
 		break;
 	case NIOCCONFIG:
+	case NIOCBDGCONF:
 		argsize = sizeof(arg.ifr);
 		break;
 	default:
@@ -1534,6 +1643,7 @@ struct nm_kthread {
 
     atomic_t scheduled;         /* pending wake_up request */
     int attach_user;            /* kthread attached to user_process */
+    int affinity;               /* cpu to bind to, -1 if none */
 
     struct nm_kthread_ctx worker_ctx;
 };
@@ -1625,7 +1735,8 @@ nm_kthread_worker(void *data)
 void inline
 nm_os_kthread_send_irq(struct nm_kthread *nmk)
 {
-    eventfd_signal(nmk->worker_ctx.irq_ctx, 1);
+    if (nmk->worker_ctx.irq_ctx)
+        eventfd_signal(nmk->worker_ctx.irq_ctx, 1);
 }
 
 static int
@@ -1634,6 +1745,10 @@ nm_kthread_open_files(struct nm_kthread *nmk, struct nm_kth_event_cfg *ring_cfg)
     struct file *file;
     struct nm_kthread_ctx *wctx = &nmk->worker_ctx;
 
+    /* kthreads woken up only through nm_os_kthread_wakeup_worker() */
+    if (ring_cfg->ioeventfd == 0 && ring_cfg->irqfd == 0)
+        return 0;
+
     file = eventfd_fget(ring_cfg->ioeventfd);
     if (IS_ERR(file))
         return -PTR_ERR(file);
@@ -1688,7 +1803,7 @@ nm_kthread_start_poll(struct nm_kthread_ctx *ctx, struct file *file)
     unsigned long mask;
     int ret = 0;
 
-    if (ctx->waitq_head)
+    if (ctx->waitq_head || file == NULL)
         return 0;
     mask = file->f_op->poll(file, &ctx->poll_table);
     if (mask)
@@ -1724,6 +1839,7 @@ nm_os_kthread_create(struct nm_kthread_cfg *cfg)
     nmk->worker_ctx.worker_private = cfg->worker_private;
     nmk->worker_ctx.type = cfg->type;
     atomic_set(&nmk->scheduled, 0);
+    nmk->affinity = -1;
 
     /* attach kthread to user process (ptnetmap) */
     nmk->attach_user = cfg->attach_user;
@@ -1756,12 +1872,16 @@ nm_os_kthread_start(struct nm_kthread *nmk)
         nmk->mm = get_task_mm(current);
     }
 
-    nmk->worker = kthread_run(nm_kthread_worker, nmk, "nm_kthread-%ld-%d",
+    nmk->worker = kthread_create(nm_kthread_worker, nmk, "nm_kthread-%ld-%d",
             nmk->worker_ctx.type, current->pid);
     if (IS_ERR(nmk->worker)) {
 	error = -PTR_ERR(nmk->worker);
 	goto err;
     }
+    /* kthread_bind() must be called before the first wakeup */
+    if (nmk->affinity >= 0)
+        kthread_bind(nmk->worker, nmk->affinity);
+    wake_up_process(nmk->worker);
 
     error = nm_kthread_start_poll(&nmk->worker_ctx, nmk->worker_ctx.ioevent_file);
     if (error) {
@@ -1779,6 +1899,27 @@ err:
     return error;
 }
 
+void
+nm_os_kthread_set_affinity(struct nm_kthread *nmk, int affinity)
+{
+    if (affinity >= 0 && !cpu_online(affinity))
+        affinity = -1;
+    nmk->affinity = affinity;
+}
+
+int
+nm_os_ncpus(void)
+{
+    return num_online_cpus();
+}
+
+/* may be stale when called with preemption enabled */
+int
+nm_os_curcpu(void)
+{
+    return raw_smp_processor_id();
+}
+
 void
 nm_os_kthread_stop(struct nm_kthread *nmk)
 {
@@ -1814,6 +1955,138 @@ nm_os_kthread_delete(struct nm_kthread *nmk)
     kfree(nmk);
 }
 
+/* ##################### timer wrapper ##################### */
+/*
+ * The hrtimer fires in hardirq context, where we cannot call into
+ * the drivers, so the callback is run by a tasklet.
+ */
+struct nm_os_timer {
+    struct hrtimer timer;
+    struct tasklet_struct tasklet;
+    void (*fn)(void *);
+    void *arg;
+};
+
+static void
+nm_os_timer_tasklet(unsigned long data)
+{
+    struct nm_os_timer *nmt = (struct nm_os_timer *)data;
+
+    nmt->fn(nmt->arg);
+}
+
+static enum hrtimer_restart
+nm_os_timer_handler(struct hrtimer *t)
+{
+    struct nm_os_timer *nmt = container_of(t, struct nm_os_timer, timer);
+
+    tasklet_schedule(&nmt->tasklet);
+    return HRTIMER_NORESTART;
+}
+
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+    struct nm_os_timer *nmt;
+
+    nmt = kzalloc(sizeof *nmt, GFP_KERNEL);
+    if (!nmt)
+        return NULL;
+    hrtimer_init(&nmt->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    nmt->timer.function = &nm_os_timer_handler;
+    tasklet_init(&nmt->tasklet, nm_os_timer_tasklet, (unsigned long)nmt);
+    nmt->fn = fn;
+    nmt->arg = arg;
+    return nmt;
+}
+
+void
+nm_os_timer_start(struct nm_os_timer *nmt, u_int usec)
+{
+    hrtimer_start(&nmt->timer, ktime_set(0, usec * 1000UL), HRTIMER_MODE_REL);
+}
+
+void
+nm_os_timer_delete(struct nm_os_timer *nmt)
+{
+    if (!nmt)
+        return;
+    hrtimer_cancel(&nmt->timer);
+    tasklet_kill(&nmt->tasklet);
+    kfree(nmt);
+}
+
+/* ##################### pinned user memory ##################### */
+#include <linux/vmalloc.h>
+
+struct nm_os_upin {
+    struct page **pages;
+    int npages;		/* pages we hold a reference to */
+    void *kva;
+};
+
+int
+nm_os_upin(uintptr_t uaddr, size_t len, struct nm_os_upin **pin, char **kva)
+{
+    unsigned long start = uaddr & PAGE_MASK;
+    int n = (PAGE_ALIGN(uaddr + len) - start) >> PAGE_SHIFT;
+    struct nm_os_upin *p;
+    int got;
+
+    p = kzalloc(sizeof *p, GFP_KERNEL);
+    if (!p)
+        return ENOMEM;
+    p->pages = vmalloc(n * sizeof(struct page *));
+    if (!p->pages) {
+        kfree(p);
+        return ENOMEM;
+    }
+    /* we only transmit from here, but a read-only pin of a private
+     * mapping goes stale when the process writes to the page and
+     * gets a copy. The pin is held until NM_UREG_DEL, so it is long term.
+     */
+#ifdef NETMAP_LINUX_HAVE_PIN_USER_PAGES
+    got = pin_user_pages_fast(start, n, FOLL_WRITE | FOLL_LONGTERM, p->pages);
+#else
+    got = get_user_pages_fast(start, n, 1 /* write */, p->pages);
+#endif
+    if (got > 0)
+        p->npages = got;
+    if (got != n)
+        goto fail;
+    p->kva = vmap(p->pages, n, VM_MAP, PAGE_KERNEL);
+    if (!p->kva)
+        goto fail;
+    *pin = p;
+    *kva = (char *)p->kva + (uaddr & ~PAGE_MASK);
+    return 0;
+
+fail:
+    nm_os_uunpin(p);
+    return EFAULT;
+}
+
+void
+nm_os_uunpin(struct nm_os_upin *p)
+{
+    if (!p)
+        return;
+    if (p->kva)
+        vunmap(p->kva);
+#ifdef NETMAP_LINUX_HAVE_PIN_USER_PAGES
+    unpin_user_pages(p->pages, p->npages);
+#else
+    {
+        int i;
+
+        for (i = 0; i < p->npages; i++)
+            put_page(p->pages[i]);
+    }
+#endif
+    vfree(p->pages);
+    kfree(p);
+}
+
 /* ##################### PTNETMAP SUPPORT ##################### */
 #ifdef WITH_PTNETMAP_GUEST
 /*
@@ -386,6 +386,11 @@ ioctlDeviceControl(PDEVICE_OBJECT DeviceObject, PIRP Irp)
 		argsize = sizeof(arg.ifr);
 		break;
 
+	case NIOCBDGCONF:
+		DbgPrint("Netmap.sys: NIOCBDGCONF");
+		argsize = sizeof(arg.ifr);
+		break;
+
 	case NETMAP_MMAP:
 		DbgPrint("Netmap.sys: NETMAP_MMAP");
 		NtStatus = windows_netmap_mmap(Irp);
@@ -792,6 +797,47 @@ nm_os_vi_persist(const char *name, struct ifnet **ret)
     return ENOMEM;
 }
 
+int
+nm_os_ncpus(void)
+{
+    return KeQueryActiveProcessorCount(NULL);
+}
+
+int
+nm_os_curcpu(void)
+{
+    return KeGetCurrentProcessorNumber();
+}
+
+/* no timers yet, the bwrap then rings the doorbell at every notify */
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+    return NULL;
+}
+
+void
+nm_os_timer_start(struct nm_os_timer *nmt, u_int usec)
+{
+}
+
+void
+nm_os_timer_delete(struct nm_os_timer *nmt)
+{
+}
+
+/* no pinned user regions yet, NS_INDIRECT slots always use copyin() */
+int
+nm_os_upin(uintptr_t uaddr, size_t len, struct nm_os_upin **pin, char **kva)
+{
+    return EOPNOTSUPP;
+}
+
+void
+nm_os_uunpin(struct nm_os_upin *p)
+{
+}
+
 void
 bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	struct netmap_vp_adapter *dst_na,
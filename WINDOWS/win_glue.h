@@ -131,6 +131,7 @@ typedef ULONG 			vm_ooffset_t;
 #define destroy_dev(a)
 #define __user
 #define nm_iommu_group_id(dev)	0
+#define nm_numa_node(dev)	(-1)
 
 
 /*
@@ -240,6 +241,16 @@ static int time_uptime_w32()
 	return ret;
 }
 
+static uint64_t nm_os_gettime_ns()
+{
+	LARGE_INTEGER tm;
+	KeQuerySystemTime(&tm);		/* 100ns units */
+	return (uint64_t)tm.QuadPart * 100;
+}
+
+/* not the TSC but the closest portable counter, for WITH_VALE_PROF */
+#define nm_os_cycles()	((uint64_t)KeQueryPerformanceCounter(NULL).QuadPart)
+
 #define microtime		do_gettimeofday
 #define time_second		time_uptime_w32
 
@@ -512,7 +523,10 @@ win_contigmalloc(int sz, int page_size)
  */
 #define contigmalloc(sz, ty, flags, a, b, pgsz, c)	\
 					win_contigmalloc(sz, M_NETMAP)
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node)	\
+					win_contigmalloc(sz, M_NETMAP)
 #define contigfree(va, sz, ty)		ExFreePoolWithTag(va, M_NETMAP)
+#define nm_numa_node_ok(n)		0
 
 #define vtophys				MmGetPhysicalAddress
 #define MALLOC_DEFINE(a,b,c)
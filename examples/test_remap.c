@@ -0,0 +1,149 @@
+/*
+ * test runtime growth of the global memory region and nm_remap()
+ *
+ *	./test_remap [port [more_bufs]]
+ *
+ * Opens port (default vale0:remap@1, a VALE port in the global region),
+ * raises dev.netmap.buf_num by more_bufs (default 1024) while the region
+ * is mapped, triggers the growth with NIOCGINFO, extends the mapping
+ * with nm_remap() and then writes and reads back the first and the last
+ * page of the new tail. buf_num is restored on exit.
+ * Needs root and a nonzero dev.netmap.buf_max_num.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+#ifdef __FreeBSD__
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#endif
+
+#define BUF_NUM_PATH	"/sys/module/netmap/parameters/buf_num"
+
+static int
+get_buf_num(u_int *v)
+{
+#ifdef __FreeBSD__
+	size_t len = sizeof(*v);
+
+	return sysctlbyname("dev.netmap.buf_num", v, &len, NULL, 0);
+#else
+	FILE *f = fopen(BUF_NUM_PATH, "r");
+	int ret;
+
+	if (f == NULL)
+		return -1;
+	ret = fscanf(f, "%u", v) == 1 ? 0 : -1;
+	fclose(f);
+	return ret;
+#endif
+}
+
+static int
+set_buf_num(u_int v)
+{
+#ifdef __FreeBSD__
+	return sysctlbyname("dev.netmap.buf_num", NULL, NULL, &v, sizeof(v));
+#else
+	FILE *f = fopen(BUF_NUM_PATH, "w");
+	int ret;
+
+	if (f == NULL)
+		return -1;
+	ret = fprintf(f, "%u\n", v) > 0 ? 0 : -1;
+	if (fclose(f))
+		ret = -1;
+	return ret;
+#endif
+}
+
+/* write a pattern on the page at p and read it back */
+static int
+touch(volatile char *p, const char *what)
+{
+	u_int i, pgsz = getpagesize();
+
+	for (i = 0; i < pgsz; i++)
+		p[i] = (char)i;
+	for (i = 0; i < pgsz; i++) {
+		if (p[i] != (char)i) {
+			fprintf(stderr, "%s: mismatch at %u\n", what, i);
+			return -1;
+		}
+	}
+	printf("%s page at %p ok\n", what, p);
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *port = argc > 1 ? argv[1] : "vale0:remap@1";
+	u_int more = argc > 2 ? atoi(argv[2]) : 1024;
+	struct nm_desc *d;
+	struct nmreq nmr;
+	uint32_t oldsize, newsize;
+	u_int buf_num;
+	int ret = 1, error;
+
+	d = nm_open(port, NULL, 0, NULL);
+	if (d == NULL) {
+		fprintf(stderr, "cannot open %s\n", port);
+		return 1;
+	}
+	oldsize = d->memsize;
+	printf("%s: region %d, %u bytes mapped\n", port, d->req.nr_arg2,
+		oldsize);
+
+	if (get_buf_num(&buf_num)) {
+		fprintf(stderr, "cannot read buf_num: %s\n", strerror(errno));
+		goto out;
+	}
+	if (set_buf_num(buf_num + more)) {
+		fprintf(stderr, "cannot set buf_num: %s\n", strerror(errno));
+		goto out;
+	}
+
+	/* the region grows at the next configuration request */
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	nmr.nr_arg2 = d->req.nr_arg2;
+	if (ioctl(d->fd, NIOCGINFO, &nmr)) {
+		fprintf(stderr, "NIOCGINFO: %s\n", strerror(errno));
+		goto restore;
+	}
+	newsize = d->nifp->ni_memsize;
+	if (newsize <= oldsize) {
+		fprintf(stderr, "region did not grow (%u bytes), "
+			"is dev.netmap.buf_max_num set?\n", newsize);
+		goto restore;
+	}
+	printf("region grown to %u bytes\n", newsize);
+
+	error = nm_remap(d);
+	if (error) {
+		fprintf(stderr, "nm_remap: %s\n", strerror(error));
+		goto restore;
+	}
+	if (d->memsize != newsize) {
+		fprintf(stderr, "mapped %u bytes, expected %u\n",
+			d->memsize, newsize);
+		goto restore;
+	}
+	/* the first and the last page of the new buffers */
+	if (touch((char *)d->mem + oldsize, "first") == 0 &&
+	    touch((char *)d->mem + newsize - getpagesize(), "last") == 0)
+		ret = 0;
+
+restore:
+	set_buf_num(buf_num);
+out:
+	nm_close(d);
+	printf("%s\n", ret ? "FAILED" : "PASSED");
+	return ret;
+}
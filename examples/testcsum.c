@@ -47,6 +47,11 @@ bufs    size    ns/cy
 #include <string.h>
 #include <inttypes.h>
 #include <sys/time.h>
+#if defined(__FreeBSD__)
+#include <sys/endian.h>
+#else
+#include <endian.h>	/* be16toh */
+#endif
 
 
 volatile uint16_t res;
@@ -192,6 +197,176 @@ sum32a(const unsigned char *addr, int count)
 }
 
 
+/*
+ * What nm_os_csum_raw() does on FreeBSD, 16 bit at a time
+ * with a byte swap on each word.
+ */
+uint32_t
+sum16be(const unsigned char *addr, int count)
+{
+	uint32_t sum = 0;
+	const uint16_t *d = (const uint16_t *)addr;
+
+	for (; count >= 2; count -= 2)
+		sum += be16toh(*d++);
+	if (count & 1)
+		sum += *(const uint8_t *)d << 8;
+	return REDUCE16(sum);
+}
+
+/*
+ * nm_csum_partial() in netmap_offloadings.c: 32 bit loads added to
+ * a 64 bit accumulator, unrolled 8 times, memcpy() for unaligned data.
+ */
+uint32_t
+sum64u(const unsigned char *p, int len)
+{
+	uint64_t sum = 0;
+	uint32_t w[8];
+	uint16_t t = 0;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		memcpy(w, p, 32);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3] +
+			w[4] + w[5] + w[6] + w[7];
+	}
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(w, p, 4);
+		sum += w[0];
+	}
+	if (len >= 2) {
+		memcpy(&t, p, 2);
+		sum += t;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {
+		t = 0;
+		memcpy(&t, p, 1);
+		sum += t;
+	}
+	sum = REDUCE32(sum);
+	return REDUCE16(sum);
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+/*
+ * AVX2: 32 bytes per iteration, 32 bit lanes widened to 64 bit
+ * and added in two vector accumulators.
+ */
+__attribute__((target("avx2"))) uint32_t
+sum_avx2(const unsigned char *p, int len)
+{
+	__m256i acc0 = _mm256_setzero_si256(), acc1 = acc0;
+	uint64_t v[4], sum;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)p);
+
+		acc0 = _mm256_add_epi64(acc0,
+			_mm256_cvtepu32_epi64(_mm256_castsi256_si128(x)));
+		acc1 = _mm256_add_epi64(acc1,
+			_mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1)));
+	}
+	_mm256_storeu_si256((__m256i *)v, _mm256_add_epi64(acc0, acc1));
+	sum = REDUCE32(v[0]) + REDUCE32(v[1]) + REDUCE32(v[2]) + REDUCE32(v[3]);
+	sum += sum64u(p, len);
+	sum = REDUCE32(sum);
+	return REDUCE16(sum);
+}
+#endif /* __x86_64__ */
+
+/*
+ * Copy and checksum. copy_sum16be is what bdg_mismatch_datapath()
+ * did before (sum, then copy), copysum64 is nm_csum_copy() on FreeBSD.
+ * On Linux nm_csum_copy() uses csum_partial_copy_nocheck(), which is
+ * kernel only and cannot be measured here. copy_then_sum64 is its
+ * fallback on architectures with no fused version (memcpy(), then
+ * the sum of the destination). With data in the cache a fast memcpy()
+ * may beat the portable fused loop, so compare the two on the target.
+ */
+static unsigned char copy_dst[2048 + 64];
+
+uint32_t
+copy_sum16be(const unsigned char *addr, int count)
+{
+	uint32_t sum = sum16be(addr, count);
+
+	memcpy(copy_dst, addr, count);
+	return sum;
+}
+
+uint32_t
+copy_then_sum64(const unsigned char *src, int len)
+{
+	memcpy(copy_dst, src, len);
+	return sum64u(copy_dst, len);
+}
+
+uint32_t
+copysum64(const unsigned char *src, int len)
+{
+	uint64_t sum = 0, w;
+	unsigned char *dst = copy_dst;
+	uint16_t t;
+
+	for (; len >= 8; len -= 8, src += 8, dst += 8) {
+		memcpy(&w, src, 8);
+		memcpy(dst, &w, 8);
+		sum += (w & 0xffffffff) + (w >> 32);
+	}
+	for (; len >= 2; len -= 2, src += 2, dst += 2) {
+		memcpy(&t, src, 2);
+		memcpy(dst, &t, 2);
+		sum += t;
+	}
+	if (len) {
+		t = 0;
+		*dst = *src;
+		memcpy(&t, src, 1);
+		sum += t;
+	}
+	sum = REDUCE32(sum);
+	return REDUCE16(sum);
+}
+
+/*
+ * Per-segment IPv4 header checksum in GSO: full recomputation
+ * (gso_fix_segment() before) vs the incremental update from the
+ * constant part of the header (tot_len and id change). 'count'
+ * is used as the length to insert.
+ */
+static unsigned char iphdr[20] = { 0x45, 0, 0, 0, 0x12, 0x34, 0x40, 0,
+	64, 6, 0, 0, 10, 0, 0, 1, 10, 0, 0, 2 };
+
+uint32_t
+iphdr_full(const unsigned char *addr, int count)
+{
+	uint16_t *w = (uint16_t *)iphdr;
+
+	(void)addr;
+	w[1] = htobe16(count);
+	w[5] = 0;
+	w[5] = htobe16(~sum16be(iphdr, 20));
+	return w[5];
+}
+
+uint32_t
+iphdr_incr(const unsigned char *addr, int count)
+{
+	static uint64_t base;
+	uint16_t *w = (uint16_t *)iphdr;
+
+	(void)addr;
+	if (base == 0)	/* once per GSO packet */
+		base = sum64u(iphdr, 2) + sum64u(iphdr + 6, 4) +
+			sum64u(iphdr + 12, 8);
+	w[1] = htobe16(count);
+	w[5] = ~REDUCE16(REDUCE32(base + w[1] + w[2]));
+	return w[5];
+}
+
 struct ftab {
 	char *name;
 	uint32_t (*fn)(const unsigned char *, int);
@@ -200,9 +375,19 @@ struct ftab {
 struct ftab f[] = {
 	{ "dummy", dummy },
 	{ "sum16", sum16 },
+	{ "sum16be", sum16be },
 	{ "sum32", sum32 },
 	{ "sum32u", sum32u },
 	{ "sum32a", sum32a },
+	{ "sum64u", sum64u },
+#if defined(__x86_64__)
+	{ "avx2", sum_avx2 },
+#endif
+	{ "copy_sum16be", copy_sum16be },
+	{ "copy_then_sum64", copy_then_sum64 },
+	{ "copysum64", copysum64 },
+	{ "iphdr_full", iphdr_full },
+	{ "iphdr_incr", iphdr_incr },
 	{ NULL, NULL }
 };
 
@@ -267,10 +452,11 @@ main(int argc, char *argv[])
 	n = tb.tv_sec * 1000000 +  tb.tv_usec;
 	fprintf(stderr, "%dM cycles in %d.%06ds, %dns/cycle\n",
 		lim, (int)tb.tv_sec, (int)tb.tv_usec, n/(lim*1000) );
-	fprintf(stderr, "%s %u sum16 %u sum32 %d sum32u %u\n",
+	fprintf(stderr, "%s %u sum16 %u sum32 %d sum32u %u sum64u %u\n",
 		fn, res,
 		sum16((unsigned char *)buf0, len),
 		sum32((unsigned char *)buf0, len),
-		sum32u((unsigned char *)buf0, len));
+		sum32u((unsigned char *)buf0, len),
+		sum64u((unsigned char *)buf0, len));
 	return 0;
 }
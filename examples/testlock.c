@@ -741,6 +741,366 @@ test_netmap(struct targ *t)
 	return;
 }
 
+/*
+ * Source learning in a VALE switch, see netmap_bdg_learning().
+ * Each thread is a sender that alternates among LEARN_HOSTS source
+ * addresses and updates a shared forwarding table:
+ *	learn		writes the entry whenever the source changes
+ *	learn-check	writes only if the entry is different
+ *	learn-log	as learn-check, but queues the changes in a
+ *			per-thread log applied once per LEARN_BATCH,
+ *			or when full. A change is applied only if the
+ *			entry is still the one it replaced
+ * With -l 1 the hosts of all threads use the same entries, as with
+ * colliding or moving hosts, so entries keep changing. Scaling is
+ * shown by running with 1 to 32 threads, e.g.
+ *	for t in 1 2 4 8 16 32; do testlock -m learn-check -t $t -a 1; done
+ */
+#define LEARN_HASH	1024
+#define LEARN_HOSTS	4
+#define LEARN_BATCH	512
+#define LEARN_LOG	20
+
+static struct {
+	uint64_t	mac;
+	uint64_t	ports;
+} learn_ht[LEARN_HASH] __attribute__ ((aligned(64)));
+
+struct learn_ent {
+	uint64_t	mac;
+	uint64_t	omac;	/* the entry being replaced */
+	uint16_t	sh;
+	uint16_t	port;
+	uint16_t	oport;
+};
+
+/* as nm_bdg_learn_merge() */
+static void
+learn_merge(struct learn_ent *e, u_int n)
+{
+	u_int k;
+
+	for (k = 0; k < n; k++) {
+		if (learn_ht[e[k].sh].mac == e[k].omac &&
+		    learn_ht[e[k].sh].ports == e[k].oport) {
+			learn_ht[e[k].sh].mac = e[k].mac;
+			learn_ht[e[k].sh].ports = e[k].port;
+		}
+	}
+}
+
+static inline uint32_t
+learn_hash(uint64_t mac)
+{
+	return (uint32_t)((mac * 0x9e3779b97f4a7c15ULL) >> 54) & (LEARN_HASH - 1);
+}
+
+static void
+learn_body(struct targ *t, int check, int log)
+{
+	int64_t m, i;
+	uint64_t macs[LEARN_HOSTS], last = 0;
+	struct learn_ent e[LEARN_LOG];
+	u_int h, n = 0, k, port = t->me;
+
+	for (h = 0; h < LEARN_HOSTS; h++)	/* 02:xx:... locally administered */
+		macs[h] = 0x02 | ((uint64_t)(t->g->arg ? 0 : t->me) << 8) |
+			((uint64_t)h << 24);
+	for (m = 0; m < t->g->m_cycles; m++) {
+		for (i = 0; i < ONE_MILLION; i++) {
+			uint64_t smac = macs[i % LEARN_HOSTS];
+			uint32_t sh;
+			int queued = 0;
+
+			if (smac != last) {
+				sh = learn_hash(smac);
+				if (!check) {
+					learn_ht[sh].mac = smac;
+					learn_ht[sh].ports = port;
+				} else if (learn_ht[sh].mac != smac ||
+				    learn_ht[sh].ports != port) {
+					if (!log) {
+						learn_ht[sh].mac = smac;
+						learn_ht[sh].ports = port;
+					} else {
+						for (k = 0; k < n && e[k].sh != sh; k++)
+							;
+						if (k == LEARN_LOG) {
+							learn_merge(e, n);
+							k = n = 0;
+						}
+						e[k].mac = smac;
+						e[k].sh = sh;
+						e[k].port = port;
+						e[k].omac = learn_ht[sh].mac;
+						e[k].oport = learn_ht[sh].ports;
+						if (k == n)
+							n++;
+						queued = 1;
+					}
+				}
+				/* as last_smac, a queued change is
+				 * checked again until applied */
+				if (!queued)
+					last = smac;
+			}
+			if (log && (i % LEARN_BATCH) == 0) {
+				learn_merge(e, n);
+				n = 0;
+			}
+			if ((i & 1023) == 1023)	/* limit the sharing of count */
+				t->count += 1024;
+		}
+	}
+}
+
+void
+test_learn(struct targ *t)
+{
+	learn_body(t, 0, 0);
+}
+
+void
+test_learn_check(struct targ *t)
+{
+	learn_body(t, 1, 0);
+}
+
+void
+test_learn_log(struct targ *t)
+{
+	learn_body(t, 1, 1);
+}
+
+/*
+ * Buffer allocator throughput. Each thread repeatedly creates and
+ * destroys an ephemeral VALE port with -l extra buffers (default 1024).
+ * VALE ports get a private region by default, so the ports are put
+ * in the global region (its id comes from NIOCGINFO, in nr_arg2)
+ * and all threads allocate and free from the same pool.
+ * Counts are in buffers, e.g.
+ *	for t in 1 2 4 8; do testlock -m nmbufs -t $t -l 4096; done
+ */
+static uint16_t nmbufs_mem_id;	/* shared region, set by the first thread */
+
+void
+test_nmbufs(struct targ *t)
+{
+	struct nmreq nmr;
+	int fd;
+	int64_t m;
+
+	pthread_mutex_lock(&t->g->mtx);
+	if (nmbufs_mem_id == 0) {
+		fd = open("/dev/netmap", O_RDWR);
+		if (fd >= 0) {
+			bzero(&nmr, sizeof(nmr));
+			nmr.nr_version = NETMAP_API;
+			if (ioctl(fd, NIOCGINFO, &nmr) == 0)
+				nmbufs_mem_id = nmr.nr_arg2;
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&t->g->mtx);
+	if (nmbufs_mem_id == 0) {
+		D("cannot find the global memory region, exit");
+		return;
+	}
+
+	for (m = 0; m < t->g->m_cycles; m++) {
+		fd = open("/dev/netmap", O_RDWR);
+		if (fd < 0) {
+			D("fail to open netmap, exit");
+			return;
+		}
+		bzero(&nmr, sizeof(nmr));
+		nmr.nr_version = NETMAP_API;
+		nmr.nr_flags = NR_REG_ALL_NIC;
+		nmr.nr_arg2 = nmbufs_mem_id;
+		nmr.nr_arg3 = t->g->arg > 0 ? t->g->arg : 1024;
+		snprintf(nmr.nr_name, sizeof(nmr.nr_name), "vale%d:tl%d",
+			t->me, t->me);
+		if (ioctl(fd, NIOCREGIF, &nmr) < 0) {
+			D("NIOCREGIF %s failed", nmr.nr_name);
+			close(fd);
+			return;
+		}
+		if (nmr.nr_arg2 != nmbufs_mem_id) {
+			D("%s not in region %d, exit", nmr.nr_name,
+				nmbufs_mem_id);
+			close(fd);
+			return;
+		}
+		t->count += nmr.nr_arg3 +
+			nmr.nr_tx_rings * nmr.nr_tx_slots +
+			nmr.nr_rx_rings * nmr.nr_rx_slots;
+		close(fd);
+	}
+}
+
+/*
+ * The buffer pool of netmap_mem2.c, to measure the allocator itself
+ * rather than the port setup around it. One pool of OBJ_NUM objects
+ * is shared by all threads and protected by g->mtx, as the pools by
+ * NMA_LOCK. The low half of the pool is taken at start, as by the
+ * rings of other ports. Each cycle allocates -l objects (default 1024)
+ * under the lock and frees them, counts are in objects:
+ *	objpool-scan	one at a time, the bitmap is scanned from word 0
+ *			(netmap_obj_malloc() before the magazine)
+ *	objpool		one at a time, magazine of freed objects, then
+ *			the bitmap from the hint (netmap_obj_malloc())
+ *	objpool-bulk	as objpool, OBJ_BATCH at a time
+ *			(netmap_obj_malloc_bulk(), netmap_new_bufs())
+ * e.g.	for t in 1 2 4 8; do testlock -m objpool-bulk -t $t -l 2048; done
+ */
+#define OBJ_NUM		(1 << 18)
+#define OBJ_CACHE	1024	/* NM_OBJ_CACHE */
+#define OBJ_BATCH	64	/* NM_BUFS_BATCH */
+
+static struct {
+	uint32_t	bitmap[OBJ_NUM / 32];	/* 1 means free */
+	uint32_t	hint;
+	uint32_t	cache[OBJ_CACHE];
+	u_int		ncache;
+	int		ready;
+} objpool;
+
+static void
+objpool_init(struct targ *t)
+{
+	pthread_mutex_lock(&t->g->mtx);
+	if (!objpool.ready) {
+		memset(objpool.bitmap, 0, sizeof(objpool.bitmap) / 2);
+		memset(objpool.bitmap + OBJ_NUM / 64, 0xff,
+			sizeof(objpool.bitmap) / 2);
+		objpool.hint = OBJ_NUM / 64;
+		objpool.ready = 1;
+	}
+	pthread_mutex_unlock(&t->g->mtx);
+}
+
+static uint32_t
+objpool_scan(uint32_t i)
+{
+	uint32_t j;
+
+	for (; i < OBJ_NUM / 32; i++) {
+		if (objpool.bitmap[i] != 0)
+			break;
+	}
+	if (i == OBJ_NUM / 32)
+		return 0;
+	j = __builtin_ctz(objpool.bitmap[i]);
+	objpool.bitmap[i] &= ~(1U << j);
+	return i * 32 + j;
+}
+
+static uint32_t
+objpool_malloc(void)
+{
+	uint32_t j;
+
+	if (objpool.ncache > 0) {
+		j = objpool.cache[--objpool.ncache];
+		objpool.bitmap[j / 32] &= ~(1U << (j % 32));
+		return j;
+	}
+	j = objpool_scan(objpool.hint);
+	objpool.hint = j / 32;
+	return j;
+}
+
+static u_int
+objpool_malloc_bulk(uint32_t *idx, u_int n)
+{
+	uint32_t i, j, cur;
+	u_int k = 0;
+
+	while (k < n && objpool.ncache > 0) {
+		j = objpool.cache[--objpool.ncache];
+		objpool.bitmap[j / 32] &= ~(1U << (j % 32));
+		idx[k++] = j;
+	}
+	for (i = objpool.hint; k < n && i < OBJ_NUM / 32; ) {
+		cur = objpool.bitmap[i];
+		while (cur != 0 && k < n) {
+			j = __builtin_ctz(cur);
+			cur &= ~(1U << j);
+			idx[k++] = i * 32 + j;
+		}
+		objpool.bitmap[i] = cur;
+		if (cur == 0)
+			i++;
+	}
+	objpool.hint = i;
+	return k;
+}
+
+static void
+objpool_free(uint32_t j, int cache)
+{
+	objpool.bitmap[j / 32] |= 1U << (j % 32);
+	if (!cache)
+		return;
+	if (j / 32 < objpool.hint)
+		objpool.hint = j / 32;
+	if (objpool.ncache < OBJ_CACHE)
+		objpool.cache[objpool.ncache++] = j;
+}
+
+static void
+objpool_body(struct targ *t, int mode)
+{
+	u_int n = t->g->arg > 0 ? t->g->arg : 1024, i, k, m;
+	uint32_t *idx;
+	int64_t c;
+
+	objpool_init(t);
+	idx = calloc(n, sizeof(*idx));
+	if (idx == NULL)
+		return;
+	for (c = 0; c < t->g->m_cycles; c++) {
+		pthread_mutex_lock(&t->g->mtx);
+		for (i = 0; i < n; i += m) {
+			if (mode == 2) {
+				m = objpool_malloc_bulk(idx + i,
+					n - i < OBJ_BATCH ? n - i : OBJ_BATCH);
+			} else {
+				idx[i] = mode ? objpool_malloc() :
+					objpool_scan(0);
+				m = idx[i] != 0;
+			}
+			if (m == 0)
+				break;
+		}
+		pthread_mutex_unlock(&t->g->mtx);
+		pthread_mutex_lock(&t->g->mtx);
+		for (k = 0; k < i; k++)
+			objpool_free(idx[k], mode != 0);
+		pthread_mutex_unlock(&t->g->mtx);
+		t->count += i;
+	}
+	free(idx);
+}
+
+void
+test_objpool_scan(struct targ *t)
+{
+	objpool_body(t, 0);
+}
+
+void
+test_objpool(struct targ *t)
+{
+	objpool_body(t, 1);
+}
+
+void
+test_objpool_bulk(struct targ *t)
+{
+	objpool_body(t, 2);
+}
+
 struct entry {
 	void (*fn)(struct targ *);
 	char *name;
@@ -770,6 +1130,13 @@ struct entry tests[] = {
 	{ test_netmap, "netmap", 1000, 100000000 },
 	{ test_pthread_mutex, "mutex", 1000, 100000000 },
 	{ test_spinlock, "spinlock", 1000, 100000000 },
+	{ test_learn, "learn", ONE_MILLION, 100 },
+	{ test_learn_check, "learn-check", ONE_MILLION, 100 },
+	{ test_learn_log, "learn-log", ONE_MILLION, 100 },
+	{ test_nmbufs, "nmbufs", 1, 1000 },
+	{ test_objpool_scan, "objpool-scan", 1000, 10000 },
+	{ test_objpool, "objpool", 1000, 10000 },
+	{ test_objpool_bulk, "objpool-bulk", 1000, 10000 },
 	{ NULL, NULL, 0, 0 }
 };
 
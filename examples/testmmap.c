@@ -534,7 +534,8 @@ do_if()
 	printf("tx_rings   %u\n", nifp->ni_tx_rings);
 	printf("rx_rings   %u\n", nifp->ni_rx_rings);
 	printf("bufs_head  %u\n", nifp->ni_bufs_head);
-	for (i = 0; i < 5; i++)
+	printf("memsize    %u\n", nifp->ni_memsize);
+	for (i = 0; i < sizeof(nifp->ni_spare1) / sizeof(nifp->ni_spare1[0]); i++)
 		printf("spare1[%d]  %u\n", i, nifp->ni_spare1[i]);
 	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings + 2); i++)
 		printf("ring_ofs[%d] %ld\n", i, nifp->ring_ofs[i]);
@@ -902,6 +903,7 @@ do_nmr_dump()
 		printf(", EXCLUSIVE");
 	}
 	printf("]\n");
+	printf("nr_numa: %u\n", curr_nmr.nr_numa);
 	printf("spare2[0]: %x\n", curr_nmr.spare2[0]);
 }
 
@@ -39,6 +39,8 @@
 #include <net/netmap_user.h>
 #include <libgen.h>	/* basename */
 #include <stdlib.h>	/* atoi, free */
+#include <arpa/inet.h>	/* inet_pton */
+#include <ctype.h>	/* isdigit */
 
 /* debug support */
 #define ND(format, ...)	do {} while(0)
@@ -74,6 +76,9 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 		case 3:
 			nmr->nr_rx_rings = v;
 			break;
+		case 4:
+			nmr->nr_arg2 = v; /* memory region to share */
+			break;
 		default:
 			D("ignored config: %s", tok);
 			break;
@@ -85,11 +90,50 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 	free(w);
 }
 
+/* port parameters accessible with -p */
+static struct {
+	const char *name;
+	int id;
+	const char *ring;	/* per ring parameter, NULL if per port */
+} bdg_params[] = {
+	{ "latency",	NETMAP_BDG_P_LATENCY,	NULL },
+	{ "batch",	NETMAP_BDG_P_BATCH,	"tx" },
+	{ "budget",	NETMAP_BDG_P_BUDGET,	NULL },
+	{ "wakeups",	NETMAP_BDG_P_WAKEUPS,	"rx" },
+	{ "polls",	NETMAP_BDG_P_POLLS,	"rx" },
+	{ "slots",	NETMAP_BDG_P_SLOTS,	"rx" },
+	{ "exhausted",	NETMAP_BDG_P_EXHAUSTED,	"rx" },
+	{ "txthresh",	NETMAP_BDG_P_TXTHRESH,	NULL },
+	{ "txdelay",	NETMAP_BDG_P_TXDELAY,	NULL },
+	{ "doorbells",	NETMAP_BDG_P_DOORBELLS,	"tx" },
+	{ "deferred",	NETMAP_BDG_P_DEFERRED,	"tx" },
+	{ "txtimer",	NETMAP_BDG_P_TXTIMER,	"tx" },
+	{ "scan",	NETMAP_BDG_P_CYC_SCAN,	NULL },
+	{ "lookup",	NETMAP_BDG_P_CYC_LOOKUP, NULL },
+	{ "lease",	NETMAP_BDG_P_CYC_LEASE,	NULL },
+	{ "copy",	NETMAP_BDG_P_CYC_COPY,	NULL },
+	{ "done",	NETMAP_BDG_P_CYC_DONE,	NULL },
+	{ "notify",	NETMAP_BDG_P_CYC_NOTIFY, NULL },
+	{ "mem",	NETMAP_BDG_P_MEM,	NULL },
+	{ NULL, 0, NULL }
+};
+
+static int
+bdg_param_idx(const char *name)
+{
+	int i;
+
+	for (i = 0; bdg_params[i].name != NULL; i++)
+		if (!strcmp(bdg_params[i].name, name))
+			return i;
+	return -1;
+}
+
 static int
 bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 {
 	struct nmreq nmr;
-	int error = 0;
+	int error = 0, i;
 	int fd = open("/dev/netmap", O_RDWR);
 
 	if (fd == -1) {
@@ -102,7 +146,8 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 	if (name != NULL) /* might be NULL */
 		strncpy(nmr.nr_name, name, sizeof(nmr.nr_name));
 	nmr.nr_cmd = nr_cmd;
-	parse_nmr_config(nmr_config, &nmr);
+	if (nr_cmd != NETMAP_BDG_SETPARAM)
+		parse_nmr_config(nmr_config, &nmr);
 
 	switch (nr_cmd) {
 	case NETMAP_BDG_DELIF:
@@ -155,6 +200,50 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 
 		break;
 
+	case NETMAP_BDG_SETPARAM:
+		/* nmr_config is "param" or "param=value" */
+		{
+			char *v = strchr(nmr_config, '=');
+			int idx;
+
+			if (v != NULL)
+				*v++ = '\0';
+			idx = bdg_param_idx(nmr_config);
+			if (idx < 0) {
+				D("unknown parameter %s", nmr_config);
+				error = -1;
+				break;
+			}
+			nmr.nr_arg1 = bdg_params[idx].id;
+			if (v != NULL) {
+				nmr.nr_arg3 = atoi(v);
+				error = ioctl(fd, NIOCREGIF, &nmr);
+				if (error == -1)
+					perror(name);
+				break;
+			}
+			/* no value, read the parameter (maybe per ring) */
+			nmr.nr_cmd = NETMAP_BDG_GETPARAM;
+			for (i = 0; ; i++) {
+				nmr.nr_ringid = i;
+				error = ioctl(fd, NIOCGINFO, &nmr);
+				if (error == -1) {
+					if (i == 0)
+						perror(name);
+					else
+						error = 0;
+					break;
+				}
+				if (bdg_params[idx].ring == NULL) {
+					D("%s: %s %u", name, nmr_config, nmr.nr_arg3);
+					break;
+				}
+				D("%s: %s %u on %s ring %d", name, nmr_config,
+				    nmr.nr_arg3, bdg_params[idx].ring, i);
+			}
+		}
+		break;
+
 	default: /* GINFO */
 		nmr.nr_cmd = nmr.nr_arg1 = nmr.nr_arg2 = 0;
 		error = ioctl(fd, NIOCGINFO, &nmr);
@@ -169,6 +258,380 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 	return error;
 }
 
+static int
+parse_mac(const char *s, uint8_t *mac)
+{
+	unsigned int m[6];
+	int i;
+
+	if (sscanf(s, "%x:%x:%x:%x:%x:%x",
+	    &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) != 6)
+		return -1;
+	for (i = 0; i < 6; i++)
+		mac[i] = m[i];
+	return 0;
+}
+
+/*
+ * -T port[,off|,vni=N,lip=A,lmac=M,rip=A,rmac=M[,udp=P]]
+ * configure, remove or show a VXLAN tunnel endpoint
+ */
+static int
+vtep_ctl(const char *spec)
+{
+	struct nm_ifreq ifr;
+	struct nm_vtep_req *req = (struct nm_vtep_req *)ifr.data;
+	char *w = strdup(spec), *tok;
+	int fd, error = 0;
+	char a[INET_ADDRSTRLEN], b[INET_ADDRSTRLEN];
+
+	bzero(&ifr, sizeof(ifr));
+	tok = strtok(w, ",");
+	strncpy(ifr.nifr_name, tok, sizeof(ifr.nifr_name) - 1);
+	req->nvr_cmd = NM_VTEP_GET;
+	while ((tok = strtok(NULL, ",")) != NULL) {
+		char *v = strchr(tok, '=');
+
+		if (!strcmp(tok, "off")) {
+			req->nvr_cmd = NM_VTEP_CLEAR;
+			continue;
+		}
+		req->nvr_cmd = NM_VTEP_SET;
+		if (v == NULL)
+			goto bad;
+		*v++ = '\0';
+		if (!strcmp(tok, "vni"))
+			req->nvr_vni = atoi(v);
+		else if (!strcmp(tok, "udp"))
+			req->nvr_udp_port = htons(atoi(v));
+		else if (!strcmp(tok, "lip")) {
+			if (inet_pton(AF_INET, v, &req->nvr_local_ip) != 1)
+				goto bad;
+		} else if (!strcmp(tok, "rip")) {
+			if (inet_pton(AF_INET, v, &req->nvr_remote_ip) != 1)
+				goto bad;
+		} else if (!strcmp(tok, "lmac")) {
+			if (parse_mac(v, req->nvr_local_mac))
+				goto bad;
+		} else if (!strcmp(tok, "rmac")) {
+			if (parse_mac(v, req->nvr_remote_mac))
+				goto bad;
+		} else
+			goto bad;
+	}
+	free(w);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCBDGCONF, &ifr);
+	if (error == -1) {
+		perror(ifr.nifr_name);
+	} else if (req->nvr_cmd == NM_VTEP_GET) {
+		inet_ntop(AF_INET, &req->nvr_local_ip, a, sizeof(a));
+		inet_ntop(AF_INET, &req->nvr_remote_ip, b, sizeof(b));
+		D("%s: vni %u %s -> %s udp %u", ifr.nifr_name, req->nvr_vni,
+		    a, b, ntohs(req->nvr_udp_port));
+		D("%s: tx %" PRIu64 " rx %" PRIu64 " tx_drop %" PRIu64
+		    " rx_drop %" PRIu64, ifr.nifr_name, req->nvr_tx,
+		    req->nvr_rx, req->nvr_tx_drop, req->nvr_rx_drop);
+	}
+	close(fd);
+	return error;
+
+bad:
+	D("invalid tunnel option %s", tok);
+	free(w);
+	return -1;
+}
+
+/*
+ * -L port[,id|,off|,up|,down]
+ * add a port to a link aggregation group, remove it, set it up or down,
+ * or show its group
+ */
+static int
+lag_ctl(const char *spec)
+{
+	struct nm_ifreq ifr;
+	struct nm_lag_req *req = (struct nm_lag_req *)ifr.data;
+	char *w = strdup(spec), *tok;
+	int fd, error = 0, i;
+
+	bzero(&ifr, sizeof(ifr));
+	tok = strtok(w, ",");
+	strncpy(ifr.nifr_name, tok, sizeof(ifr.nifr_name) - 1);
+	req->nlr_cmd = NM_LAG_GET;
+	tok = strtok(NULL, ",");
+	if (tok != NULL) {
+		if (!strcmp(tok, "off")) {
+			req->nlr_cmd = NM_LAG_REMOVE;
+		} else if (!strcmp(tok, "up")) {
+			req->nlr_cmd = NM_LAG_UP;
+		} else if (!strcmp(tok, "down")) {
+			req->nlr_cmd = NM_LAG_DOWN;
+		} else if (isdigit((unsigned char)tok[0])) {
+			req->nlr_cmd = NM_LAG_ADD;
+			req->nlr_id = atoi(tok);
+		} else {
+			D("invalid LAG option %s", tok);
+			free(w);
+			return -1;
+		}
+	}
+	free(w);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCBDGCONF, &ifr);
+	if (error == -1) {
+		perror(ifr.nifr_name);
+	} else if (req->nlr_cmd == NM_LAG_GET) {
+		D("%s: LAG %d, %d members", ifr.nifr_name, req->nlr_id,
+		    req->nlr_count);
+		for (i = 0; i < req->nlr_count && i < NM_LAG_MAXMEMBERS; i++) {
+			struct nm_lag_member *m = &req->nlr_members[i];
+
+			D("  %s port %d %s tx %" PRIu64, m->name, m->port,
+			    m->up ? "up" : "down", m->tx);
+		}
+	}
+	close(fd);
+	return error;
+}
+
+/*
+ * -M switch[,on|,off] or -M port,router|,norouter
+ * show the multicast groups of a switch, enable or disable IGMP/MLD
+ * snooping, or set a static multicast router port
+ */
+static int
+mcast_ctl(const char *spec)
+{
+	struct nm_ifreq ifr;
+	struct nm_mcast_req *req = (struct nm_mcast_req *)ifr.data;
+	char *w = strdup(spec), *tok;
+	int fd, error = 0, i;
+
+	bzero(&ifr, sizeof(ifr));
+	tok = strtok(w, ",");
+	strncpy(ifr.nifr_name, tok, sizeof(ifr.nifr_name) - 1);
+	req->nmc_cmd = NM_MCAST_GET;
+	tok = strtok(NULL, ",");
+	if (tok != NULL) {
+		if (!strcmp(tok, "on")) {
+			req->nmc_cmd = NM_MCAST_ON;
+		} else if (!strcmp(tok, "off")) {
+			req->nmc_cmd = NM_MCAST_OFF;
+		} else if (!strcmp(tok, "router")) {
+			req->nmc_cmd = NM_MCAST_ROUTER;
+			req->nmc_arg = 1;
+		} else if (!strcmp(tok, "norouter")) {
+			req->nmc_cmd = NM_MCAST_ROUTER;
+		} else {
+			D("invalid multicast option %s", tok);
+			free(w);
+			return -1;
+		}
+	}
+	free(w);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	for (;;) {
+		error = ioctl(fd, NIOCBDGCONF, &ifr);
+		if (error == -1) {
+			perror(ifr.nifr_name);
+			break;
+		}
+		if (req->nmc_cmd != NM_MCAST_GET)
+			break;
+		if (req->nmc_arg == 0)
+			D("%s: %" PRIu64 " reports %" PRIu64 " queries",
+			    ifr.nifr_name, req->nmc_reports, req->nmc_queries);
+		for (i = 0; i < req->nmc_count && i < NM_MCAST_REQ_GROUPS; i++) {
+			struct nm_mcast_group *g = &req->nmc_groups[i];
+
+			D("  %02x:%02x:%02x:%02x:%02x:%02x %d ports",
+			    g->mac[0], g->mac[1], g->mac[2], g->mac[3],
+			    g->mac[4], g->mac[5], g->nports);
+		}
+		if (req->nmc_next == 0)
+			break;
+		req->nmc_arg = req->nmc_next;
+	}
+	close(fd);
+	return error;
+}
+
+/*
+ * -N bridge[,on|,off]
+ * show the ARP/ND bindings of a switch, enable or disable suppression
+ */
+static int
+arp_ctl(const char *spec)
+{
+	struct nm_ifreq ifr;
+	struct nm_arp_req *req = (struct nm_arp_req *)ifr.data;
+	char *w = strdup(spec), *tok;
+	int fd, error = 0, i;
+
+	bzero(&ifr, sizeof(ifr));
+	tok = strtok(w, ",");
+	strncpy(ifr.nifr_name, tok, sizeof(ifr.nifr_name) - 1);
+	req->nar_cmd = NM_ARP_GET;
+	tok = strtok(NULL, ",");
+	if (tok != NULL) {
+		if (!strcmp(tok, "on")) {
+			req->nar_cmd = NM_ARP_ON;
+		} else if (!strcmp(tok, "off")) {
+			req->nar_cmd = NM_ARP_OFF;
+		} else {
+			D("invalid ARP option %s", tok);
+			free(w);
+			return -1;
+		}
+	}
+	free(w);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	for (;;) {
+		error = ioctl(fd, NIOCBDGCONF, &ifr);
+		if (error == -1) {
+			perror(ifr.nifr_name);
+			break;
+		}
+		if (req->nar_cmd != NM_ARP_GET)
+			break;
+		if (req->nar_arg == 0)
+			D("%s: %" PRIu64 " replies %" PRIu64 " learned",
+			    ifr.nifr_name, req->nar_replies, req->nar_learned);
+		for (i = 0; i < req->nar_count && i < NM_ARP_REQ_BINDINGS; i++) {
+			struct nm_arp_binding *e = &req->nar_bindings[i];
+			static const uint8_t v4[12] = { [10] = 0xff, [11] = 0xff };
+			char ip[INET6_ADDRSTRLEN];
+
+			if (!memcmp(e->ip, v4, sizeof(v4)))
+				inet_ntop(AF_INET, e->ip + 12, ip, sizeof(ip));
+			else
+				inet_ntop(AF_INET6, e->ip, ip, sizeof(ip));
+			D("  %s %02x:%02x:%02x:%02x:%02x:%02x port %d age %ds",
+			    ip, e->mac[0], e->mac[1], e->mac[2], e->mac[3],
+			    e->mac[4], e->mac[5], e->port, e->age);
+		}
+		if (req->nar_next == 0)
+			break;
+		req->nar_arg = req->nar_next;
+	}
+	close(fd);
+	return error;
+}
+
+/*
+ * -B interface[,source|,sink|,stop][,len=N,pps=N,smac=MAC,dmac=MAC,
+ *    sip=IP,dip=IP,nsrc=N,ndst=N]
+ * create an in-kernel source or sink port, destroy it, or show its
+ * counters and the cost per packet
+ */
+static int
+bench_ctl(const char *spec)
+{
+	struct nm_ifreq ifr;
+	struct nm_bench_req *req = (struct nm_bench_req *)ifr.data;
+	char *w = strdup(spec), *tok;
+	int fd, error = 0;
+
+	bzero(&ifr, sizeof(ifr));
+	tok = strtok(w, ",");
+	strncpy(ifr.nifr_name, tok, sizeof(ifr.nifr_name) - 1);
+	req->nbr_cmd = NM_BENCH_GET;
+	/* defaults for a source, broadcast from 10.0.0.1 to 10.0.0.2 */
+	parse_mac("02:00:00:00:00:01", req->nbr_src_mac);
+	parse_mac("ff:ff:ff:ff:ff:ff", req->nbr_dst_mac);
+	inet_pton(AF_INET, "10.0.0.1", &req->nbr_src_ip);
+	inet_pton(AF_INET, "10.0.0.2", &req->nbr_dst_ip);
+	while ((tok = strtok(NULL, ",")) != NULL) {
+		char *v = strchr(tok, '=');
+
+		if (!strcmp(tok, "source")) {
+			req->nbr_cmd = NM_BENCH_SOURCE;
+			continue;
+		} else if (!strcmp(tok, "sink")) {
+			req->nbr_cmd = NM_BENCH_SINK;
+			continue;
+		} else if (!strcmp(tok, "stop")) {
+			req->nbr_cmd = NM_BENCH_STOP;
+			continue;
+		}
+		if (v == NULL)
+			goto bad;
+		*v++ = '\0';
+		if (!strcmp(tok, "len"))
+			req->nbr_len = atoi(v);
+		else if (!strcmp(tok, "pps"))
+			req->nbr_pps = strtoull(v, NULL, 0);
+		else if (!strcmp(tok, "nsrc"))
+			req->nbr_nsrc = atoi(v);
+		else if (!strcmp(tok, "ndst"))
+			req->nbr_ndst = atoi(v);
+		else if (!strcmp(tok, "sip")) {
+			if (inet_pton(AF_INET, v, &req->nbr_src_ip) != 1)
+				goto bad;
+		} else if (!strcmp(tok, "dip")) {
+			if (inet_pton(AF_INET, v, &req->nbr_dst_ip) != 1)
+				goto bad;
+		} else if (!strcmp(tok, "smac")) {
+			if (parse_mac(v, req->nbr_src_mac))
+				goto bad;
+		} else if (!strcmp(tok, "dmac")) {
+			if (parse_mac(v, req->nbr_dst_mac))
+				goto bad;
+		} else
+			goto bad;
+	}
+	free(w);
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCBDGCONF, &ifr);
+	if (error == -1) {
+		perror(ifr.nifr_name);
+	} else if (req->nbr_cmd == NM_BENCH_GET ||
+	    req->nbr_cmd == NM_BENCH_STOP) {
+		double secs = req->nbr_elapsed / 1e9;
+
+		D("%s: %s len %u pps %" PRIu64 " up %.3fs", ifr.nifr_name,
+		    req->nbr_mode == NM_BENCH_SOURCE ? "source" : "sink",
+		    req->nbr_len, req->nbr_pps, secs);
+		D("%s: %" PRIu64 " packets %" PRIu64 " bytes %.1f ns/packet",
+		    ifr.nifr_name, req->nbr_packets, req->nbr_bytes,
+		    req->nbr_packets ?
+		    (double)req->nbr_ns / req->nbr_packets : 0.0);
+	}
+	close(fd);
+	return error;
+
+bad:
+	D("invalid benchmark option %s", tok);
+	free(w);
+	return -1;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -189,11 +652,35 @@ usage:
 			"\t-r interface	interface name to be deleted\n"
 			"\t-l list all or specified bridge's interfaces (default)\n"
 			"\t-C string ring/slot setting of an interface creating by -n\n"
+			"\t   (txd[,rxd[,txr[,rxr[,memid]]]], memid shares a region)\n"
+			"\t-p interface:param[=value] get or set a port parameter\n"
+			"\t   (latency: batch latency budget in us, batch: current batch,\n"
+			"\t   budget: NIC worker slots per poll, wakeups|polls|slots|exhausted:\n"
+			"\t   NIC worker counters, txthresh|txdelay: NIC doorbell after\n"
+			"\t   slots or us, doorbells|deferred|txtimer: NIC doorbell counters,\n"
+			"\t   scan|lookup|lease|copy|done|notify: cycles per packet in each\n"
+			"\t   forwarding phase, with --enable-vale-prof, =0 clears them,\n"
+			"\t   mem: memory used by the port in KB)\n"
+			"\t-T interface[,off|,vni=N,lip=IP,lmac=MAC,rip=IP,rmac=MAC[,udp=PORT]]\n"
+			"\t   show, remove or set a VXLAN tunnel endpoint\n"
+			"\t-L interface[,ID|,off|,up|,down]\n"
+			"\t   show the link aggregation group of a port, add the port\n"
+			"\t   to group ID, remove it, or set it up or down\n"
+			"\t-M bridge[,on|,off] or -M interface,router|,norouter\n"
+			"\t   show the multicast groups, enable or disable IGMP/MLD\n"
+			"\t   snooping, or set a static multicast router port\n"
+			"\t-N bridge[,on|,off]\n"
+			"\t   show the ARP/ND bindings, enable or disable ARP/ND\n"
+			"\t   suppression\n"
+			"\t-B interface[,source|,sink|,stop][,len=N,pps=N,smac=MAC,\n"
+			"\t   dmac=MAC,sip=IP,dip=IP,nsrc=N,ndst=N]\n"
+			"\t   create an in-kernel traffic source or sink port, destroy\n"
+			"\t   it, or show its counters and ns/packet\n"
 			"", command);
 		return 0;
 	}
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:T:L:M:N:B:")) != -1) {
 		name = optarg; /* default */
 		switch (ch) {
 		default:
@@ -226,6 +713,25 @@ usage:
 		case 'C':
 			nmr_config = strdup(optarg);
 			break;
+		case 'p':
+			/* the parameter follows the last ':' */
+			nr_cmd = NETMAP_BDG_SETPARAM;
+			name = strdup(optarg);
+			nmr_config = strrchr(name, ':');
+			if (nmr_config == NULL || nmr_config == name)
+				goto usage;
+			*nmr_config++ = '\0';
+			break;
+		case 'T':
+			return vtep_ctl(optarg) ? 1 : 0;
+		case 'L':
+			return lag_ctl(optarg) ? 1 : 0;
+		case 'M':
+			return mcast_ctl(optarg) ? 1 : 0;
+		case 'N':
+			return arp_ctl(optarg) ? 1 : 0;
+		case 'B':
+			return bench_ctl(optarg) ? 1 : 0;
 		}
 		if (optind != argc) {
 			// fprintf(stderr, "optind %d argc %d\n", optind, argc);
@@ -509,6 +509,14 @@ int netmap_generic_mit = 100*1000;   /* Generic mitigation interval in nanosecon
 int netmap_generic_ringsize = 1024;   /* Generic ringsize. */
 int netmap_generic_rings = 1;   /* number of queues in generic. */
 
+/*
+ * Populate the whole mapping in mmap() instead of on the first access
+ * to each page (linux only). The time spent in the last populate is
+ * exported in netmap_mmap_prefault_us.
+ */
+int netmap_mmap_prefault = 0;
+int netmap_mmap_prefault_us = 0;
+
 /*
  * SYSCTL calls are grouped between SYSBEGIN and SYSEND to be emulated
  * in some other operating systems
@@ -535,6 +543,10 @@ SYSCTL_INT(_dev_netmap, OID_AUTO, admode, CTLFLAG_RW, &netmap_admode, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_mit, CTLFLAG_RW, &netmap_generic_mit, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_ringsize, CTLFLAG_RW, &netmap_generic_ringsize, 0 , "");
 SYSCTL_INT(_dev_netmap, OID_AUTO, generic_rings, CTLFLAG_RW, &netmap_generic_rings, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, mmap_prefault, CTLFLAG_RW,
+    &netmap_mmap_prefault, 0 , "Map all pages of the region in mmap()");
+SYSCTL_INT(_dev_netmap, OID_AUTO, mmap_prefault_us, CTLFLAG_RD,
+    &netmap_mmap_prefault_us, 0 , "Duration of the last mmap() populate");
 
 SYSEND;
 
@@ -896,6 +908,7 @@ netmap_hw_krings_delete(struct netmap_adapter *na)
 /* call with NMG_LOCK held */
 static void netmap_unset_ringid(struct netmap_priv_d *);
 static void netmap_rel_exclusive(struct netmap_priv_d *);
+static void netmap_unset_mem(struct netmap_adapter *);
 static void
 netmap_do_unregif(struct netmap_priv_d *priv)
 {
@@ -946,6 +959,8 @@ netmap_do_unregif(struct netmap_priv_d *priv)
 	netmap_mem_if_delete(na, priv->np_nifp);
 	/* drop the allocator */
 	netmap_mem_deref(na->nm_mem, na);
+	/* the last instance goes back to its own region */
+	netmap_unset_mem(na);
 	/* mark the priv as unregistered */
 	priv->np_na = NULL;
 	priv->np_nifp = NULL;
@@ -1438,6 +1453,55 @@ out:
 }
 
 
+/*
+ * Called on NIOCREGIF. Move an adapter that is not in use to the
+ * memory region nmr->nr_arg2, if any, so that it can exchange
+ * buffers with the other ports there. Adapters that cannot move
+ * (in use, with pipes, pipe or monitor endpoints, or owning their
+ * memory) keep their region: the id returned in nr_arg2 tells.
+ * The move lasts while the adapter is in use: netmap_unset_mem()
+ * undoes it if the registration fails or when the last file goes.
+ */
+static int
+netmap_set_mem(struct netmap_adapter *na, struct nmreq *nmr)
+{
+	struct netmap_mem_d *nmd;
+	u_int reg = nmr->nr_flags & NR_REG_MASK;
+
+	if (nmr->nr_arg2 == 0 ||
+	    nmr->nr_arg2 == netmap_mem_get_id(na->nm_mem))
+		return 0;
+	if ((na->na_flags & NAF_MEM_OWNER) || na->active_fds > 0 ||
+	    nm_netmap_on(na) || na->na_next_pipe > 0 ||
+	    reg == NR_REG_PIPE_MASTER || reg == NR_REG_PIPE_SLAVE ||
+	    (nmr->nr_flags & (NR_MONITOR_TX | NR_MONITOR_RX)))
+		return 0;
+	nmd = netmap_mem_find(nmr->nr_arg2);
+	if (nmd == NULL)
+		return EINVAL;
+	ND("%s: region %d -> %d", na->name,
+		netmap_mem_get_id(na->nm_mem), nmr->nr_arg2);
+	na->nm_mem_prev = na->nm_mem; /* keeps its reference */
+	na->nm_mem = nmd; /* keeps the netmap_mem_find() reference */
+	return 0;
+}
+
+
+/* back to the region the adapter had before netmap_set_mem() */
+static void
+netmap_unset_mem(struct netmap_adapter *na)
+{
+	if (na->nm_mem_prev == NULL || na->active_fds > 0)
+		return;
+	ND("%s: region %d -> %d", na->name,
+		netmap_mem_get_id(na->nm_mem),
+		netmap_mem_get_id(na->nm_mem_prev));
+	netmap_mem_put(na->nm_mem);
+	na->nm_mem = na->nm_mem_prev;
+	na->nm_mem_prev = NULL;
+}
+
+
 /*
  * validate parameters on entry for *_txsync()
  * Returns ring->cur if ok, or something >= kring->nkr_num_slots
@@ -1932,9 +1996,20 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 	uint16_t ringid, uint32_t flags)
 {
 	struct netmap_if *nifp = NULL;
+	u_int bufclass = (flags & NR_BUF_CLASS1) ? 1 : 0;
 	int error;
 
 	NMG_LOCK_ASSERT();
+	/* the first registration chooses the buffer class, later
+	 * ones (and those of ports inheriting it) must ask for the
+	 * one in use, with or without NR_BUF_CLASS1 */
+	if (na->active_fds == 0 && !(na->na_flags & NAF_BUFCLASS_FIXED)) {
+		na->na_bufclass = bufclass;
+	} else if (na->na_bufclass != bufclass) {
+		D("%s: buffer class %u already in use", na->name,
+			na->na_bufclass);
+		return EBUSY;
+	}
 	/* ring configuration may have changed, fetch from the card */
 	netmap_update_config(na);
 	priv->np_na = na;     /* store the reference */
@@ -1986,7 +2061,8 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		 * and make it use the shared buffers.
 		 */
 		/* cache the allocator info in the na */
-		error = netmap_mem_get_lut(na->nm_mem, &na->na_lut);
+		error = netmap_mem_get_lut(na->nm_mem, &na->na_lut,
+				na->na_bufclass);
 		if (error)
 			goto err_del_if;
 		D("lut %p bufs %u size %u", na->na_lut.lut, na->na_lut.objtotal,
@@ -2102,7 +2178,8 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 
 	switch (cmd) {
 	case NIOCGINFO:		/* return capabilities etc */
-		if (nmr->nr_cmd == NETMAP_BDG_LIST) {
+		if (nmr->nr_cmd == NETMAP_BDG_LIST ||
+		    nmr->nr_cmd == NETMAP_BDG_GETPARAM) {
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
 		}
@@ -2119,12 +2196,28 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				if (error)
 					break;
 				nmd = na->nm_mem; /* get memory allocator */
+			} else if (nmr->nr_arg2 != 0) {
+				/* info on the region with that id, if any,
+				 * otherwise on the global one as usual
+				 */
+				struct netmap_mem_d *r = netmap_mem_find(nmr->nr_arg2);
+
+				if (r != NULL) {
+					error = netmap_mem_get_info(r,
+						&nmr->nr_memsize, &memflags,
+						&nmr->nr_arg2);
+					nmr->nr_numa =
+						netmap_mem_get_numa_node(r) + 1;
+					netmap_mem_put(r);
+					break;
+				}
 			}
 
 			error = netmap_mem_get_info(nmd, &nmr->nr_memsize, &memflags,
 				&nmr->nr_arg2);
 			if (error)
 				break;
+			nmr->nr_numa = netmap_mem_get_numa_node(nmd) + 1;
 			if (na == NULL) /* only memory info */
 				break;
 			nmr->nr_offset = 0;
@@ -2144,6 +2237,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 		i = nmr->nr_cmd;
 		if (i == NETMAP_BDG_ATTACH || i == NETMAP_BDG_DETACH
 				|| i == NETMAP_BDG_VNET_HDR
+				|| i == NETMAP_BDG_SETPARAM
 				|| i == NETMAP_BDG_NEWIF
 				|| i == NETMAP_BDG_DELIF) {
 			error = netmap_bdg_ctl(nmr, NULL);
@@ -2175,8 +2269,14 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				error = EBUSY;
 				break;
 			}
+			error = netmap_set_mem(na, nmr);
+			if (error) {
+				netmap_adapter_put(na);
+				break;
+			}
 			error = netmap_do_regif(priv, na, nmr->nr_ringid, nmr->nr_flags);
 			if (error) {    /* reg. failed, release priv and ref */
+				netmap_unset_mem(na);
 				netmap_adapter_put(na);
 				break;
 			}
@@ -2195,6 +2295,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				netmap_adapter_put(na);
 				break;
 			}
+			nmr->nr_numa = netmap_mem_get_numa_node(na->nm_mem) + 1;
 			if (memflags & NETMAP_MEM_PRIVATE) {
 				*(uint32_t *)(uintptr_t)&nifp->ni_flags |= NI_PRIV_MEM;
 			}
@@ -2280,6 +2381,10 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 	case NIOCCONFIG:
 		error = netmap_bdg_config(nmr);
 		break;
+
+	case NIOCBDGCONF:
+		error = netmap_bdg_svc_config(nmr, priv);
+		break;
 #endif
 #ifdef __FreeBSD__
 	case FIONBIO:
@@ -2658,8 +2763,8 @@ netmap_attach_common(struct netmap_adapter *na)
 	na->active_fds = 0;
 
 	if (na->nm_mem == NULL)
-		/* use the global allocator */
-		na->nm_mem = &nm_mem;
+		/* use the global allocator (of the device NUMA node) */
+		na->nm_mem = netmap_mem_global_node(nm_numa_node(na->pdev));
 	netmap_mem_get(na->nm_mem);
 #ifdef WITH_VALE
 	if (na->nm_bdg_attach == NULL)
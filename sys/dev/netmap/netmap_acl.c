@@ -0,0 +1,544 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * ACL classifier for VALE ports.
+ *
+ * This is a netmap_bdg_ops module: lookup() classifies the packets
+ * sent by a port against the rules of that port, drops the ones
+ * that hit a DROP rule and hands the others to netmap_bdg_learning().
+ * NM_ACL_ON (NIOCBDGCONF) plugs it into a plain learning bridge, and
+ * the rules are then loaded with NIOCCONFIG, see struct nm_acl_req
+ * in net/netmap.h for the commands.
+ *
+ * Rules are compiled into a tuple space: rules with the same
+ * (src mask, dst mask, exact proto, exact sport, exact dport)
+ * signature go into the same hash table, keyed on the masked
+ * addresses and on the exact fields. Port ranges and wildcards
+ * are not part of the key and are checked on the entries of the
+ * bucket. A packet costs one hash probe per tuple, independently
+ * of the number of rules. Tuples are sorted by the best (lowest)
+ * rule index they contain, so the search stops as soon as no
+ * remaining tuple can beat the current match.
+ *
+ * config() runs with NMG_LOCK() held and the bridge write-locked
+ * (netmap_bdg_config() treats it apart from other config()
+ * callbacks, which get the read lock), so a commit just replaces
+ * the compiled table of the port and frees the old one.
+ * Hit counters are plain per-table counters. They are not updated
+ * atomically, so they may undercount when several rings of the
+ * same port transmit concurrently.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_ACL_NONE	0xffffffffU	/* end of chain, no match */
+
+/* a rule in the hash table of its tuple */
+struct nm_acl_ent {
+	uint32_t	src, dst;	/* masked, network order */
+	uint16_t	sport_lo, sport_hi;
+	uint16_t	dport_lo, dport_hi;
+	uint8_t		proto;
+	uint8_t		action;
+	uint32_t	rule;		/* index in the rule set */
+	uint32_t	next;		/* next entry in the bucket */
+};
+
+struct nm_acl_tuple {
+	uint32_t	src_mask, dst_mask;
+	uint8_t		proto_exact, sport_exact, dport_exact;
+	uint32_t	min_rule;	/* best rule in this tuple */
+	uint32_t	nents;
+	uint32_t	hmask;		/* number of buckets - 1 */
+	uint32_t	*buckets;	/* first entry of each bucket */
+	struct nm_acl_ent *ents;
+};
+
+/* a compiled rule set */
+struct nm_acl_table {
+	uint32_t	nrules;
+	uint32_t	ntuples;
+	uint8_t		def_action;
+	struct nm_acl_tuple *tuples;	/* sorted by min_rule */
+	uint64_t	*hits;		/* nrules + 1 (default) */
+};
+
+/* per-port state, hangs from netmap_vp_adapter */
+struct nm_acl {
+	struct nm_acl_table *cur;	/* active set, or NULL */
+
+	/* staging set, filled by NM_ACL_BEGIN/NM_ACL_ADD */
+	struct nm_acl_rule *staging;
+	uint32_t	nstaged;
+	uint32_t	staging_size;
+	uint8_t		staging_def;
+};
+
+
+static inline uint32_t
+nm_acl_hash(uint32_t src, uint32_t dst, uint8_t proto,
+	uint16_t sport, uint16_t dport)
+{
+	uint32_t h = src * 0x9e3779b1U;
+
+	h ^= dst + 0x7f4a7c15U + (h << 6) + (h >> 2);
+	h ^= ((uint32_t)sport << 16 | dport) + (h << 6) + (h >> 2);
+	h ^= proto;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	return h;
+}
+
+
+static void
+nm_acl_table_free(struct nm_acl_table *t)
+{
+	u_int i;
+
+	if (t == NULL)
+		return;
+	if (t->tuples) {
+		for (i = 0; i < t->ntuples; i++) {
+			if (t->tuples[i].buckets)
+				free(t->tuples[i].buckets, M_DEVBUF);
+		}
+		free(t->tuples, M_DEVBUF);
+	}
+	if (t->hits)
+		free(t->hits, M_DEVBUF);
+	free(t, M_DEVBUF);
+}
+
+
+static inline int
+nm_acl_same_tuple(const struct nm_acl_tuple *tp, const struct nm_acl_rule *r)
+{
+	return tp->src_mask == r->src_mask && tp->dst_mask == r->dst_mask &&
+		tp->proto_exact == (r->proto != 0) &&
+		tp->sport_exact == (r->sport_lo == r->sport_hi) &&
+		tp->dport_exact == (r->dport_lo == r->dport_hi);
+}
+
+
+/* check that the mask is a prefix, e.g. 255.255.240.0 */
+static inline int
+nm_acl_valid_mask(uint32_t mask)
+{
+	uint32_t m = ~be32toh(mask);
+
+	return (m & (m + 1)) == 0;
+}
+
+
+/*
+ * Compile the rules into a new table.
+ * Returns NULL on allocation failure.
+ */
+static struct nm_acl_table *
+nm_acl_compile(const struct nm_acl_rule *rules, u_int n, uint8_t def_action)
+{
+	struct nm_acl_table *t;
+	uint32_t *tid = NULL;	/* tuple of each rule */
+	u_int i, j;
+
+	t = malloc(sizeof(*t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return NULL;
+	t->nrules = n;
+	t->def_action = def_action;
+	t->hits = malloc(sizeof(uint64_t) * (n + 1), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t->hits == NULL)
+		goto fail;
+	if (n == 0)
+		return t;
+
+	/* first pass: find the tuples. There are at most n of them */
+	tid = malloc(sizeof(uint32_t) * n, M_DEVBUF, M_NOWAIT | M_ZERO);
+	t->tuples = malloc(sizeof(struct nm_acl_tuple) * n, M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	if (tid == NULL || t->tuples == NULL)
+		goto fail;
+	for (i = 0; i < n; i++) {
+		const struct nm_acl_rule *r = rules + i;
+		struct nm_acl_tuple *tp;
+
+		for (j = 0; j < t->ntuples; j++) {
+			if (nm_acl_same_tuple(t->tuples + j, r))
+				break;
+		}
+		tp = t->tuples + j;
+		if (j == t->ntuples) {	/* new tuple */
+			t->ntuples++;
+			tp->src_mask = r->src_mask;
+			tp->dst_mask = r->dst_mask;
+			tp->proto_exact = (r->proto != 0);
+			tp->sport_exact = (r->sport_lo == r->sport_hi);
+			tp->dport_exact = (r->dport_lo == r->dport_hi);
+			tp->min_rule = i;
+		}
+		tp->nents++;
+		tid[i] = j;
+	}
+
+	/* allocate the hash tables, with at least twice as many
+	 * buckets as entries
+	 */
+	for (j = 0; j < t->ntuples; j++) {
+		struct nm_acl_tuple *tp = t->tuples + j;
+		u_int nb = 2, l;
+
+		while (nb < 2 * tp->nents)
+			nb <<= 1;
+		l = sizeof(uint32_t) * nb + sizeof(struct nm_acl_ent) * tp->nents;
+		tp->buckets = malloc(l, M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (tp->buckets == NULL)
+			goto fail;
+		tp->hmask = nb - 1;
+		tp->ents = (struct nm_acl_ent *)(tp->buckets + nb);
+		for (i = 0; i < nb; i++)
+			tp->buckets[i] = NM_ACL_NONE;
+		tp->nents = 0;	/* recomputed below */
+	}
+
+	/* second pass: insert the rules from the last one, so that
+	 * each chain is sorted by rule index
+	 */
+	for (i = n; i-- > 0; ) {
+		const struct nm_acl_rule *r = rules + i;
+		struct nm_acl_tuple *tp = t->tuples + tid[i];
+		struct nm_acl_ent *e = tp->ents + tp->nents;
+		uint32_t h;
+
+		e->src = r->src & r->src_mask;
+		e->dst = r->dst & r->dst_mask;
+		e->proto = r->proto;
+		e->sport_lo = r->sport_lo;
+		e->sport_hi = r->sport_hi;
+		e->dport_lo = r->dport_lo;
+		e->dport_hi = r->dport_hi;
+		e->action = r->action;
+		e->rule = i;
+		h = nm_acl_hash(e->src, e->dst, tp->proto_exact ? e->proto : 0,
+			tp->sport_exact ? e->sport_lo : 0,
+			tp->dport_exact ? e->dport_lo : 0) & tp->hmask;
+		e->next = tp->buckets[h];
+		tp->buckets[h] = tp->nents++;
+	}
+
+	/* sort the tuples by min_rule (insertion sort, they are few) */
+	for (i = 1; i < t->ntuples; i++) {
+		struct nm_acl_tuple x = t->tuples[i];
+
+		for (j = i; j > 0 && t->tuples[j - 1].min_rule > x.min_rule; j--)
+			t->tuples[j] = t->tuples[j - 1];
+		t->tuples[j] = x;
+	}
+	free(tid, M_DEVBUF);
+	return t;
+
+fail:
+	if (tid)
+		free(tid, M_DEVBUF);
+	nm_acl_table_free(t);
+	return NULL;
+}
+
+
+/*
+ * Return the action for the packet in ft (IPv4 only, other
+ * packets are passed without counting).
+ */
+static u_int
+nm_acl_classify(struct nm_acl_table *t, struct nm_bdg_fwd *ft,
+	struct netmap_vp_adapter *na)
+{
+	uint8_t *buf = ft->ft_buf;
+	u_int buf_len = ft->ft_len;
+	struct nm_iphdr *iph;
+	uint32_t src, dst, best = NM_ACL_NONE;
+	uint16_t sport = 0, dport = 0;
+	u_int i, iphlen, action = t->def_action;
+	uint8_t proto;
+
+	/* same layout checks as netmap_bdg_learning() */
+	if (buf_len >= 14 + na->virt_hdr_len) {
+		buf += na->virt_hdr_len;
+		buf_len -= na->virt_hdr_len;
+	} else if (buf_len == na->virt_hdr_len && ft->ft_flags & NS_MOREFRAG) {
+		ft++;
+		buf = ft->ft_buf;
+		buf_len = ft->ft_len;
+	} else {
+		return NM_ACL_PASS;
+	}
+	if (buf_len < 14 + sizeof(*iph) ||
+	    be16toh(*(uint16_t *)(buf + 12)) != 0x0800)
+		return NM_ACL_PASS;
+	iph = (struct nm_iphdr *)(buf + 14);
+	iphlen = (iph->version_ihl & 0x0f) << 2;
+	src = iph->saddr;
+	dst = iph->daddr;
+	proto = iph->protocol;
+	/* ports are only valid in the first fragment */
+	if ((proto == 6 || proto == 17 || proto == 132) &&
+	    (be16toh(iph->frag_off) & 0x1fff) == 0 &&
+	    buf_len >= 14 + iphlen + 4) {
+		uint16_t *p = (uint16_t *)(buf + 14 + iphlen);
+
+		sport = be16toh(p[0]);
+		dport = be16toh(p[1]);
+	}
+
+	for (i = 0; i < t->ntuples; i++) {
+		struct nm_acl_tuple *tp = t->tuples + i;
+		uint32_t h, e;
+
+		if (tp->min_rule >= best)
+			break;	/* no better match possible */
+		h = nm_acl_hash(src & tp->src_mask, dst & tp->dst_mask,
+			tp->proto_exact ? proto : 0,
+			tp->sport_exact ? sport : 0,
+			tp->dport_exact ? dport : 0) & tp->hmask;
+		for (e = tp->buckets[h]; e != NM_ACL_NONE; e = tp->ents[e].next) {
+			struct nm_acl_ent *ent = tp->ents + e;
+
+			if (ent->rule >= best)
+				break;	/* chains are sorted */
+			if (ent->src != (src & tp->src_mask) ||
+			    ent->dst != (dst & tp->dst_mask) ||
+			    (ent->proto && ent->proto != proto) ||
+			    sport < ent->sport_lo || sport > ent->sport_hi ||
+			    dport < ent->dport_lo || dport > ent->dport_hi)
+				continue;
+			best = ent->rule;
+			action = ent->action;
+			break;
+		}
+	}
+	t->hits[best == NM_ACL_NONE ? t->nrules : best]++;
+	return action;
+}
+
+
+/* lookup callback: filter, then learn and forward */
+static u_int
+netmap_acl_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na)
+{
+	struct nm_acl *acl = na->acl;
+
+	if (acl != NULL && acl->cur != NULL &&
+	    nm_acl_classify(acl->cur, ft, na) == NM_ACL_DROP)
+		return NM_BDG_NOPORT;
+	return netmap_bdg_learning(ft, dst_ring, na);
+}
+
+
+static void
+nm_acl_staging_free(struct nm_acl *acl)
+{
+	if (acl->staging)
+		free(acl->staging, M_DEVBUF);
+	acl->staging = NULL;
+	acl->nstaged = acl->staging_size = 0;
+}
+
+
+/* append rules to the staging set, growing it as needed */
+static int
+nm_acl_stage(struct nm_acl *acl, const struct nm_acl_rule *r, u_int n)
+{
+	u_int i;
+
+	if (acl->nstaged + n > NM_ACL_MAXRULES)
+		return ENOSPC;
+	for (i = 0; i < n; i++) {
+		if ((r[i].action != NM_ACL_PASS && r[i].action != NM_ACL_DROP) ||
+		    r[i].sport_lo > r[i].sport_hi ||
+		    r[i].dport_lo > r[i].dport_hi ||
+		    !nm_acl_valid_mask(r[i].src_mask) ||
+		    !nm_acl_valid_mask(r[i].dst_mask))
+			return EINVAL;
+	}
+	if (acl->nstaged + n > acl->staging_size) {
+		u_int sz = acl->staging_size ? acl->staging_size : 64;
+		struct nm_acl_rule *s;
+
+		while (sz < acl->nstaged + n)
+			sz *= 2;
+		s = malloc(sizeof(*s) * sz, M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (s == NULL)
+			return ENOMEM;
+		if (acl->staging) {
+			memcpy(s, acl->staging, sizeof(*s) * acl->nstaged);
+			free(acl->staging, M_DEVBUF);
+		}
+		acl->staging = s;
+		acl->staging_size = sz;
+	}
+	memcpy(acl->staging + acl->nstaged, r, sizeof(*r) * n);
+	acl->nstaged += n;
+	return 0;
+}
+
+
+/*
+ * config callback, invoked by netmap_bdg_config() with NMG_LOCK()
+ * held and the bridge write-locked.
+ */
+static int
+netmap_acl_config(struct nm_ifreq *ifr)
+{
+	struct nm_acl_req *req = (struct nm_acl_req *)ifr->data;
+	struct netmap_vp_adapter *vpna;
+	struct nm_acl *acl;
+	struct nm_acl_table *t;
+	u_int i;
+
+	vpna = netmap_bdg_port_byname(ifr->nifr_name);
+	if (vpna == NULL)
+		return ENXIO;
+	acl = vpna->acl;
+	if (acl == NULL) {
+		if (req->nar_cmd == NM_ACL_CLEAR || req->nar_cmd == NM_ACL_STATS)
+			return ENOENT;
+		acl = malloc(sizeof(*acl), M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (acl == NULL)
+			return ENOMEM;
+		vpna->acl = acl;
+	}
+
+	switch (req->nar_cmd) {
+	case NM_ACL_BEGIN:
+		if (req->nar_arg != NM_ACL_PASS && req->nar_arg != NM_ACL_DROP)
+			return EINVAL;
+		nm_acl_staging_free(acl);
+		acl->staging_def = req->nar_arg;
+		break;
+
+	case NM_ACL_ADD:
+		if (req->nar_count > NM_ACL_REQ_RULES)
+			return EINVAL;
+		return nm_acl_stage(acl, req->nar_u.rules, req->nar_count);
+
+	case NM_ACL_COMMIT:
+		t = nm_acl_compile(acl->staging, acl->nstaged, acl->staging_def);
+		if (t == NULL)
+			return ENOMEM;
+		/* no packets in flight, see netmap_bdg_config() */
+		nm_acl_table_free(acl->cur);
+		acl->cur = t;
+		nm_acl_staging_free(acl);
+		ND("%s: %d rules in %d tuples", vpna->up.name, t->nrules, t->ntuples);
+		req->nar_arg = t->ntuples;
+		break;
+
+	case NM_ACL_CLEAR:
+		nm_acl_table_free(acl->cur);
+		acl->cur = NULL;
+		break;
+
+	case NM_ACL_STATS:
+		t = acl->cur;
+		if (t == NULL)
+			return ENOENT;
+		if (req->nar_arg > t->nrules)
+			return EINVAL;
+		for (i = 0; i < NM_ACL_REQ_HITS && req->nar_arg + i <= t->nrules; i++)
+			req->nar_u.hits[i] = t->hits[req->nar_arg + i];
+		req->nar_count = i;
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+
+/* dtor callback, the port is leaving the bridge */
+static void
+netmap_acl_dtor(const struct netmap_vp_adapter *cvpna)
+{
+	struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)cvpna;
+	struct nm_acl *acl = vpna->acl;
+
+	if (acl == NULL)
+		return;
+	nm_acl_table_free(acl->cur);
+	nm_acl_staging_free(acl);
+	free(acl, M_DEVBUF);
+	vpna->acl = NULL;
+}
+
+
+struct netmap_bdg_ops netmap_acl_bdg_ops = {
+	.lookup = netmap_acl_lookup,
+	.config = netmap_acl_config,
+	.dtor = netmap_acl_dtor,
+};
+
+#endif /* WITH_VALE */
@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * ARP/ND suppression for VALE switches.
+ *
+ * ARP requests and IPv6 neighbor solicitations are broadcast (or
+ * multicast) frames, so on a switch with many ports each of them
+ * costs a copy into every port. With suppression enabled (NIOCBDGCONF,
+ * struct nm_arp_req) the switch keeps a table of IP to MAC bindings,
+ * learned from the ARP replies, gratuitous ARPs and neighbor
+ * advertisements that go through it. nm_bdg_flush() passes every
+ * frame to nm_arp_input(), which learns from it and, for a request
+ * on a known address, writes the reply in a buffer supplied by the
+ * caller and points the forwarding entry to it. The reply is then
+ * sent back to the requester like any unicast frame, and the request
+ * is not flooded.
+ *
+ * Only untagged frames in a single slot are handled. Requests that
+ * probe an address (ARP with a null sender, DAD solicitations) and
+ * requests for the MAC of the requester itself are flooded, so that
+ * duplicates are still detected by the owners. Bindings expire after
+ * NM_ARP_AGE seconds without a refresh, and go away when the port
+ * they were learned on leaves the switch.
+ *
+ * The table is set-associative, NM_ARP_WAYS entries per set, with
+ * the least recently refreshed entry replaced when a set is full.
+ * Lookups and updates take a spinlock, they only happen for ARP and
+ * ND frames.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_ARP_SETS		256
+#define NM_ARP_WAYS		4
+#define NM_ARP_AGE		300	/* seconds */
+/* about one second, good enough for the timeout above */
+#define NM_ARP_NOW()		((uint32_t)(nm_os_gettime_ns() >> 30))
+
+#define NM_ARP_LEN		42	/* ethernet + ARP */
+#define NM_ARP_MINLEN		60	/* replies are padded to this */
+#define NM_ND_LEN		86	/* ethernet + IPv6 + NS/NA + option */
+
+struct nm_arp_ent {
+	uint8_t		ip[16];		/* IPv4 addresses are v4-mapped */
+	uint8_t		mac[6];
+	uint8_t		valid;
+	uint8_t		router;		/* from an NA with the R flag */
+	uint16_t	port;		/* where it was learned */
+	uint32_t	last;		/* last refresh */
+};
+
+struct nm_arp {
+	NM_LOCK_T	lock;
+	uint64_t	replies;	/* requests answered */
+	uint64_t	learned;	/* bindings learned or refreshed */
+	struct nm_arp_ent ent[NM_ARP_SETS][NM_ARP_WAYS];
+};
+
+static const uint8_t nm_arp_v4mapped[12] =
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+
+static inline void
+nm_arp_key4(uint8_t *key, const uint8_t *ip)
+{
+	memcpy(key, nm_arp_v4mapped, 12);
+	memcpy(key + 12, ip, 4);
+}
+
+static inline struct nm_arp_ent *
+nm_arp_set(struct nm_arp *a, const uint8_t *key)
+{
+	/* the low bits of the address are the most variable ones */
+	uint32_t h = ((uint32_t)key[12] << 24) | (key[13] << 16) |
+		(key[14] << 8) | key[15];
+
+	h ^= ((uint32_t)key[8] << 24) | (key[9] << 16) |
+		(key[10] << 8) | key[11];
+	return a->ent[(h * 0x9e3779b1U) >> 24];
+}
+
+static inline int
+nm_arp_zero(const uint8_t *p, u_int len)
+{
+	while (len-- > 0) {
+		if (*p++)
+			return 0;
+	}
+	return 1;
+}
+
+/* valid binding for key, or NULL. Called with the lock held */
+static struct nm_arp_ent *
+nm_arp_find(struct nm_arp *a, const uint8_t *key, uint32_t now)
+{
+	struct nm_arp_ent *e = nm_arp_set(a, key);
+	u_int i;
+
+	for (i = 0; i < NM_ARP_WAYS; i++, e++) {
+		if (e->valid && !memcmp(e->ip, key, 16))
+			return now - e->last > NM_ARP_AGE ? NULL : e;
+	}
+	return NULL;
+}
+
+static void
+nm_arp_learn(struct nm_arp *a, const uint8_t *key, const uint8_t *mac,
+	u_int port, int router)
+{
+	struct nm_arp_ent *e = nm_arp_set(a, key), *victim = e;
+	uint32_t now;
+	u_int i;
+
+	/* no multicast or null MACs */
+	if ((mac[0] & 1) || nm_arp_zero(mac, 6))
+		return;
+	now = NM_ARP_NOW();
+	mtx_lock(&a->lock);
+	for (i = 0; i < NM_ARP_WAYS; i++, e++) {
+		if (e->valid && !memcmp(e->ip, key, 16)) {
+			victim = e;
+			break;
+		}
+		if (!e->valid)
+			victim = e;
+		else if (victim->valid && now - e->last > now - victim->last)
+			victim = e;
+	}
+	memcpy(victim->ip, key, 16);
+	memcpy(victim->mac, mac, 6);
+	victim->valid = 1;
+	victim->router = router;
+	victim->port = port;
+	victim->last = now;
+	a->learned++;
+	mtx_unlock(&a->lock);
+}
+
+/*
+ * Look up key for a request from src. If the binding is valid and
+ * not for src itself, copy the MAC and return 1: the caller is going
+ * to build a reply.
+ */
+static int
+nm_arp_resolve(struct nm_arp *a, const uint8_t *key, const uint8_t *src,
+	uint8_t *mac, int *router)
+{
+	struct nm_arp_ent *e;
+
+	mtx_lock(&a->lock);
+	e = nm_arp_find(a, key, NM_ARP_NOW());
+	if (e != NULL && memcmp(e->mac, src, 6)) {
+		memcpy(mac, e->mac, 6);
+		*router = e->router;
+		a->replies++;
+	} else {
+		e = NULL;
+	}
+	mtx_unlock(&a->lock);
+	return e != NULL;
+}
+
+/* one's complement sum of big endian 16 bit words */
+static uint32_t
+nm_arp_sum(const uint8_t *p, u_int len, uint32_t sum)
+{
+	for (; len > 1; p += 2, len -= 2)
+		sum += (p[0] << 8) | p[1];
+	if (len)
+		sum += p[0] << 8;
+	return sum;
+}
+
+/*
+ * ARP frame at buf: learn from replies and gratuitous ARPs,
+ * answer requests in reply. Return the reply length, or 0.
+ */
+static u_int
+nm_arp_arp(struct nm_arp *a, const uint8_t *buf, u_int len, u_int port,
+	uint8_t *reply)
+{
+	const uint8_t *arp = buf + 14, *sha = arp + 8, *spa = arp + 14,
+		*tpa = arp + 24;
+	uint8_t key[16], mac[6];
+	u_int op;
+	int router;
+
+	if (len < NM_ARP_LEN || arp[0] != 0 || arp[1] != 1 ||	/* ethernet */
+	    arp[2] != 0x08 || arp[3] != 0x00 ||			/* IPv4 */
+	    arp[4] != 6 || arp[5] != 4)
+		return 0;
+	op = (arp[6] << 8) | arp[7];
+	if (nm_arp_zero(spa, 4))
+		return 0;	/* probe */
+	if (op == 2 || (op == 1 && !memcmp(spa, tpa, 4))) {
+		/* reply or announcement */
+		nm_arp_key4(key, spa);
+		nm_arp_learn(a, key, sha, port, 0);
+		return 0;
+	}
+	if (op != 1 || reply == NULL)
+		return 0;
+	nm_arp_key4(key, tpa);
+	if (!nm_arp_resolve(a, key, sha, mac, &router))
+		return 0;
+	memcpy(reply, buf + 6, 6);		/* to the requester */
+	memcpy(reply + 6, mac, 6);
+	memcpy(reply + 12, buf + 12, 2 + 6);	/* type, hw/proto */
+	reply[20] = 0;
+	reply[21] = 2;				/* reply */
+	memcpy(reply + 22, mac, 6);		/* sha */
+	memcpy(reply + 28, tpa, 4);		/* spa */
+	memcpy(reply + 32, sha, 6);		/* tha */
+	memcpy(reply + 38, spa, 4);		/* tpa */
+	bzero(reply + NM_ARP_LEN, NM_ARP_MINLEN - NM_ARP_LEN);
+	return NM_ARP_MINLEN;
+}
+
+/*
+ * IPv6 frame at buf: learn from neighbor advertisements, answer
+ * neighbor solicitations in reply. Return the reply length, or 0.
+ */
+static u_int
+nm_arp_nd(struct nm_arp *a, const uint8_t *buf, u_int len, u_int port,
+	uint8_t *reply)
+{
+	const uint8_t *ip6 = buf + 14, *icmp = ip6 + 40, *opt, *lla = NULL;
+	uint8_t mac[6];
+	uint32_t sum;
+	u_int l;
+	int router;
+
+	/* ND messages have no extension headers and a hop limit of 255 */
+	if (len < 14 + 40 + 24 || ip6[6] != 58 || ip6[7] != 255 ||
+	    icmp[1] != 0)
+		return 0;
+	if (icmp[0] != 135 && icmp[0] != 136)
+		return 0;
+	l = 14 + 40 + ((ip6[4] << 8) | ip6[5]);
+	if (l < len)
+		len = l;
+	/* source or target link-layer address option */
+	for (opt = icmp + 24; opt + 8 <= buf + len && opt[1] != 0;
+	    opt += opt[1] * 8) {
+		if (opt[0] == (icmp[0] == 135 ? 1 : 2)) {
+			lla = opt + 2;
+			break;
+		}
+	}
+	if (icmp[0] == 136) {	/* advertisement */
+		nm_arp_learn(a, icmp + 8, lla ? lla : buf + 6, port,
+			(icmp[4] & 0x80) != 0);
+		return 0;
+	}
+	if (reply == NULL || nm_arp_zero(ip6 + 8, 16))	/* DAD */
+		return 0;
+	if (!nm_arp_resolve(a, icmp + 8, buf + 6, mac, &router))
+		return 0;
+	memcpy(reply, buf + 6, 6);		/* to the requester */
+	memcpy(reply + 6, mac, 6);
+	reply[12] = 0x86;
+	reply[13] = 0xdd;
+	reply[14] = 0x60;
+	reply[15] = reply[16] = reply[17] = 0;
+	reply[18] = 0;
+	reply[19] = 32;				/* payload length */
+	reply[20] = 58;
+	reply[21] = 255;
+	memcpy(reply + 22, icmp + 8, 16);	/* from the target */
+	memcpy(reply + 38, buf + 22, 16);	/* to the requester */
+	reply[54] = 136;			/* advertisement */
+	reply[55] = 0;
+	reply[56] = reply[57] = 0;		/* checksum */
+	reply[58] = 0x60 | (router ? 0x80 : 0);	/* solicited, override */
+	reply[59] = reply[60] = reply[61] = 0;
+	memcpy(reply + 62, icmp + 8, 16);	/* target */
+	reply[78] = 2;				/* target link-layer address */
+	reply[79] = 1;
+	memcpy(reply + 80, mac, 6);
+	/* pseudo header and message */
+	sum = nm_arp_sum(reply + 22, 32, 32 + 58);
+	sum = nm_arp_sum(reply + 54, 32, sum);
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	sum = ~sum & 0xffff;
+	reply[56] = sum >> 8;
+	reply[57] = sum & 0xff;
+	return NM_ND_LEN;
+}
+
+
+/*
+ * Called by nm_bdg_flush() for every frame when suppression is on.
+ * reply is NULL, or a buffer of NM_ARP_REPLY_SIZE bytes if the frame
+ * is a broadcast that can be answered. In that case, if the frame is
+ * a request for a known address, the reply is built there, ft is
+ * changed to point to it and 1 is returned.
+ */
+int
+nm_arp_input(struct nm_arp *a, struct nm_bdg_fwd *ft,
+	struct netmap_vp_adapter *na, char *reply)
+{
+	const uint8_t *buf = ft->ft_buf;
+	u_int len = ft->ft_len, vh = na->virt_hdr_len, rlen = 0, port;
+
+	if (unlikely(ft->ft_flags & NS_INDIRECT) || ft->ft_frags != 1 ||
+	    len < vh + 14)
+		return 0;
+	buf += vh;
+	len -= vh;
+	port = na->bdg_port;
+	if (buf[12] == 0x08 && buf[13] == 0x06)
+		rlen = nm_arp_arp(a, buf, len, port,
+			reply ? (uint8_t *)reply + vh : NULL);
+	else if (buf[12] == 0x86 && buf[13] == 0xdd)
+		rlen = nm_arp_nd(a, buf, len, port,
+			reply ? (uint8_t *)reply + vh : NULL);
+	if (rlen == 0)
+		return 0;
+	/* a clean virtio-net header, no offloads */
+	bzero(reply, vh);
+	ft->ft_buf = reply;
+	ft->ft_len = vh + rlen;
+	ft->ft_flags = 0;
+	return 1;
+}
+
+
+/* forget what was learned on a port leaving the switch */
+void
+netmap_arp_port_gone(struct nm_arp *a, u_int port)
+{
+	u_int i, j;
+
+	if (a == NULL)
+		return;
+	mtx_lock(&a->lock);
+	for (i = 0; i < NM_ARP_SETS; i++) {
+		for (j = 0; j < NM_ARP_WAYS; j++) {
+			if (a->ent[i][j].port == port)
+				a->ent[i][j].valid = 0;
+		}
+	}
+	mtx_unlock(&a->lock);
+}
+
+
+void
+netmap_arp_free(struct nm_arp *a)
+{
+	if (a == NULL)
+		return;
+	mtx_destroy(&a->lock);
+	free(a, M_DEVBUF);
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() with the
+ * bridge write-locked. ap is the table of the bridge.
+ */
+int
+netmap_arp_config(struct nm_ifreq *ifr, struct nm_arp **ap)
+{
+	struct nm_arp_req *req = (struct nm_arp_req *)ifr->data;
+	struct nm_arp *a = *ap;
+	uint32_t now;
+	u_int i;
+
+	if (a == NULL && req->nar_cmd != NM_ARP_ON)
+		return ENOENT;
+
+	switch (req->nar_cmd) {
+	case NM_ARP_ON:
+		if (a != NULL)
+			return 0;
+		a = malloc(sizeof(*a), M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (a == NULL)
+			return ENOMEM;
+		mtx_init(&a->lock, "nm_arp_lock", NULL, MTX_DEF);
+		*ap = a;
+		break;
+
+	case NM_ARP_OFF:
+		*ap = NULL;
+		netmap_arp_free(a);
+		break;
+
+	case NM_ARP_GET:
+		now = NM_ARP_NOW();
+		req->nar_replies = a->replies;
+		req->nar_learned = a->learned;
+		req->nar_count = 0;
+		req->nar_next = 0;
+		mtx_lock(&a->lock);
+		for (i = req->nar_arg; i < NM_ARP_SETS * NM_ARP_WAYS; i++) {
+			struct nm_arp_ent *e =
+				&a->ent[i / NM_ARP_WAYS][i % NM_ARP_WAYS];
+			struct nm_arp_binding *rb;
+
+			if (!e->valid || now - e->last > NM_ARP_AGE)
+				continue;
+			if (req->nar_count == NM_ARP_REQ_BINDINGS) {
+				req->nar_next = i;
+				break;
+			}
+			rb = &req->nar_bindings[req->nar_count++];
+			memcpy(rb->ip, e->ip, 16);
+			memcpy(rb->mac, e->mac, 6);
+			rb->port = e->port;
+			rb->age = now - e->last;
+		}
+		mtx_unlock(&a->lock);
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+#endif /* WITH_VALE */
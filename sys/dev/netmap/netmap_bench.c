@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * In-kernel traffic source and sink ports for VALE, to measure the
+ * cost of the switch without the syscalls and scheduling of pkt-gen.
+ *
+ * A benchmark port is an ephemeral VALE port with one ring pair,
+ * created, registered and owned by the kernel on NIOCBDGCONF
+ * (struct nm_bench_req) and destroyed by NM_BENCH_STOP.
+ * A source prefills its tx ring with UDP frames, once, and a kernel
+ * thread hands the slots to nm_bdg_preflush() in bursts of half a
+ * ring, paced to the requested rate. The time spent in the switch is
+ * accumulated, so busy ns / packets is the switching cost per packet.
+ * A sink replaces the notify callback of its rx ring: the slots
+ * filled by nm_bdg_flush() are released and counted on the spot.
+ * Benchmark ports are kept in a small table protected by NMG_LOCK.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_BENCH_MAX		16	/* benchmark ports */
+#define NM_BENCH_MINLEN		60	/* without the CRC */
+
+struct nm_bench {
+	char		name[IFNAMSIZ];
+	struct netmap_vp_adapter *vpna;
+	struct netmap_priv_d *priv;	/* kernel registration of the port */
+	struct nm_kthread *nmk;		/* source only */
+	int		(*saved_notify)(struct netmap_kring *, int); /* sink */
+	uint16_t	mode;		/* NM_BENCH_SOURCE or NM_BENCH_SINK */
+	u_int		len;
+	uint64_t	pps;
+	uint64_t	start;		/* ns */
+	uint64_t	first, last;	/* ns, first and last sink batch */
+	uint64_t	packets;
+	uint64_t	bytes;
+	uint64_t	ns;		/* in the switch, for a source */
+};
+
+static struct nm_bench *nm_benches[NM_BENCH_MAX];
+
+
+static struct nm_bench *
+nm_bench_find(const char *name)
+{
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+	for (i = 0; i < NM_BENCH_MAX; i++) {
+		if (nm_benches[i] != NULL &&
+		    !strncmp(nm_benches[i]->name, name, IFNAMSIZ))
+			return nm_benches[i];
+	}
+	return NULL;
+}
+
+
+/* base + i in the low 24 bits of the address */
+static void
+nm_bench_mac(uint8_t *dst, const uint8_t *base, u_int i)
+{
+	uint32_t low = ((base[3] << 16) | (base[4] << 8) | base[5]) + i;
+
+	memcpy(dst, base, 3);
+	dst[3] = low >> 16;
+	dst[4] = low >> 8;
+	dst[5] = low;
+}
+
+
+static uint16_t
+nm_bench_csum(const uint8_t *p, u_int len)
+{
+	uint32_t sum = 0;
+	u_int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return htobe16(~sum & 0xffff);
+}
+
+
+/*
+ * Write the frames of a source in all the slots of its tx ring.
+ * Slot j goes from source address j % nsrc to destination address
+ * (j / nsrc) % ndst, so the pattern repeats every ring.
+ */
+static void
+nm_bench_fill(struct nm_bench *nb, const struct nm_bench_req *req)
+{
+	struct netmap_adapter *na = &nb->vpna->up;
+	struct netmap_kring *kring = &na->tx_rings[0];
+	struct netmap_ring *ring = kring->ring;
+	u_int nsrc = req->nbr_nsrc ? req->nbr_nsrc : 1;
+	u_int ndst = req->nbr_ndst ? req->nbr_ndst : 1;
+	u_int j;
+
+	for (j = 0; j < kring->nkr_num_slots; j++) {
+		struct netmap_slot *slot = &ring->slot[j];
+		uint8_t *p = NMB(na, slot);
+		struct nm_iphdr *iph = (struct nm_iphdr *)(p + 14);
+		struct nm_udphdr *udph = (struct nm_udphdr *)(p + 34);
+		u_int s = j % nsrc, d = (j / nsrc) % ndst;
+
+		bzero(p, nb->len);
+		nm_bench_mac(p, req->nbr_dst_mac, d);
+		nm_bench_mac(p + 6, req->nbr_src_mac, s);
+		p[12] = 0x08;			/* IPv4 */
+		iph->version_ihl = 0x45;
+		iph->tot_len = htobe16(nb->len - 14);
+		iph->ttl = 64;
+		iph->protocol = 17;		/* UDP */
+		iph->saddr = htobe32(be32toh(req->nbr_src_ip) + s);
+		iph->daddr = htobe32(be32toh(req->nbr_dst_ip) + d);
+		iph->check = nm_bench_csum((uint8_t *)iph, 20);
+		udph->source = htobe16(9);	/* discard */
+		udph->dest = htobe16(9);
+		udph->len = htobe16(nb->len - 34);
+		slot->len = nb->len;
+		slot->flags = 0;
+	}
+}
+
+
+#ifndef _WIN32 /* no kthreads on windows */
+/*
+ * Body of the kthread of a source. Like the bwrap workers it sends
+ * a burst and reschedules itself, so the cpu is released when
+ * needed. With a rate it only sends the packets that are due.
+ */
+static void
+nm_bench_source(void *data)
+{
+	struct nm_bench *nb = data;
+	struct netmap_kring *kring = &nb->vpna->up.tx_rings[0];
+	u_int lim = kring->nkr_num_slots - 1;
+	u_int n = kring->nkr_num_slots / 2, head, done;
+	uint64_t t0, t1;
+
+	t0 = nm_os_gettime_ns();
+	if (nb->pps) {
+		uint64_t due = (t0 - nb->start) / 1000 * nb->pps / 1000000;
+
+		if (due <= nb->packets)
+			goto out;
+		if (due - nb->packets < n)
+			n = due - nb->packets;
+	}
+	head = kring->nr_hwcur + n;
+	if (head > lim)
+		head -= lim + 1;
+	done = nm_bdg_preflush(kring, head);
+	t1 = nm_os_gettime_ns();
+	n = done >= kring->nr_hwcur ? done - kring->nr_hwcur :
+		done + lim + 1 - kring->nr_hwcur;
+	kring->nr_hwcur = done;
+	nb->packets += n;
+	nb->bytes += (uint64_t)n * nb->len;
+	nb->ns += t1 - t0;
+out:
+	nm_os_kthread_wakeup_worker(nb->nmk);
+}
+#endif /* !_WIN32 */
+
+
+/*
+ * nm_notify callback of the rx ring of a sink, called by
+ * nm_bdg_flush() without the queue lock. Release and count
+ * everything up to nr_hwtail.
+ */
+static int
+nm_bench_sink_notify(struct netmap_kring *kring, int flags)
+{
+	struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)kring->na;
+	struct nm_bench *nb = vpna->bench;
+	struct netmap_ring *ring = kring->ring;
+	u_int lim = kring->nkr_num_slots - 1, j;
+	uint64_t packets = 0, bytes = 0;
+
+	mtx_lock(&kring->q_lock);
+	for (j = kring->nr_hwcur; j != kring->nr_hwtail; j = nm_next(j, lim)) {
+		struct netmap_slot *slot = &ring->slot[j];
+
+		bytes += slot->len;
+		if (!(slot->flags & NS_MOREFRAG))
+			packets++;
+	}
+	kring->nr_hwcur = j;
+	ring->head = ring->cur = j;
+	if (nb != NULL && packets) {
+		nb->last = nm_os_gettime_ns();
+		if (nb->packets == 0)
+			nb->first = nb->last;
+		nb->packets += packets;
+		nb->bytes += bytes;
+	}
+	mtx_unlock(&kring->q_lock);
+	return 0;
+}
+
+
+static void
+nm_bench_stop(struct nm_bench *nb)
+{
+	struct netmap_vp_adapter *vpna = nb->vpna;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+#ifndef _WIN32
+	if (nb->nmk != NULL)
+		nm_os_kthread_delete(nb->nmk);
+#endif /* !_WIN32 */
+	if (nb->saved_notify != NULL)
+		vpna->up.rx_rings[0].nm_notify = nb->saved_notify;
+	vpna->bench = NULL;
+	/* wait for the flushes that may be in the notify callback */
+	netmap_bdg_drain(vpna);
+	vpna->up.na_flags &= ~NAF_BUSY;
+	/* the last reference, the port leaves the switch */
+	if (netmap_dtor_locked(nb->priv)) {
+		bzero(nb->priv, sizeof(*nb->priv));
+		free(nb->priv, M_DEVBUF);
+	}
+	for (i = 0; i < NM_BENCH_MAX; i++) {
+		if (nm_benches[i] == nb)
+			nm_benches[i] = NULL;
+	}
+	free(nb, M_DEVBUF);
+}
+
+
+static int
+nm_bench_start(const char *name, const struct nm_bench_req *req)
+{
+	struct nmreq nmr;
+	struct netmap_adapter *na = NULL;
+	struct netmap_priv_d *npriv;
+	struct nm_bench *nb;
+	int error;
+	u_int i;
+
+	NMG_LOCK_ASSERT();
+	for (i = 0; i < NM_BENCH_MAX && nm_benches[i] != NULL; i++)
+		;
+	if (i == NM_BENCH_MAX)
+		return ENOMEM;
+#ifdef _WIN32
+	if (req->nbr_cmd == NM_BENCH_SOURCE)
+		return EOPNOTSUPP;
+#endif /* _WIN32 */
+
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	strncpy(nmr.nr_name, name, sizeof(nmr.nr_name) - 1);
+	/* the port must be new, and not a NIC */
+	error = netmap_get_bdg_na(&nmr, &na, 0);
+	if (na != NULL) {
+		netmap_adapter_put(na);
+		return EBUSY;
+	}
+	nmr.nr_tx_rings = nmr.nr_rx_rings = 1;
+	error = netmap_get_bdg_na(&nmr, &na, 1);
+	if (error)
+		return error;
+	if (na == NULL)		/* not a VALE port name */
+		return EINVAL;
+	if (na->ifp != NULL) {
+		netmap_adapter_put(na);
+		return EINVAL;
+	}
+
+	nb = malloc(sizeof(*nb), M_DEVBUF, M_NOWAIT | M_ZERO);
+	npriv = malloc(sizeof(*npriv), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (nb == NULL || npriv == NULL) {
+		error = ENOMEM;
+		goto fail;
+	}
+	error = netmap_do_regif(npriv, na, 0, NR_REG_ALL_NIC);
+	if (error)
+		goto fail;
+	/* as for an open file, released by netmap_dtor_locked() */
+	npriv->np_refs = 1;
+	netmap_use_count++;
+	na->na_flags |= NAF_BUSY;
+
+	strncpy(nb->name, name, sizeof(nb->name) - 1);
+	nb->vpna = (struct netmap_vp_adapter *)na;
+	nb->priv = npriv;
+	nb->mode = req->nbr_cmd;
+	nb->len = req->nbr_len ? req->nbr_len : NM_BENCH_MINLEN;
+	if (nb->len > NETMAP_BUF_SIZE(na))
+		nb->len = NETMAP_BUF_SIZE(na);
+	nb->pps = req->nbr_pps;
+	nb->start = nm_os_gettime_ns();
+	nm_benches[i] = nb;
+
+	if (nb->mode == NM_BENCH_SINK) {
+		struct netmap_kring *kring = &na->rx_rings[0];
+
+		nb->vpna->bench = nb;
+		nb->saved_notify = kring->nm_notify;
+		kring->nm_notify = nm_bench_sink_notify;
+		return 0;
+	}
+	nm_bench_fill(nb, req);
+#ifndef _WIN32
+	{
+		struct nm_kthread_cfg cfg;
+
+		bzero(&cfg, sizeof(cfg));
+		cfg.worker_fn = nm_bench_source;
+		cfg.worker_private = nb;
+		nb->nmk = nm_os_kthread_create(&cfg);
+		if (nb->nmk == NULL) {
+			nm_bench_stop(nb);
+			return ENOMEM;
+		}
+		if (nm_os_kthread_start(nb->nmk)) {
+			nm_bench_stop(nb);
+			return ENOMEM;
+		}
+		nm_os_kthread_wakeup_worker(nb->nmk);
+	}
+#endif /* !_WIN32 */
+	return 0;
+
+fail:
+	if (npriv != NULL)
+		free(npriv, M_DEVBUF);
+	if (nb != NULL)
+		free(nb, M_DEVBUF);
+	netmap_adapter_put(na);
+	return error;
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() without locks
+ * as the port may not exist yet.
+ */
+int
+netmap_bench_config(struct nm_ifreq *ifr)
+{
+	struct nm_bench_req *req = (struct nm_bench_req *)ifr->data;
+	struct nm_bench *nb;
+	int error = 0;
+
+	NMG_LOCK();
+	nb = nm_bench_find(ifr->nifr_name);
+	switch (req->nbr_cmd) {
+	case NM_BENCH_SOURCE:
+	case NM_BENCH_SINK:
+		if (nb != NULL) {
+			error = EBUSY;
+			break;
+		}
+		if (req->nbr_len && req->nbr_len < NM_BENCH_MINLEN) {
+			error = EINVAL;
+			break;
+		}
+		error = nm_bench_start(ifr->nifr_name, req);
+		break;
+
+	case NM_BENCH_STOP:
+	case NM_BENCH_GET:
+		if (nb == NULL) {
+			error = ENXIO;
+			break;
+		}
+		req->nbr_mode = nb->mode;
+		req->nbr_len = nb->len;
+		req->nbr_pps = nb->pps;
+		req->nbr_packets = nb->packets;
+		req->nbr_bytes = nb->bytes;
+		req->nbr_ns = nb->mode == NM_BENCH_SOURCE ? nb->ns :
+			nb->last - nb->first;
+		req->nbr_elapsed = nm_os_gettime_ns() - nb->start;
+		if (req->nbr_cmd == NM_BENCH_STOP)
+			nm_bench_stop(nb);
+		break;
+
+	default:
+		error = EINVAL;
+		break;
+	}
+	NMG_UNLOCK();
+	return error;
+}
+
+
+/* stop all the benchmark ports, on module unload */
+void
+netmap_bench_fini(void)
+{
+	u_int i;
+
+	NMG_LOCK();
+	for (i = 0; i < NM_BENCH_MAX; i++) {
+		if (nm_benches[i] != NULL)
+			nm_bench_stop(nm_benches[i]);
+	}
+	NMG_UNLOCK();
+}
+
+#endif /* WITH_VALE */
@@ -45,6 +45,8 @@
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pager.h>
+#include <vm/vm_map.h>
+#include <vm/vm_extern.h> /* vm_fault_quick_hold_pages(), kva_alloc() */
 #include <vm/uma.h>
 
 
@@ -55,6 +57,8 @@
 #include <sys/proc.h> /* PROC_LOCK() */
 #include <sys/unistd.h> /* RFNOWAIT */
 #include <sys/sched.h> /* sched_bind() */
+#include <sys/smp.h> /* mp_ncpus */
+#include <sys/callout.h> /* callout_reset_sbt() */
 #include <net/if.h>
 #include <net/if_var.h>
 #include <net/if_types.h> /* IFT_ETHER */
@@ -1038,6 +1042,9 @@ nm_kthread_open_files(struct nm_kthread *nmk, struct nm_kthread_cfg *cfg)
 	/* ring.ioeventfd contains the chan where do tsleep to wait events */
 	if (cfg->event.ioeventfd) {
 		nmk->worker_ctx.ioevent_file = (void *)cfg->event.ioeventfd;
+	} else if (!cfg->event.irqfd) {
+		/* no events at all, only nm_os_kthread_wakeup_worker() */
+		nmk->worker_ctx.ioevent_file = nmk;
 	}
 
 	return 0;
@@ -1056,6 +1063,19 @@ nm_os_kthread_set_affinity(struct nm_kthread *nmk, int affinity)
 	nmk->affinity = affinity;
 }
 
+int
+nm_os_ncpus(void)
+{
+	return mp_ncpus;
+}
+
+/* may be stale when called without a critical section */
+int
+nm_os_curcpu(void)
+{
+	return curcpu;
+}
+
 struct nm_kthread *
 nm_os_kthread_create(struct nm_kthread_cfg *cfg)
 {
@@ -1150,6 +1170,102 @@ nm_os_kthread_delete(struct nm_kthread *nmk)
 	free(nmk, M_DEVBUF);
 }
 
+/******************** timer wrapper ****************/
+
+struct nm_os_timer {
+	struct callout c;
+	void (*fn)(void *);
+	void *arg;
+};
+
+struct nm_os_timer *
+nm_os_timer_create(void (*fn)(void *), void *arg)
+{
+	struct nm_os_timer *nmt;
+
+	nmt = malloc(sizeof(*nmt), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (!nmt)
+		return NULL;
+	callout_init(&nmt->c, 1 /* mpsafe */);
+	nmt->fn = fn;
+	nmt->arg = arg;
+	return nmt;
+}
+
+void
+nm_os_timer_start(struct nm_os_timer *nmt, u_int usec)
+{
+	callout_reset_sbt(&nmt->c, SBT_1US * usec, 0, nmt->fn, nmt->arg, 0);
+}
+
+void
+nm_os_timer_delete(struct nm_os_timer *nmt)
+{
+	if (!nmt)
+		return;
+	callout_drain(&nmt->c);
+	free(nmt, M_DEVBUF);
+}
+
+/******************** pinned user memory ****************/
+
+struct nm_os_upin {
+	vm_page_t *ma;
+	int npages;		/* held pages */
+	vm_offset_t kva;
+};
+
+int
+nm_os_upin(uintptr_t uaddr, size_t len, struct nm_os_upin **pin, char **kva)
+{
+	vm_offset_t start = trunc_page(uaddr);
+	int n = atop(round_page(uaddr + len) - start);
+	struct nm_os_upin *p;
+
+	p = malloc(sizeof(*p), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (p == NULL)
+		return ENOMEM;
+	p->ma = malloc(n * sizeof(vm_page_t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (p->ma == NULL) {
+		free(p, M_DEVBUF);
+		return ENOMEM;
+	}
+	/* we only transmit from here, but ask for write access so that
+	 * copy-on-write is resolved now and the held pages are the ones
+	 * the process keeps writing to
+	 */
+	if (vm_fault_quick_hold_pages(&curproc->p_vmspace->vm_map,
+	    uaddr, len, VM_PROT_READ | VM_PROT_WRITE, p->ma, n) != n)
+		goto fail;
+	p->npages = n;
+	p->kva = kva_alloc(ptoa(n));
+	if (p->kva == 0)
+		goto fail;
+	pmap_qenter(p->kva, p->ma, n);
+	*pin = p;
+	*kva = (char *)p->kva + (uaddr & PAGE_MASK);
+	return 0;
+
+fail:
+	nm_os_uunpin(p);
+	return EFAULT;
+}
+
+void
+nm_os_uunpin(struct nm_os_upin *p)
+{
+	if (p == NULL)
+		return;
+	if (p->kva) {
+		pmap_qremove(p->kva, p->npages);
+		kva_free(p->kva, ptoa(p->npages));
+	}
+	if (p->npages)
+		vm_page_unhold_pages(p->ma, p->npages);
+	free(p->ma, M_DEVBUF);
+	free(p, M_DEVBUF);
+}
+
 /******************** kqueue support ****************/
 
 /*
@@ -57,12 +57,16 @@
 #if defined(CONFIG_NETMAP_PTNETMAP_HOST)
 #define WITH_PTNETMAP_HOST
 #endif
+#if defined(CONFIG_NETMAP_VALE_PROF)
+#define WITH_VALE_PROF
+#endif
 
 #elif defined (_WIN32)
 #define WITH_VALE	// comment out to disable VALE support
 #define WITH_PIPES
 #define WITH_MONITOR
 #define WITH_GENERIC
+//#define WITH_VALE_PROF	// per phase cycle counters in VALE
 
 #else	/* neither linux nor windows */
 #define WITH_VALE	// comment out to disable VALE support
@@ -71,6 +75,7 @@
 #define WITH_GENERIC
 #define WITH_PTNETMAP_HOST	/* ptnetmap host support */
 #define WITH_PTNETMAP_GUEST	/* ptnetmap guest support */
+//#define WITH_VALE_PROF	/* per phase cycle counters in VALE */
 
 #endif
 
@@ -126,6 +131,19 @@ struct nm_selinfo {
 	struct mtx m;
 };
 
+/* monotonic time in nanoseconds */
+static inline uint64_t
+nm_os_gettime_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* cycle counter, used by WITH_VALE_PROF */
+#define nm_os_cycles()	((uint64_t)get_cyclecount())
+
 
 // XXX linux struct, not used in FreeBSD
 struct net_device_ops {
@@ -252,6 +270,12 @@ typedef struct hrtimer{
 struct netmap_adapter;
 struct nm_bdg_fwd;
 struct nm_bridge;
+struct nm_acl;
+struct nm_vtep;
+struct nm_lag;
+struct nm_mcast;
+struct nm_arp;
+struct nm_uregs;
 struct netmap_priv_d;
 
 const char *nm_dump_buf(char *p, int len, int lim, char *dst);
@@ -394,6 +418,11 @@ struct netmap_kring {
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
 
+	/* adaptive batching on VALE tx rings, see nm_bdg_preflush() */
+	uint32_t	nkr_bdg_batch;	/* current batch, 0 if not set yet */
+	uint32_t	nkr_bdg_pktcost; /* smoothed cost per slot, ns */
+	uint64_t	nkr_bdg_last;	/* end of the last preflush, ns */
+
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
 	 * This is used by netmap_disable_all_rings()
@@ -584,6 +613,10 @@ struct netmap_adapter {
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
 #define NAF_PTNETMAP_HOST 256	/* the adapter supports ptnetmap in the host */
+#define NAF_BUFCLASS_FIXED 512	/* na_bufclass is inherited from a parent
+				 * (pipes, zero copy monitors) and cannot
+				 * be chosen at registration
+				 */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
 				  * cannot be registered from userspace
 				  */
@@ -711,9 +744,17 @@ struct netmap_adapter {
 	/* memory allocator (opaque)
 	 * We also cache a pointer to the lut_entry for translating
 	 * buffer addresses, and the total number of buffers.
+	 * All rings of the adapter draw buffers from the same
+	 * class, na_bufclass, and na_lut describes that class.
 	 */
  	struct netmap_mem_d *nm_mem;
+	/* own region while the port is moved to another one by
+	 * nr_arg2 at NIOCREGIF, restored when the last file goes */
+	struct netmap_mem_d *nm_mem_prev;
 	struct netmap_lut na_lut;
+	u_int na_bufclass;
+#define NM_BUF_CLASSES	2	/* see NR_BUF_CLASS1 */
+	u_int na_extra_bufs;	/* extra buffers held by the port */
 
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
@@ -797,6 +838,23 @@ struct netmap_vp_adapter {	/* VALE software port */
 	u_int mfs;
 	/* Last source MAC on this port */
 	uint64_t last_smac;
+	/* Latency budget for a batch, in us (0: none) */
+	u_int lat_budget;
+	/* ACL state, see netmap_acl.c */
+	struct nm_acl *acl;
+	/* VXLAN tunnel endpoint, see netmap_vtep.c */
+	struct nm_vtep *vtep;
+	/* link aggregation group, see netmap_lag.c */
+	struct nm_lag *lag;
+	/* pinned user memory for NS_INDIRECT, see netmap_ureg.c */
+	struct nm_uregs *uregs;
+	/* in-kernel sink, see netmap_bench.c */
+	struct nm_bench *bench;
+#ifdef WITH_VALE_PROF
+	/* per cpu cycle counters of the forwarding phases */
+	struct nm_bdg_prof *prof;
+	u_int nprof;
+#endif /* WITH_VALE_PROF */
 };
 
 
@@ -892,11 +950,51 @@ netmap_real_rings(struct netmap_adapter *na, enum txrx t)
  *   but are diverted to the host adapter depending on the ring number.
  *
  */
+/*
+ * Per hw rx ring worker used when the bwrap forwards from a kthread
+ * (dev.netmap.bridge_bwrap_threads) instead of the notify context.
+ * The counters are reported through NETMAP_BDG_GETPARAM.
+ */
+struct nm_bwrap_worker {
+	struct nm_kthread *nmk;
+	struct netmap_kring *kring;	/* hw rx ring served */
+	struct netmap_bwrap_adapter *bna;
+	uint64_t wakeups;		/* notifications received */
+	uint64_t polls;			/* worker runs */
+	uint64_t slots;			/* slots forwarded */
+	uint64_t exhausted;		/* polls that hit the budget */
+};
+
+/*
+ * Per hw tx ring state of the doorbell coalescing in netmap_bwrap_notify().
+ * Slots arrived from the switch may wait, up to tx_delay us, until
+ * tx_thresh of them are ready before the hw txsync is done.
+ */
+struct nm_bwrap_txq {
+	struct netmap_kring *kring;	/* bwrap rx ring feeding the hw ring */
+	struct nm_os_timer *timer;	/* fires the deferred doorbell */
+	uint64_t deferred_since;	/* ns, 0 if nothing deferred */
+	uint64_t doorbells;		/* hw txsyncs */
+	uint64_t deferred;		/* notifications not rung */
+	uint64_t timer_doorbells;	/* doorbells rung by the timer */
+};
+
 struct netmap_bwrap_adapter {
 	struct netmap_vp_adapter up;
 	struct netmap_vp_adapter host;  /* for host rings */
 	struct netmap_adapter *hwna;	/* the underlying device */
 
+	/* threaded forwarding, one worker per hw rx ring (+ host ring) */
+	struct nm_bwrap_worker *workers;
+	u_int num_workers;
+	u_int budget;			/* max slots per worker poll */
+
+	/* tx doorbell coalescing, one entry per hw tx ring (+ host ring) */
+	struct nm_bwrap_txq *txqs;
+	u_int num_txqs;
+	u_int tx_thresh;		/* slots, 0 rings at every notify */
+	u_int tx_delay;			/* max deferral, us */
+
 	/*
 	 * When we attach a physical interface to the bridge, we
 	 * allow the controlling process to terminate, so we need
@@ -1224,6 +1322,12 @@ struct netmap_bdg_ops {
 
 u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 		struct netmap_vp_adapter *);
+struct netmap_vp_adapter *netmap_bdg_port_byname(const char *name);
+void netmap_bdg_relearn(struct nm_bridge *b, u_int from, u_int to);
+void netmap_bdg_drain(struct netmap_vp_adapter *vpna);
+
+/* ACL classifier, plugged into learning bridges by NM_ACL_ON */
+extern struct netmap_bdg_ops netmap_acl_bdg_ops;
 
 #define	NM_BDG_MAXPORTS		254	/* up to 254 */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
@@ -1239,6 +1343,7 @@ int netmap_init_bridges(void);
 void netmap_uninit_bridges(void);
 int netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops);
 int netmap_bdg_config(struct nmreq *nmr);
+int netmap_bdg_svc_config(struct nmreq *nmr, struct netmap_priv_d *priv);
 
 #else /* !WITH_VALE */
 #define	netmap_get_bdg_na(_1, _2, _3)	0
@@ -1351,6 +1456,9 @@ extern int netmap_flags;
 extern int netmap_generic_mit;
 extern int netmap_generic_ringsize;
 extern int netmap_generic_rings;
+extern int netmap_mmap_prefault;
+extern int netmap_mmap_prefault_us;
+extern int netmap_priv_exact;
 extern int netmap_use_count;
 
 /*
@@ -1396,6 +1504,9 @@ extern int netmap_use_count;
  * Returns -ENOMEM in case the domain is different */
 #define nm_iommu_group_id(dev) (0)
 
+/* NUMA node of the device, -1 if unknown. Drivers do not set na->pdev */
+#define nm_numa_node(dev) (-1)
+
 /* Callback invoked by the dma machinery after a successful dmamap_load */
 static void netmap_dmamap_cb(__unused void *arg,
     __unused bus_dma_segment_t * segs, __unused int nseg, __unused int error)
@@ -1441,6 +1552,10 @@ netmap_reload_map(struct netmap_adapter *na,
 int nm_iommu_group_id(bus_dma_tag_t dev);
 #include <linux/dma-mapping.h>
 
+/* NUMA node of the device, -1 if unknown */
+#define nm_numa_node(dev) \
+	((dev) ? dev_to_node((struct device *)(dev)) : -1)
+
 static inline void
 netmap_load_map(struct netmap_adapter *na,
 	bus_dma_tag_t tag, bus_dmamap_t map, void *buf)
@@ -1706,10 +1821,17 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
  * destination are put in a list using ft_next as a link field.
  * ft_frags and ft_next are valid only on the first fragment.
  */
+#define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
+#define NM_MULTISEG		64	/* max size of a chain of bufs */
+/* actual size of the tables */
+#define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
+/* NM_FT_NULL terminates a list of slots in the ft */
+#define NM_FT_NULL		NM_BDG_BATCH_MAX
+
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
-	uint8_t _ft_port;	/* dst port (unused) */
+	uint8_t ft_mgrp;	/* multicast group, see netmap_mcast.c */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
@@ -1798,6 +1920,92 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			   struct netmap_vp_adapter *dst_na,
 			   struct nm_bdg_fwd *ft_p, struct netmap_ring *ring,
 			   u_int *j, u_int lim, u_int *howmany);
+u_int bdg_gro_datapath(struct netmap_vp_adapter *na,
+		       struct netmap_vp_adapter *dst_na,
+		       struct nm_bdg_fwd *ft, struct nm_bdg_fwd *ft_p,
+		       u_int *next, u_int stop, struct netmap_ring *ring,
+		       u_int *j, u_int lim, u_int *howmany);
+
+/* VXLAN tunnel endpoints on VALE ports */
+int netmap_vtep_config(struct nm_ifreq *ifr);
+void netmap_vtep_free(struct netmap_vp_adapter *vpna);
+int nm_vtep_decap(struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft);
+void nm_vtep_encap(struct netmap_vp_adapter *na,
+		   struct netmap_vp_adapter *dst_na,
+		   struct nm_bdg_fwd *ft_p, struct netmap_ring *ring,
+		   u_int *j, u_int lim, u_int *howmany);
+
+/* link aggregation of VALE ports */
+int netmap_lag_config(struct nm_ifreq *ifr, struct nm_lag **lags);
+void netmap_lag_free(struct netmap_vp_adapter *vpna);
+u_int nm_lag_port(struct netmap_vp_adapter *na);
+u_int nm_lag_pick(struct netmap_vp_adapter *dst, struct nm_bdg_fwd *ft,
+		  struct netmap_vp_adapter *src);
+int nm_lag_brd(struct netmap_vp_adapter *dst, struct netmap_vp_adapter *src);
+
+/* IGMP/MLD snooping on VALE switches */
+int netmap_mcast_config(struct nm_ifreq *ifr, struct nm_mcast **mp);
+void netmap_mcast_free(struct nm_mcast *m);
+void netmap_mcast_port_gone(struct nm_mcast *m, u_int port);
+u_int nm_mcast_classify(struct nm_mcast *m, struct nm_bdg_fwd *ft,
+			struct netmap_vp_adapter *na, uint32_t *mask);
+int nm_mcast_member(struct nm_mcast *m, u_int grp, u_int port);
+
+/* ARP/ND suppression on VALE switches */
+#define NM_ARP_REPLY_SIZE	128	/* room for a reply, see nm_arp_input */
+int netmap_arp_config(struct nm_ifreq *ifr, struct nm_arp **ap);
+void netmap_arp_free(struct nm_arp *a);
+void netmap_arp_port_gone(struct nm_arp *a, u_int port);
+int nm_arp_input(struct nm_arp *a, struct nm_bdg_fwd *ft,
+		 struct netmap_vp_adapter *na, char *reply);
+
+/*
+ * user memory regions pinned for NS_INDIRECT slots. The table of a
+ * port only changes with the bridge write-locked.
+ */
+struct nm_os_upin; /* OS-specific pinned pages - opaque */
+struct nm_ureg {
+	uintptr_t	uaddr;		/* user address, 0 if unused */
+	size_t		len;
+	char		*kva;		/* kernel mapping of uaddr */
+	struct nm_os_upin *pin;
+};
+
+struct nm_uregs {
+	u_int		n;		/* entries in use are below n */
+	uint64_t	misses;		/* approximate, not locked */
+	struct nm_ureg	r[NM_UREG_MAX];
+};
+
+/* kernel address of an indirect buffer, or NULL if not pinned */
+static inline char *
+nm_ureg_kva(struct nm_uregs *u, uintptr_t p, u_int len)
+{
+	u_int i;
+
+	len = (len + 63) & ~63;	/* nm_bdg_flush() copies this much */
+	for (i = 0; i < u->n; i++) {
+		struct nm_ureg *r = &u->r[i];
+
+		if (p - r->uaddr < r->len && r->len - (p - r->uaddr) >= len)
+			return r->kva + (p - r->uaddr);
+	}
+	u->misses++;
+	return NULL;
+}
+
+int netmap_ureg_prepare(struct nm_ifreq *ifr, struct nm_ureg *r);
+int netmap_ureg_config(struct nm_ifreq *ifr, struct nm_ureg *r,
+	struct netmap_priv_d *priv);
+void netmap_ureg_release(struct nm_ureg *r);
+void netmap_ureg_free(struct nm_uregs *u);
+
+/*
+ * in-kernel traffic source and sink ports, see netmap_bench.c
+ */
+int nm_bdg_preflush(struct netmap_kring *kring, u_int end);
+int netmap_bench_config(struct nm_ifreq *ifr);
+void netmap_bench_fini(void);
 
 /* persistent virtual port routines */
 int nm_os_vi_persist(const char *, struct ifnet **);
@@ -1813,7 +2021,9 @@ typedef void (*nm_kthread_worker_fn_t)(void *data);
 /* kthread configuration */
 struct nm_kthread_cfg {
 	long				type;		/* kthread type */
-	struct nm_kth_event_cfg		event;		/* event/ioctl fd */
+	struct nm_kth_event_cfg		event;		/* event/ioctl fd, all 0
+							 * if only woken up by
+							 * nm_os_kthread_wakeup_worker() */
 	nm_kthread_worker_fn_t		worker_fn;	/* worker function */
 	void				*worker_private;/* worker parameter */
 	int				attach_user;	/* attach kthread to user process */
@@ -1826,6 +2036,26 @@ void nm_os_kthread_delete(struct nm_kthread *);
 void nm_os_kthread_wakeup_worker(struct nm_kthread *nmk);
 void nm_os_kthread_send_irq(struct nm_kthread *);
 void nm_os_kthread_set_affinity(struct nm_kthread *, int);
+int nm_os_ncpus(void);
+int nm_os_curcpu(void);
+
+/*
+ * one-shot timers. The callback runs in a context where drivers
+ * can be called (a softirq on linux, the softclock thread on FreeBSD).
+ * nm_os_timer_delete() waits for a running callback.
+ */
+struct nm_os_timer; /* OS-specific timer - opaque */
+struct nm_os_timer *nm_os_timer_create(void (*fn)(void *), void *arg);
+void nm_os_timer_start(struct nm_os_timer *, u_int usec);
+void nm_os_timer_delete(struct nm_os_timer *);
+
+/*
+ * pin len bytes of user memory at uaddr, in the calling process,
+ * and map them in the kernel at *kva. May sleep.
+ */
+int nm_os_upin(uintptr_t uaddr, size_t len, struct nm_os_upin **pin,
+	       char **kva);
+void nm_os_uunpin(struct nm_os_upin *);
 
 #ifdef WITH_PTNETMAP_HOST
 /*
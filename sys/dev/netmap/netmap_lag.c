@@ -0,0 +1,415 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * Link aggregation (static LAG) of VALE ports.
+ *
+ * Up to NM_LAG_MAX groups of up to NM_LAG_MAXMEMBERS ports can be
+ * defined on each switch with NIOCBDGCONF, see struct nm_lag_req.
+ * The members are normally NICs attached to the switch, connected to
+ * the same external switch (with a static port channel) so that
+ * the uplink bandwidth grows with the number of NICs.
+ * nm_bdg_flush() and the learning bridge use three hooks:
+ *
+ *   nm_lag_port() returns the port where the sources behind a member
+ *	are learned. It is the first member of the LAG, so that the
+ *	forwarding table does not change when a host moves from a
+ *	member to another;
+ *
+ *   nm_lag_pick() maps a destination that is a member to the member
+ *	that actually sends the packet. The packet headers are hashed
+ *	into one of NM_LAG_BUCKETS buckets, each owned by a member.
+ *	The buckets of a member that is down go to the other members,
+ *	the others keep theirs, so only the flows of the failed member
+ *	are moved. In the same way a member that is removed hands its
+ *	buckets over to the others, and a new member takes its share
+ *	of buckets from all of them;
+ *
+ *   nm_lag_brd() selects a single member for broadcast traffic.
+ *
+ * Packets are never sent back to the LAG they came from.
+ * The state is changed only with the bridge write-locked, so the
+ * datapath needs no further locking, except for the tx counters
+ * that all the senders update.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#define NM_LAG_COUNT(p)	atomic_add_long((p), 1)
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#define NM_LAG_COUNT(p)	atomic_long_inc((atomic_long_t *)(p))
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_LAG_BUCKETS	256
+
+struct nm_lag {
+	struct nm_lag	**slot;		/* entry in the table of the bridge */
+	u_int		id;
+	u_int		nmembers;
+	u_int		port;		/* where sources are learned */
+	struct netmap_vp_adapter *members[NM_LAG_MAXMEMBERS];
+	uint8_t		up[NM_LAG_MAXMEMBERS];
+	volatile u_long	tx[NM_LAG_MAXMEMBERS];	/* NM_LAG_COUNT() */
+	uint8_t		home[NM_LAG_BUCKETS];	/* bucket -> owner */
+	uint8_t		map[NM_LAG_BUCKETS];	/* bucket -> member */
+};
+
+
+static inline uint32_t
+nm_lag_get32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint32_t
+nm_lag_mix(uint32_t h, uint32_t x)
+{
+	h ^= x;
+	h *= 0x9e3779b1;
+	return h ^ (h >> 15);
+}
+
+/*
+ * Hash bucket of a frame: MAC addresses, then IPv4/IPv6 addresses
+ * and TCP/UDP ports if present in the first fragment. The hash does
+ * not depend on anything but the headers, so a flow always maps to
+ * the same bucket.
+ */
+static u_int
+nm_lag_bucket(const struct nm_bdg_fwd *ft, u_int vh)
+{
+	const uint8_t *buf = ft->ft_buf + vh;
+	u_int len = ft->ft_len, off = 14, l4 = 0;
+	uint16_t type;
+	uint32_t h = 0;
+
+	if (unlikely(ft->ft_flags & NS_INDIRECT || len < vh + 14))
+		return 0;
+	len -= vh;
+	h = nm_lag_mix(h, nm_lag_get32(buf));
+	h = nm_lag_mix(h, nm_lag_get32(buf + 4));
+	h = nm_lag_mix(h, nm_lag_get32(buf + 8));
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= 18) {	/* skip one VLAN tag */
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	if (type == 0x0800 && len >= off + 20) {
+		const struct nm_iphdr *iph = (const struct nm_iphdr *)(buf + off);
+
+		h = nm_lag_mix(h, nm_lag_get32(buf + off + 12));
+		h = nm_lag_mix(h, nm_lag_get32(buf + off + 16));
+		if ((iph->frag_off & htobe16(0x3fff)) == 0 &&
+		    (iph->protocol == 6 || iph->protocol == 17))
+			l4 = off + ((iph->version_ihl & 0x0f) << 2);
+	} else if (type == 0x86dd && len >= off + 40) {
+		const struct nm_ipv6hdr *ip6h =
+			(const struct nm_ipv6hdr *)(buf + off);
+		u_int i;
+
+		for (i = 0; i < 32; i += 4)
+			h = nm_lag_mix(h, nm_lag_get32(buf + off + 8 + i));
+		if (ip6h->nexthdr == 6 || ip6h->nexthdr == 17)
+			l4 = off + 40;
+	}
+	if (l4 && len >= l4 + 4)
+		h = nm_lag_mix(h, nm_lag_get32(buf + l4));	/* ports */
+	return (h ^ (h >> 16)) & (NM_LAG_BUCKETS - 1);
+}
+
+
+/*
+ * Map the buckets to the members, called after any change.
+ * A bucket goes to its owner unless the owner is down.
+ */
+static void
+nm_lag_rebuild(struct nm_lag *lag)
+{
+	u_int active[NM_LAG_MAXMEMBERS], nactive = 0, i, m;
+
+	for (i = 0; i < lag->nmembers; i++) {
+		if (lag->up[i])
+			active[nactive++] = i;
+	}
+	for (i = 0; i < NM_LAG_BUCKETS; i++) {
+		m = lag->home[i];
+		if (!lag->up[m] && nactive > 0)
+			m = active[i % nactive];
+		lag->map[i] = m;
+	}
+	lag->port = lag->members[0]->bdg_port;
+}
+
+/* member i is new, give it every nmembers-th bucket */
+static void
+nm_lag_grab(struct nm_lag *lag, u_int i)
+{
+	u_int k;
+
+	for (k = i; k < NM_LAG_BUCKETS; k += lag->nmembers)
+		lag->home[k] = i;
+}
+
+/*
+ * Member i is gone and the ones after it moved down by one,
+ * hand its buckets over to the others in turn.
+ */
+static void
+nm_lag_release(struct nm_lag *lag, u_int i)
+{
+	u_int k, next = 0;
+
+	for (k = 0; k < NM_LAG_BUCKETS; k++) {
+		if (lag->home[k] == i) {
+			lag->home[k] = next;
+			if (++next == lag->nmembers)
+				next = 0;
+		} else if (lag->home[k] > i) {
+			lag->home[k]--;
+		}
+	}
+}
+
+
+u_int
+nm_lag_port(struct netmap_vp_adapter *na)
+{
+	return na->lag->port;
+}
+
+
+/*
+ * Return the port that sends a packet for the LAG of dst,
+ * or NM_BDG_NOPORT if the packet comes from the LAG itself or
+ * no member can send it.
+ */
+u_int
+nm_lag_pick(struct netmap_vp_adapter *dst, struct nm_bdg_fwd *ft,
+	struct netmap_vp_adapter *src)
+{
+	struct nm_lag *lag = dst->lag;
+	u_int i, m;
+
+	if (src->lag == lag)
+		return NM_BDG_NOPORT;
+	m = lag->map[nm_lag_bucket(ft, src->virt_hdr_len)];
+	/* a member out of netmap mode is skipped like a down one */
+	for (i = 0; i < lag->nmembers; i++) {
+		if (lag->up[m] && nm_netmap_on(&lag->members[m]->up)) {
+			NM_LAG_COUNT(&lag->tx[m]);
+			return lag->members[m]->bdg_port;
+		}
+		if (++m == lag->nmembers)
+			m = 0;
+	}
+	return NM_BDG_NOPORT;
+}
+
+
+/* Return 1 if broadcasts from src must be sent to dst, a LAG member */
+int
+nm_lag_brd(struct netmap_vp_adapter *dst, struct netmap_vp_adapter *src)
+{
+	struct nm_lag *lag = dst->lag;
+	u_int i;
+
+	if (src->lag == lag)
+		return 0;
+	for (i = 0; i < lag->nmembers; i++) {
+		if (lag->up[i] && nm_netmap_on(&lag->members[i]->up))
+			return lag->members[i] == dst;
+	}
+	return 0;
+}
+
+
+static int
+nm_lag_member(struct nm_lag *lag, struct netmap_vp_adapter *vpna)
+{
+	u_int i;
+
+	for (i = 0; i < lag->nmembers; i++) {
+		if (lag->members[i] == vpna)
+			return i;
+	}
+	return -1;
+}
+
+
+/* remove a port from its LAG, if any. Called with the bridge locked */
+void
+netmap_lag_free(struct netmap_vp_adapter *vpna)
+{
+	struct nm_lag *lag = vpna->lag;
+	u_int port;
+	int i, m;
+
+	if (lag == NULL)
+		return;
+	vpna->lag = NULL;
+	m = nm_lag_member(lag, vpna);
+	if (m < 0)
+		return;
+	lag->nmembers--;
+	for (i = m; i < lag->nmembers; i++) {
+		lag->members[i] = lag->members[i + 1];
+		lag->up[i] = lag->up[i + 1];
+		lag->tx[i] = lag->tx[i + 1];
+	}
+	if (lag->nmembers == 0) {
+		*lag->slot = NULL;
+		free(lag, M_DEVBUF);
+		return;
+	}
+	nm_lag_release(lag, m);
+	port = lag->port;
+	nm_lag_rebuild(lag);
+	/* the hosts behind the LAG are now learned elsewhere */
+	if (lag->port != port && vpna->na_bdg != NULL)
+		netmap_bdg_relearn(vpna->na_bdg, port, lag->port);
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() with the
+ * bridge write-locked. lags is the table of the bridge.
+ */
+int
+netmap_lag_config(struct nm_ifreq *ifr, struct nm_lag **lags)
+{
+	struct nm_lag_req *req = (struct nm_lag_req *)ifr->data;
+	struct netmap_vp_adapter *vpna;
+	struct nm_lag *lag;
+	u_int i;
+	int m;
+
+	vpna = netmap_bdg_port_byname(ifr->nifr_name);
+	if (vpna == NULL)
+		return ENXIO;
+	lag = vpna->lag;
+
+	switch (req->nlr_cmd) {
+	case NM_LAG_ADD:
+		if (req->nlr_id >= NM_LAG_MAX)
+			return EINVAL;
+		if (lag != NULL)
+			return lag->id == req->nlr_id ? 0 : EBUSY;
+		lag = lags[req->nlr_id];
+		if (lag == NULL) {
+			lag = malloc(sizeof(*lag), M_DEVBUF, M_NOWAIT | M_ZERO);
+			if (lag == NULL)
+				return ENOMEM;
+			lag->id = req->nlr_id;
+			lag->slot = &lags[req->nlr_id];
+			lags[req->nlr_id] = lag;
+		} else if (lag->nmembers == NM_LAG_MAXMEMBERS) {
+			return ENOSPC;
+		}
+		i = lag->nmembers++;
+		lag->members[i] = vpna;
+		lag->up[i] = 1;
+		lag->tx[i] = 0;
+		vpna->lag = lag;
+		nm_lag_grab(lag, i);
+		nm_lag_rebuild(lag);
+		D("%s: member %d of LAG %d", vpna->up.name, i, lag->id);
+		break;
+
+	case NM_LAG_REMOVE:
+		if (lag == NULL)
+			return ENOENT;
+		netmap_lag_free(vpna);
+		break;
+
+	case NM_LAG_UP:
+	case NM_LAG_DOWN:
+		if (lag == NULL)
+			return ENOENT;
+		m = nm_lag_member(lag, vpna);
+		lag->up[m] = (req->nlr_cmd == NM_LAG_UP);
+		nm_lag_rebuild(lag);
+		break;
+
+	case NM_LAG_GET:
+		if (lag == NULL)
+			return ENOENT;
+		req->nlr_id = lag->id;
+		req->nlr_count = lag->nmembers;
+		for (i = 0; i < lag->nmembers; i++) {
+			struct nm_lag_member *lm = &req->nlr_members[i];
+
+			strncpy(lm->name, lag->members[i]->up.name,
+				sizeof(lm->name));
+			lm->port = lag->members[i]->bdg_port;
+			lm->up = lag->up[i];
+			lm->tx = lag->tx[i];
+		}
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+#endif /* WITH_VALE */
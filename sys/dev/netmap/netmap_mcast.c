@@ -0,0 +1,588 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * IGMP/MLD snooping for VALE switches.
+ *
+ * Without snooping, the learning bridge returns NM_BDG_BROADCAST for
+ * every multicast frame and nm_bdg_flush() copies it to all the ports.
+ * With snooping enabled on a switch (NIOCBDGCONF, struct nm_mcast_req)
+ * nm_bdg_flush() calls nm_mcast_classify() on the broadcast frames,
+ * which returns in ft_mgrp:
+ *
+ *   0 (NM_MCAST_FLOOD) for broadcasts, non-IP multicast, link-local
+ *	groups (224.0.0.x, ff02::x) and IGMP/MLD messages, which are
+ *	flooded as before;
+ *   NM_MCAST_ROUTERS for unknown groups, sent to the router ports;
+ *   the group entry + NM_MCAST_FIRST otherwise.
+ *
+ * and ORs the ports of the group in a bitmap, so that only those are
+ * scanned as destinations. In the second pass nm_mcast_member() filters
+ * the broadcast list of each destination.
+ *
+ * Groups are kept per destination MAC address, in an open addressing
+ * table of port bitmaps. Reports (IGMPv1/v2/v3, MLDv1/v2) add the
+ * sending port, leaves and v3/v2 TO_IN({}) records remove it at once
+ * (fast leave). Queries mark the port as a router port. Groups not
+ * refreshed by a report for NM_MCAST_AGE seconds, and learned router
+ * ports silent for NM_MCAST_RAGE seconds, are removed when the next
+ * IGMP/MLD message is processed.
+ *
+ * The datapath reads the table without locks, updates are serialized
+ * by a spinlock since they are rare. A frame may then briefly see a
+ * group as it was before a concurrent report.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_MCAST_FLOOD		0
+#define NM_MCAST_ROUTERS	1
+#define NM_MCAST_FIRST		2
+#define NM_MCAST_GROUPS		252	/* ft_mgrp is 8 bits */
+#define NM_MCAST_WORDS		((NM_BDG_MAXPORTS + 31) / 32)
+#define NM_MCAST_AGE		260	/* group membership interval */
+#define NM_MCAST_RAGE		255	/* other querier present interval */
+/* about one second, good enough for the timeouts above */
+#define NM_MCAST_NOW()		((uint32_t)(nm_os_gettime_ns() >> 30))
+
+enum { NM_MCAST_FREE = 0, NM_MCAST_USED, NM_MCAST_DELETED };
+
+struct nm_mcast_ent {
+	uint64_t	mac;
+	uint32_t	state;
+	uint32_t	last;		/* last report */
+	uint32_t	ports[NM_MCAST_WORDS];
+};
+
+struct nm_mcast {
+	NM_LOCK_T	lock;		/* serializes the updates */
+	uint32_t	last_sweep;
+	uint32_t	rstatic[NM_MCAST_WORDS];	/* configured routers */
+	uint32_t	rdyn[NM_MCAST_WORDS];		/* learned routers */
+	uint32_t	routers[NM_MCAST_WORDS];	/* both */
+	uint32_t	rlast[NM_BDG_MAXPORTS];		/* last query */
+	uint64_t	reports;
+	uint64_t	queries;
+	struct nm_mcast_ent grp[NM_MCAST_GROUPS];
+};
+
+
+/* MAC address as in netmap_bdg_learning() */
+static inline uint64_t
+nm_mcast_mac(const uint8_t *p)
+{
+	return (uint64_t)p[0] | ((uint64_t)p[1] << 8) |
+		((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+		((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40);
+}
+
+/* MAC of an IPv4 group, 01:00:5e + low 23 bits */
+static inline uint64_t
+nm_mcast_mac4(const uint8_t *g)
+{
+	uint8_t m[6] = { 0x01, 0x00, 0x5e, g[1] & 0x7f, g[2], g[3] };
+
+	return nm_mcast_mac(m);
+}
+
+/* MAC of an IPv6 group, 33:33 + low 32 bits */
+static inline uint64_t
+nm_mcast_mac6(const uint8_t *g)
+{
+	uint8_t m[6] = { 0x33, 0x33, g[12], g[13], g[14], g[15] };
+
+	return nm_mcast_mac(m);
+}
+
+static inline u_int
+nm_mcast_hash(uint64_t mac)
+{
+	/* the first three bytes are a constant prefix */
+	return ((uint32_t)(mac >> 24) * 0x9e3779b1U >> 8) % NM_MCAST_GROUPS;
+}
+
+static inline int
+nm_mcast_isset(const uint32_t *map, u_int port)
+{
+	return (map[port >> 5] >> (port & 31)) & 1;
+}
+
+static int
+nm_mcast_empty(const uint32_t *map)
+{
+	u_int i;
+
+	for (i = 0; i < NM_MCAST_WORDS; i++) {
+		if (map[i])
+			return 0;
+	}
+	return 1;
+}
+
+static void
+nm_mcast_routers(struct nm_mcast *m)
+{
+	u_int i;
+
+	for (i = 0; i < NM_MCAST_WORDS; i++)
+		m->routers[i] = m->rstatic[i] | m->rdyn[i];
+}
+
+/* Entry of a group, or -1. If add, create it if needed. */
+static int
+nm_mcast_find(struct nm_mcast *m, uint64_t mac, int add)
+{
+	u_int h = nm_mcast_hash(mac), i;
+	struct nm_mcast_ent *e;
+	int avail = -1;
+
+	for (i = 0; i < NM_MCAST_GROUPS; i++) {
+		e = &m->grp[h];
+		if (e->state == NM_MCAST_USED && e->mac == mac)
+			return h;
+		if (e->state != NM_MCAST_USED && avail < 0)
+			avail = h;
+		if (e->state == NM_MCAST_FREE)
+			break;
+		if (++h == NM_MCAST_GROUPS)
+			h = 0;
+	}
+	if (!add || avail < 0)
+		return -1;
+	e = &m->grp[avail];
+	bzero(e->ports, sizeof(e->ports));
+	e->mac = mac;
+	e->state = NM_MCAST_USED;
+	return avail;
+}
+
+static void
+nm_mcast_join(struct nm_mcast *m, uint64_t mac, u_int port, uint32_t now)
+{
+	int g = nm_mcast_find(m, mac, 1);
+
+	if (g < 0) {
+		RD(1, "group table full");
+		return;
+	}
+	m->grp[g].ports[port >> 5] |= 1U << (port & 31);
+	m->grp[g].last = now;
+}
+
+static void
+nm_mcast_leave(struct nm_mcast *m, uint64_t mac, u_int port)
+{
+	int g = nm_mcast_find(m, mac, 0);
+
+	if (g < 0)
+		return;
+	m->grp[g].ports[port >> 5] &= ~(1U << (port & 31));
+	if (nm_mcast_empty(m->grp[g].ports))
+		m->grp[g].state = NM_MCAST_DELETED;
+}
+
+/* expire old groups and learned routers, at most once per second */
+static void
+nm_mcast_sweep(struct nm_mcast *m, uint32_t now)
+{
+	u_int i;
+
+	if (now == m->last_sweep)
+		return;
+	m->last_sweep = now;
+	for (i = 0; i < NM_MCAST_GROUPS; i++) {
+		struct nm_mcast_ent *e = &m->grp[i];
+
+		if (e->state == NM_MCAST_USED && now - e->last > NM_MCAST_AGE)
+			e->state = NM_MCAST_DELETED;
+	}
+	for (i = 0; i < NM_BDG_MAXPORTS; i++) {
+		if (nm_mcast_isset(m->rdyn, i) &&
+		    now - m->rlast[i] > NM_MCAST_RAGE)
+			m->rdyn[i >> 5] &= ~(1U << (i & 31));
+	}
+	nm_mcast_routers(m);
+}
+
+static void
+nm_mcast_query(struct nm_mcast *m, u_int port, uint32_t now)
+{
+	m->queries++;
+	m->rlast[port] = now;
+	if (!nm_mcast_isset(m->rdyn, port)) {
+		m->rdyn[port >> 5] |= 1U << (port & 31);
+		nm_mcast_routers(m);
+	}
+}
+
+/*
+ * Group record of an IGMPv3/MLDv2 report: join for any EXCLUDE mode
+ * or for sources to include, leave for an empty INCLUDE mode.
+ */
+static void
+nm_mcast_record(struct nm_mcast *m, u_int type, u_int nsrcs, uint64_t mac,
+	u_int port, uint32_t now)
+{
+	if (type == 2 || type == 4 ||
+	    (nsrcs > 0 && (type == 1 || type == 3 || type == 5)))
+		nm_mcast_join(m, mac, port, now);
+	else if (nsrcs == 0 && (type == 1 || type == 3))
+		nm_mcast_leave(m, mac, port);
+}
+
+static void
+nm_mcast_igmp(struct nm_mcast *m, const uint8_t *p, u_int len, u_int port,
+	uint32_t now)
+{
+	const uint8_t *end = p + len;
+	u_int n, i;
+
+	switch (p[0]) {
+	case 0x11:	/* query */
+		nm_mcast_query(m, port, now);
+		break;
+	case 0x12:	/* v1 report */
+	case 0x16:	/* v2 report */
+		m->reports++;
+		nm_mcast_join(m, nm_mcast_mac4(p + 4), port, now);
+		break;
+	case 0x17:	/* v2 leave */
+		m->reports++;
+		nm_mcast_leave(m, nm_mcast_mac4(p + 4), port);
+		break;
+	case 0x22:	/* v3 report */
+		m->reports++;
+		n = (p[6] << 8) | p[7];
+		for (p += 8, i = 0; i < n && p + 8 <= end; i++) {
+			u_int nsrcs = (p[2] << 8) | p[3];
+
+			nm_mcast_record(m, p[0], nsrcs, nm_mcast_mac4(p + 4),
+				port, now);
+			p += 8 + 4 * nsrcs + 4 * p[1];
+		}
+		break;
+	}
+}
+
+static void
+nm_mcast_mld(struct nm_mcast *m, const uint8_t *p, u_int len, u_int port,
+	uint32_t now)
+{
+	const uint8_t *end = p + len;
+	u_int n, i;
+
+	switch (p[0]) {
+	case 130:	/* query */
+		nm_mcast_query(m, port, now);
+		break;
+	case 131:	/* v1 report */
+	case 132:	/* done */
+		if (len < 24)
+			break;
+		m->reports++;
+		if (p[0] == 131)
+			nm_mcast_join(m, nm_mcast_mac6(p + 8), port, now);
+		else
+			nm_mcast_leave(m, nm_mcast_mac6(p + 8), port);
+		break;
+	case 143:	/* v2 report */
+		m->reports++;
+		n = (p[6] << 8) | p[7];
+		for (p += 8, i = 0; i < n && p + 20 <= end; i++) {
+			u_int nsrcs = (p[2] << 8) | p[3];
+
+			nm_mcast_record(m, p[0], nsrcs, nm_mcast_mac6(p + 4),
+				port, now);
+			p += 20 + 16 * nsrcs + 4 * p[1];
+		}
+		break;
+	}
+}
+
+/*
+ * If the frame is an IGMP or MLD message, learn from it and return 1.
+ */
+static int
+nm_mcast_snoop(struct nm_mcast *m, const uint8_t *buf, u_int len, u_int port)
+{
+	u_int off = 14, l, type = (buf[12] << 8) | buf[13];
+	const uint8_t *p;
+	uint32_t now;
+	int mld;
+
+	if (type == 0x8100 && len >= 18) {
+		type = (buf[16] << 8) | buf[17];
+		off = 18;
+	}
+	if (type == 0x0800) {
+		if (len < off + 20 || buf[off + 9] != 2)	/* IGMP */
+			return 0;
+		l = off + ((buf[off] & 0x0f) << 2);
+		if (len < l + 8)
+			return 0;
+		mld = 0;
+	} else if (type == 0x86dd) {
+		u_int nh;
+
+		if (len < off + 40)
+			return 0;
+		nh = buf[off + 6];
+		l = off + 40;
+		if (nh == 0 && len >= l + 8) {	/* hop-by-hop, router alert */
+			nh = buf[l];
+			l += (buf[l + 1] + 1) * 8;
+		}
+		if (nh != 58 || len < l + 8)	/* ICMPv6 */
+			return 0;
+		if (buf[l] != 130 && buf[l] != 131 && buf[l] != 132 &&
+		    buf[l] != 143)
+			return 0;
+		mld = 1;
+	} else {
+		return 0;
+	}
+	p = buf + l;
+	now = NM_MCAST_NOW();
+	mtx_lock(&m->lock);
+	nm_mcast_sweep(m, now);
+	if (mld)
+		nm_mcast_mld(m, p, len - l, port, now);
+	else
+		nm_mcast_igmp(m, p, len - l, port, now);
+	mtx_unlock(&m->lock);
+	return 1;
+}
+
+
+/*
+ * Classify a frame that the lookup function wants to broadcast,
+ * see the comment at the top. The ports that must receive it are
+ * added to mask.
+ */
+u_int
+nm_mcast_classify(struct nm_mcast *m, struct nm_bdg_fwd *ft,
+	struct netmap_vp_adapter *na, uint32_t *mask)
+{
+	const uint8_t *buf = ft->ft_buf;
+	u_int len = ft->ft_len, vh = na->virt_hdr_len, i, ret;
+	u_int port = na->bdg_port;
+	const uint32_t *ports;
+	int g;
+
+	/* as in the learning bridge, a LAG is one port */
+	if (unlikely(na->lag != NULL))
+		port = nm_lag_port(na);
+	if (unlikely(ft->ft_flags & NS_INDIRECT) || len < vh + 14)
+		return NM_MCAST_FLOOD;
+	buf += vh;
+	len -= vh;
+	if (buf[0] == 0x01 && buf[1] == 0x00 && buf[2] == 0x5e) {
+		if (nm_mcast_snoop(m, buf, len, port) ||
+		    (buf[3] == 0 && buf[4] == 0))	/* 224.0.0.x */
+			return NM_MCAST_FLOOD;
+	} else if (buf[0] == 0x33 && buf[1] == 0x33) {
+		if (nm_mcast_snoop(m, buf, len, port) ||
+		    (buf[2] == 0 && buf[3] == 0 && buf[4] == 0)) /* ff02::x */
+			return NM_MCAST_FLOOD;
+	} else {
+		/* broadcast, unknown unicast, non-IP multicast */
+		return NM_MCAST_FLOOD;
+	}
+	g = nm_mcast_find(m, nm_mcast_mac(buf), 0);
+	if (g < 0) {
+		ports = m->routers;
+		ret = NM_MCAST_ROUTERS;
+	} else {
+		ports = m->grp[g].ports;
+		ret = g + NM_MCAST_FIRST;
+	}
+	for (i = 0; i < NM_MCAST_WORDS; i++)
+		mask[i] |= ports[i];
+	return ret;
+}
+
+
+/* Return 1 if port must receive a frame classified as grp (not 0) */
+int
+nm_mcast_member(struct nm_mcast *m, u_int grp, u_int port)
+{
+	return nm_mcast_isset(grp == NM_MCAST_ROUTERS ?
+		m->routers : m->grp[grp - NM_MCAST_FIRST].ports, port);
+}
+
+
+/* forget a port that leaves the switch. Called with the bridge locked */
+void
+netmap_mcast_port_gone(struct nm_mcast *m, u_int port)
+{
+	u_int i;
+
+	if (m == NULL)
+		return;
+	mtx_lock(&m->lock);
+	for (i = 0; i < NM_MCAST_GROUPS; i++) {
+		struct nm_mcast_ent *e = &m->grp[i];
+
+		if (e->state != NM_MCAST_USED)
+			continue;
+		e->ports[port >> 5] &= ~(1U << (port & 31));
+		if (nm_mcast_empty(e->ports))
+			e->state = NM_MCAST_DELETED;
+	}
+	m->rstatic[port >> 5] &= ~(1U << (port & 31));
+	m->rdyn[port >> 5] &= ~(1U << (port & 31));
+	nm_mcast_routers(m);
+	mtx_unlock(&m->lock);
+}
+
+
+void
+netmap_mcast_free(struct nm_mcast *m)
+{
+	if (m == NULL)
+		return;
+	mtx_destroy(&m->lock);
+	free(m, M_DEVBUF);
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() with the
+ * bridge write-locked. mp is the snooping state of the bridge.
+ */
+int
+netmap_mcast_config(struct nm_ifreq *ifr, struct nm_mcast **mp)
+{
+	struct nm_mcast_req *req = (struct nm_mcast_req *)ifr->data;
+	struct nm_mcast *m = *mp;
+	struct netmap_vp_adapter *vpna;
+	u_int i, port;
+
+	if (m == NULL && req->nmc_cmd != NM_MCAST_ON)
+		return ENOENT;
+
+	switch (req->nmc_cmd) {
+	case NM_MCAST_ON:
+		if (m != NULL)
+			return 0;
+		m = malloc(sizeof(*m), M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (m == NULL)
+			return ENOMEM;
+		mtx_init(&m->lock, "nm_mcast_lock", NULL, MTX_DEF);
+		*mp = m;
+		break;
+
+	case NM_MCAST_OFF:
+		*mp = NULL;
+		netmap_mcast_free(m);
+		break;
+
+	case NM_MCAST_ROUTER:
+		vpna = netmap_bdg_port_byname(ifr->nifr_name);
+		if (vpna == NULL)
+			return ENXIO;
+		port = vpna->bdg_port;
+		mtx_lock(&m->lock);
+		if (req->nmc_arg)
+			m->rstatic[port >> 5] |= 1U << (port & 31);
+		else
+			m->rstatic[port >> 5] &= ~(1U << (port & 31));
+		nm_mcast_routers(m);
+		mtx_unlock(&m->lock);
+		break;
+
+	case NM_MCAST_GET:
+		req->nmc_reports = m->reports;
+		req->nmc_queries = m->queries;
+		req->nmc_count = 0;
+		req->nmc_next = 0;
+		for (i = req->nmc_arg; i < NM_MCAST_GROUPS; i++) {
+			struct nm_mcast_ent *e = &m->grp[i];
+			struct nm_mcast_group *rg;
+			u_int j;
+
+			if (e->state != NM_MCAST_USED)
+				continue;
+			if (req->nmc_count == NM_MCAST_REQ_GROUPS) {
+				req->nmc_next = i;
+				break;
+			}
+			rg = &req->nmc_groups[req->nmc_count++];
+			for (j = 0; j < 6; j++)
+				rg->mac[j] = e->mac >> (8 * j);
+			rg->nports = 0;
+			for (j = 0; j < NM_BDG_MAXPORTS; j++)
+				rg->nports += nm_mcast_isset(e->ports, j);
+		}
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+#endif /* WITH_VALE */
@@ -53,6 +53,20 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 241723 2012-10-19 09:41:45Z gle
 MALLOC_DECLARE(M_NETMAP);
 MALLOC_DEFINE(M_NETMAP, "netmap", "Network memory map");
 
+#if __FreeBSD_version >= 1200000
+#include <sys/domainset.h>
+#include <vm/vm_phys.h>		/* vm_ndomains */
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node)		\
+	((node) < 0 ? contigmalloc(sz, ty, flags, a, b, pgsz, c) :	\
+	    contigmalloc_domainset(sz, ty, DOMAINSET_PREF(node),	\
+		flags, a, b, pgsz, c))
+#define nm_numa_node_ok(n)	((n) >= 0 && (n) < vm_ndomains)
+#else
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node)		\
+	contigmalloc(sz, ty, flags, a, b, pgsz, c)
+#define nm_numa_node_ok(n)	((n) == 0)
+#endif
+
 #endif /* __FreeBSD__ */
 
 #ifdef _WIN32
@@ -76,16 +90,28 @@ MALLOC_DEFINE(M_NETMAP, "netmap", "Network memory map");
 enum {
 	NETMAP_IF_POOL   = 0,
 	NETMAP_RING_POOL,
-	NETMAP_BUF_POOL,
+	NETMAP_BUF_POOL,	/* buffer class 0, the default */
+	NETMAP_BUF1_POOL,	/* buffer class 1, optional (may be empty) */
 	NETMAP_POOLS_NR
 };
 
+/* pool for the buffers of class c, see na_bufclass */
+#define netmap_buf_pool(n, c)	(&(n)->pools[NETMAP_BUF_POOL + (c)])
+
 
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
 };
 
+#define NM_OBJ_CACHE	1024	/* max entries in a pool magazine */
+
+/* entry of the page -> cluster table, see netmap_obj_clust() */
+struct netmap_clmap_ent {
+	const char *page;	/* NULL if the entry is free */
+	u_int clust;		/* cluster index */
+};
+
 struct netmap_obj_pool {
 	char name[NETMAP_POOL_MAX_NAMSZ];	/* name of the allocator */
 
@@ -95,12 +121,34 @@ struct netmap_obj_pool {
 	u_int objtotal;         /* actual total number of objects. */
 	u_int memtotal;		/* actual total memory space */
 	u_int numclusters;	/* actual number of clusters */
+	/*
+	 * Objects [0, objpop) are backed by memory, the clusters after
+	 * them are allocated on demand by netmap_obj_populate().
+	 */
+	u_int objpop;
 
 	u_int objfree;          /* number of free objects. */
 
-	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	struct lut_entry *lut;  /* virt,phys addresses, lutsize entries */
+	u_int lutsize;		/* objtotal plus room for netmap_mem_grow() */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
+	uint32_t bitmap_hint;	/* no free objects in bitmap[] before this */
+	/*
+	 * Magazine of recently freed objects, allocated before anything
+	 * else in the bitmap. Cached objects keep their bit set, so the
+	 * bitmap is scanned only when the magazine is empty.
+	 */
+	uint32_t *cache;
+	u_int ncache;		/* valid entries in cache[] */
+	u_int cachesize;	/* capacity of cache[] */
+	/*
+	 * Open addressing hash from the pages of the clusters to the
+	 * cluster index, built only for pools whose objects are looked
+	 * up by address (netmap_if and rings). clmap_mask + 1 entries.
+	 */
+	struct netmap_clmap_ent *clmap;
+	u_int clmap_mask;
 	/* ---------------------------------------------------*/
 
 	/* limits */
@@ -115,17 +163,22 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _huge;		/* clusters are aligned hugepages */
 
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	u_int r_huge;
+	u_int r_objmax;		/* lut entries to reserve for growth */
+	int numa_node;		/* where to allocate the clusters, -1 any */
+	u_int r_prealloc;	/* objects to populate at finalize, 0 all */
 };
 
 #define NMA_LOCK_T		NM_MTX_T
 
 
 struct netmap_mem_ops {
-	int (*nmd_get_lut)(struct netmap_mem_d *, struct netmap_lut*);
+	int (*nmd_get_lut)(struct netmap_mem_d *, struct netmap_lut*, u_int);
 	int  (*nmd_get_info)(struct netmap_mem_d *, u_int *size,
 			u_int *memflags, uint16_t *id);
 
@@ -191,6 +244,7 @@ struct netmap_mem_d {
 
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
+	int nm_numa_node;	/* NUMA node of the clusters, -1 any */
 
 	/* list of all existing allocators, sorted by nm_id */
 	struct netmap_mem_d *prev, *next;
@@ -215,6 +269,13 @@ netmap_mem_##name(struct netmap_mem_d *nmd, t1 a1) \
 	return nmd->ops->nmd_##name(nmd, a1); \
 }
 
+#define NMD_DEFCB2(t0, name, t1, t2) \
+t0 \
+netmap_mem_##name(struct netmap_mem_d *nmd, t1 a1, t2 a2) \
+{ \
+	return nmd->ops->nmd_##name(nmd, a1, a2); \
+}
+
 #define NMD_DEFCB3(t0, name, t1, t2, t3) \
 t0 \
 netmap_mem_##name(struct netmap_mem_d *nmd, t1 a1, t2 a2, t3 a3) \
@@ -236,7 +297,7 @@ netmap_mem_##name(struct netmap_adapter *na, t1 a1) \
 	return na->nm_mem->ops->nmd_##name(na, a1); \
 }
 
-NMD_DEFCB1(int, get_lut, struct netmap_lut *);
+NMD_DEFCB2(int, get_lut, struct netmap_lut *, u_int);
 NMD_DEFCB3(int, get_info, u_int *, u_int *, uint16_t *);
 NMD_DEFCB1(vm_paddr_t, ofstophys, vm_ooffset_t);
 static int netmap_mem_config(struct netmap_mem_d *);
@@ -301,8 +362,10 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		nmd->lasterr = nmd->ops->nmd_finalize(nmd);
 	}
 
-	if (!nmd->lasterr && na->pdev)
+	if (!nmd->lasterr && na->pdev) {
 		netmap_mem_map(&nmd->pools[NETMAP_BUF_POOL], na);
+		netmap_mem_map(&nmd->pools[NETMAP_BUF1_POOL], na);
+	}
 
 	return nmd->lasterr;
 }
@@ -312,6 +375,7 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	NMA_LOCK(nmd);
 	netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
+	netmap_mem_unmap(&nmd->pools[NETMAP_BUF1_POOL], na);
 	NMA_UNLOCK(nmd);
 	return nmd->ops->nmd_deref(nmd);
 }
@@ -319,11 +383,19 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 
 /* accessor functions */
 static int
-netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
+netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut,
+	u_int bufclass)
 {
-	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
-	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	struct netmap_obj_pool *p;
+
+	if (bufclass >= NM_BUF_CLASSES)
+		return EINVAL;
+	p = netmap_buf_pool(nmd, bufclass);
+	if (p->objtotal == 0)
+		return ENOMEM;	/* class not configured */
+	lut->lut = p->lut;
+	lut->objtotal = p->lutsize; /* entries past objtotal map buffer 0 */
+	lut->objsize = p->_objsize;
 
 	return 0;
 }
@@ -341,8 +413,54 @@ static struct netmap_obj_params netmap_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = NETMAP_BUF_MAX_NUM,
 	},
+	[NETMAP_BUF1_POOL] = {	/* e.g. jumbo frames, unused by default */
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
+/*
+ * Build the pools from hugepage sized and aligned clusters,
+ * see netmap_config_obj_allocator(). Takes effect on the
+ * next (re)configuration of an allocator.
+ */
+static int netmap_mem_hugepages = 0;
+
+/*
+ * Upper bound for the online growth of the global buffer pool,
+ * see netmap_mem_grow(). 0 means no growth.
+ */
+static u_int netmap_buf_max_num = 0;
+
+/*
+ * If set, adapters attached afterwards use the global region of the
+ * NUMA node of their device, see netmap_mem_global_node().
+ */
+static int netmap_mem_numa = 0;
+
+/*
+ * Lazy population of the buffer pools. If buf_prealloc_num is
+ * nonzero, only that many buffers are backed by memory when a region
+ * is finalized; more clusters are allocated whenever fewer than
+ * buf_watermark buffers are left.
+ */
+static u_int netmap_buf_prealloc_num = 0;
+static u_int netmap_buf_watermark = 1024;
+static u_int netmap_mem_ready_us = 0;	/* last netmap_mem_finalize_all() */
+
+/*
+ * Size private regions (VALE ports) for exactly the rings, pipes and
+ * extra buffers requested, ignoring the priv_*_num minimums.
+ */
+int netmap_priv_exact = 0;
+
+/*
+ * Size new private regions for this many ports with the geometry of
+ * the one being created, so that the other ports of a group can be
+ * created in the same region (nr_arg2, see netmap_vp_create()).
+ */
+static u_int netmap_priv_group = 1;
+
 static struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
 	[NETMAP_IF_POOL] = {
 		.size = 1024,
@@ -356,6 +474,10 @@ static struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = 4098,
 	},
+	[NETMAP_BUF1_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 
@@ -388,10 +510,18 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_BUF1_POOL] = {
+			.name	= "netmap_buf1",
+			.objminsize = 64,
+			.objmaxsize = 65536,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.nm_numa_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -428,9 +558,17 @@ static const struct netmap_mem_d nm_blueprint = {
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_BUF1_POOL] = {
+			.name	= "%s_buf1",
+			.objminsize = 64,
+			.objmaxsize = 65536,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.flags = NETMAP_MEM_PRIVATE,
+	.nm_numa_node = -1,
 
 	.ops = &netmap_mem_private_ops
 };
@@ -462,6 +600,34 @@ static const struct netmap_mem_d nm_blueprint = {
 DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
+DECLARE_SYSCTLS(NETMAP_BUF1_POOL, buf1);
+
+SYSBEGIN(mem2_huge);
+SYSCTL_INT(_dev_netmap, OID_AUTO, mem_hugepages,
+    CTLFLAG_RW, &netmap_mem_hugepages, 0,
+    "Use 2 MB clusters for the netmap memory pools");
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_max_num,
+    CTLFLAG_RW, &netmap_buf_max_num, 0,
+    "Max number of netmap bufs after growing buf_num at runtime");
+SYSCTL_INT(_dev_netmap, OID_AUTO, mem_numa,
+    CTLFLAG_RW, &netmap_mem_numa, 0,
+    "Use a global memory region per NUMA node for NICs");
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_prealloc_num,
+    CTLFLAG_RW, &netmap_buf_prealloc_num, 0,
+    "Buffers allocated when a region is created, 0 for all");
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_watermark,
+    CTLFLAG_RW, &netmap_buf_watermark, 0,
+    "Free buffers below which more clusters are allocated");
+SYSCTL_INT(_dev_netmap, OID_AUTO, mem_ready_us,
+    CTLFLAG_RD, &netmap_mem_ready_us, 0,
+    "Time to create the last memory region, us");
+SYSCTL_INT(_dev_netmap, OID_AUTO, priv_exact,
+    CTLFLAG_RW, &netmap_priv_exact, 0,
+    "Size private memory regions exactly for the port");
+SYSCTL_INT(_dev_netmap, OID_AUTO, priv_group,
+    CTLFLAG_RW, &netmap_priv_group, 0,
+    "Ports a new private memory region is sized for");
+SYSEND;
 
 /* call with NMA_LOCK(&nm_mem) held */
 static int
@@ -559,6 +725,11 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
 		if (offset >= p[i].memtotal)
 			continue;
+		if (offset / p[i]._objsize >= p[i].objpop) {
+			/* not backed yet, see netmap_obj_populate() */
+			NMA_UNLOCK(nmd);
+			goto nomem;
+		}
 		// now lookup the cluster's address
 #ifndef _WIN32
 		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr) +
@@ -579,6 +750,7 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 			+ p[NETMAP_RING_POOL].memtotal
 			+ p[NETMAP_BUF_POOL].memtotal);
 	NMA_UNLOCK(nmd);
+nomem:
 #ifndef _WIN32
 	return 0;	// XXX bad address
 #else
@@ -638,6 +810,8 @@ win32_build_user_vm_map(struct netmap_mem_d* nmd)
 		int mdl_len = sizeof(PFN_NUMBER) * BYTES_TO_PAGES(clsz);
 		PPFN_NUMBER pSrc, pDst;
 
+		if (p->numclusters == 0)
+			continue; /* optional pool, not configured */
 		/* each pool has a different cluster size so we need to reallocate */
 		tempMdl = IoAllocateMdl(p->lut[0].vaddr, clsz, FALSE, FALSE, NULL);
 		if (tempMdl == NULL) {
@@ -715,33 +889,105 @@ out:
 	return error;
 }
 
+/*
+ * Clusters are page aligned (2 MB aligned for hugepage pools) and
+ * made of whole pages, so every page of the pool belongs to exactly
+ * one cluster. The clmap hashes the page address to the cluster.
+ */
+#define netmap_clmap_unit(p)	((p)->_huge ? NM_HUGE_CLUSTSIZE : PAGE_SIZE)
+
+static inline u_int
+netmap_clmap_hash(struct netmap_obj_pool *p, const char *page)
+{
+	return ((u_int)((uintptr_t)page / netmap_clmap_unit(p)) *
+		2654435761U) & p->clmap_mask;
+}
+
+/* call after the clusters are allocated, 0 or ENOMEM */
+static int
+netmap_obj_clmap_build(struct netmap_obj_pool *p)
+{
+	u_int unit = netmap_clmap_unit(p);
+	u_int n = p->numclusters * (p->_clustsize / unit);
+	u_int sz = 1, c, k;
+
+	while (sz < 2 * n)
+		sz <<= 1;
+	p->clmap = malloc(sizeof(*p->clmap) * sz, M_NETMAP,
+		M_NOWAIT | M_ZERO);
+	if (p->clmap == NULL)
+		return ENOMEM;
+	p->clmap_mask = sz - 1;
+	for (c = 0; c < p->numclusters; c++) {
+		const char *base = p->lut[c * p->_clustentries].vaddr;
+
+		if (base == NULL)
+			continue;
+		for (k = 0; k < p->_clustsize; k += unit) {
+			u_int h = netmap_clmap_hash(p, base + k);
+
+			while (p->clmap[h].page != NULL)
+				h = (h + 1) & p->clmap_mask;
+			p->clmap[h].page = base + k;
+			p->clmap[h].clust = c;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Return the index of the cluster that contains vaddr, or -1.
+ * Constant time on average if the pool has a clmap, otherwise
+ * we scan the clusters.
+ */
+static int
+netmap_obj_clust(struct netmap_obj_pool *p, const void *vaddr)
+{
+	u_int i;
+
+	if (p->clmap != NULL) {
+		const char *page = (const char *)((uintptr_t)vaddr &
+			~((uintptr_t)netmap_clmap_unit(p) - 1));
+
+		for (i = netmap_clmap_hash(p, page); p->clmap[i].page != NULL;
+		    i = (i + 1) & p->clmap_mask) {
+			if (p->clmap[i].page == page)
+				return p->clmap[i].clust;
+		}
+		return -1;
+	}
+	for (i = 0; i * p->_clustentries < p->objpop; i++) {
+		const char *base = p->lut[i * p->_clustentries].vaddr;
+		ssize_t relofs = (const char *)vaddr - base;
+
+		if (base != NULL && relofs >= 0 && relofs < p->_clustsize)
+			return i;
+	}
+	return -1;
+}
+
 /*
  * we store objects by kernel address, need to find the offset
  * within the pool to export the value to userspace.
- * Algorithm: scan until we find the cluster, then add the
- * actual offset in the cluster
+ * Algorithm: find the cluster, then add the actual offset in
+ * the cluster
  */
 static ssize_t
 netmap_obj_offset(struct netmap_obj_pool *p, const void *vaddr)
 {
-	int i, k = p->_clustentries, n = p->objtotal;
-	ssize_t ofs = 0;
-
-	for (i = 0; i < n; i += k, ofs += p->_clustsize) {
-		const char *base = p->lut[i].vaddr;
-		ssize_t relofs = (const char *) vaddr - base;
+	int c = netmap_obj_clust(p, vaddr);
+	ssize_t ofs;
 
-		if (relofs < 0 || relofs >= p->_clustsize)
-			continue;
-
-		ofs = ofs + relofs;
-		ND("%s: return offset %d (cluster %d) for pointer %p",
-		    p->name, ofs, i, vaddr);
-		return ofs;
+	if (c < 0) {
+		D("address %p is not contained inside any cluster (%s)",
+		    vaddr, p->name);
+		return 0; /* An error occurred */
 	}
-	D("address %p is not contained inside any cluster (%s)",
-	    vaddr, p->name);
-	return 0; /* An error occurred */
+	ofs = (ssize_t)c * p->_clustsize + ((const char *)vaddr -
+		(const char *)p->lut[c * p->_clustentries].vaddr);
+	ND("%s: return offset %d (cluster %d) for pointer %p",
+	    p->name, ofs, c, vaddr);
+	return ofs;
 }
 
 /* Helper functions which convert virtual addresses to offsets */
@@ -771,15 +1017,71 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 }
 
 /*
- * report the index, and use start position as a hint,
- * otherwise buffer allocation becomes terribly expensive.
+ * Back the next clusters of the pool with memory, until at least
+ * nfree objects are free or the whole pool is populated. The lut is
+ * filled before the objects are marked free, so the datapath never
+ * sees a free object without an address. Clusters are physically
+ * contiguous (except on windows), so vtophys() is called once per
+ * cluster. Returns ENOMEM if a cluster could not be allocated.
+ * Call with NMA_LOCK held.
+ */
+static int
+netmap_obj_populate(struct netmap_obj_pool *p, u_int nfree)
+{
+	while (p->objfree < nfree && p->objpop < p->objtotal) {
+		u_int i, lim = p->objpop + p->_clustentries;
+		char *clust;
+#ifndef _WIN32
+		vm_paddr_t pa;
+#endif
+
+		/*
+		 * XXX Note, we only need contigmalloc() for buffers attached
+		 * to native interfaces. In all other cases (nifp, netmap rings
+		 * and even buffers for VALE ports or emulated interfaces) we
+		 * can live with standard malloc, because the hardware will not
+		 * access the pages directly.
+		 */
+		clust = contigmalloc_node(p->_clustsize, M_NETMAP,
+		    M_NOWAIT | M_ZERO, (size_t)0, -1UL,
+		    p->_huge ? NM_HUGE_CLUSTSIZE : PAGE_SIZE, 0, p->numa_node);
+		if (clust == NULL) {
+			D("Unable to create cluster at %u for '%s' allocator",
+			    p->objpop, p->name);
+			return ENOMEM;
+		}
+#ifndef _WIN32
+		pa = vtophys(clust);
+#endif
+		for (i = p->objpop; i < lim; i++, clust += p->_objsize) {
+			p->lut[i].vaddr = clust;
+#ifndef _WIN32
+			p->lut[i].paddr = pa;
+			pa += p->_objsize;
+#else
+			p->lut[i].paddr = vtophys(clust);
+#endif
+		}
+		for (i = p->objpop; i < lim; i++)
+			p->bitmap[i >> 5] |= (1U << (i & 31));
+		if (p->objpop / 32 < p->bitmap_hint)
+			p->bitmap_hint = p->objpop / 32;
+		p->objfree += p->_clustentries;
+		p->objpop = lim;
+	}
+	return 0;
+}
+
+/*
+ * Allocate one object and report its index. Recently freed objects
+ * come from the magazine in constant time (and are likely still in
+ * the cache); otherwise we scan the bitmap from bitmap_hint, which
+ * never goes past a free object. Call with NMA_LOCK held.
  */
 static void *
-netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
+netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *index)
 {
-	uint32_t i = 0;			/* index in the bitmap */
-	uint32_t mask, j;		/* slot counter */
-	void *vaddr = NULL;
+	uint32_t i, j, mask, cur;
 
 	if (len > p->_objsize) {
 		D("%s request size %d too large", p->name, len);
@@ -787,36 +1089,81 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 		return NULL;
 	}
 
+	if (p->objpop < p->objtotal && p->objfree <= netmap_buf_watermark)
+		netmap_obj_populate(p, netmap_buf_watermark + 1);
 	if (p->objfree == 0) {
 		D("no more %s objects", p->name);
 		return NULL;
 	}
-	if (start)
-		i = *start;
 
-	/* termination is guaranteed by p->free, but better check bounds on i */
-	while (vaddr == NULL && i < p->bitmap_slots)  {
-		uint32_t cur = p->bitmap[i];
-		if (cur == 0) { /* bitmask is fully used */
-			i++;
-			continue;
+	if (p->ncache > 0) {
+		j = p->cache[--p->ncache];
+		p->bitmap[j / 32] &= ~(1U << (j % 32));
+	} else {
+		/* objfree guarantees termination, but check bounds on i */
+		for (i = p->bitmap_hint; i < p->bitmap_slots; i++) {
+			if (p->bitmap[i] != 0)
+				break;
 		}
+		if (i == p->bitmap_slots) {
+			D("%s bitmap has no free objects, objfree %u",
+			    p->name, p->objfree);
+			return NULL;
+		}
+		cur = p->bitmap[i];
 		/* locate a slot */
 		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
 			;
-
 		p->bitmap[i] &= ~mask; /* mark object as in use */
-		p->objfree--;
-
-		vaddr = p->lut[i * 32 + j].vaddr;
-		if (index)
-			*index = i * 32 + j;
+		p->bitmap_hint = i;
+		j += i * 32;
 	}
-	ND("%s allocator: allocated object @ [%d][%d]: vaddr %p", i, j, vaddr);
+	p->objfree--;
+	ND("%s allocator: allocated object %u vaddr %p", p->name, j,
+	    p->lut[j].vaddr);
 
-	if (start)
-		*start = i;
-	return vaddr;
+	if (index)
+		*index = j;
+	return p->lut[j].vaddr;
+}
+
+
+/*
+ * Allocate up to n objects, storing their indexes in idx[].
+ * Empties the magazine first, then takes whole bitmap words.
+ * Returns the number of objects allocated. Call with NMA_LOCK held.
+ */
+static u_int
+netmap_obj_malloc_bulk(struct netmap_obj_pool *p, uint32_t *idx, u_int n)
+{
+	uint32_t i, j, mask, cur;
+	u_int k = 0;
+
+	if (p->objpop < p->objtotal && p->objfree < n + netmap_buf_watermark)
+		netmap_obj_populate(p, n + netmap_buf_watermark);
+	if (n > p->objfree)
+		n = p->objfree;
+	while (k < n && p->ncache > 0) {
+		j = p->cache[--p->ncache];
+		p->bitmap[j / 32] &= ~(1U << (j % 32));
+		idx[k++] = j;
+	}
+	i = p->bitmap_hint;
+	while (k < n && i < p->bitmap_slots) {
+		cur = p->bitmap[i];
+		for (j = 0, mask = 1; cur != 0 && k < n; j++, mask <<= 1) {
+			if (cur & mask) {
+				cur &= ~mask;
+				idx[k++] = i * 32 + j;
+			}
+		}
+		p->bitmap[i] = cur;
+		if (cur == 0)
+			i++;
+	}
+	p->bitmap_hint = i;
+	p->objfree -= k;
+	return k;
 }
 
 
@@ -834,52 +1181,53 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 		return 1;
 	}
 	ptr = &p->bitmap[j / 32];
-	mask = (1 << (j % 32));
+	mask = (1U << (j % 32));
 	if (*ptr & mask) {
 		D("ouch, double free on buffer %d", j);
 		return 1;
-	} else {
-		*ptr |= mask;
-		p->objfree++;
-		return 0;
 	}
+	*ptr |= mask;
+	p->objfree++;
+	if (j / 32 < p->bitmap_hint)
+		p->bitmap_hint = j / 32;
+	if (p->ncache < p->cachesize)
+		p->cache[p->ncache++] = j;
+	return 0;
 }
 
 /*
- * free by address. This is slow but is only used for a few
- * objects (rings, nifp)
+ * free by address. Only used for a few objects (rings, nifp),
+ * whose pools have a clmap.
  */
 static void
 netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
 {
-	u_int i, j, n = p->numclusters;
-
-	for (i = 0, j = 0; i < n; i++, j += p->_clustentries) {
-		void *base = p->lut[i * p->_clustentries].vaddr;
-		ssize_t relofs = (ssize_t) vaddr - (ssize_t) base;
-
-		/* Given address, is out of the scope of the current cluster.*/
-		if (vaddr < base || relofs >= p->_clustsize)
-			continue;
+	int c = netmap_obj_clust(p, vaddr);
+	u_int j;
 
-		j = j + relofs / p->_objsize;
-		/* KASSERT(j != 0, ("Cannot free object 0")); */
-		netmap_obj_free(p, j);
+	if (c < 0) {
+		D("address %p is not contained inside any cluster (%s)",
+		    vaddr, p->name);
 		return;
 	}
-	D("address %p is not contained inside any cluster (%s)",
-	    vaddr, p->name);
+	j = c * p->_clustentries + ((char *)vaddr -
+		(char *)p->lut[c * p->_clustentries].vaddr) / p->_objsize;
+	/* KASSERT(j != 0, ("Cannot free object 0")); */
+	netmap_obj_free(p, j);
 }
 
 #define netmap_mem_bufsize(n)	\
 	((n)->pools[NETMAP_BUF_POOL]._objsize)
 
-#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL, NULL)
+/* the buffer pool used by the rings of an adapter */
+#define netmap_na_bufpool(na)	netmap_buf_pool((na)->nm_mem, (na)->na_bufclass)
+
+#define netmap_if_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_IF_POOL], len, NULL)
 #define netmap_if_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_IF_POOL], (v))
-#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL, NULL)
+#define netmap_ring_malloc(n, len)	netmap_obj_malloc(&(n)->pools[NETMAP_RING_POOL], len, NULL)
 #define netmap_ring_free(n, v)		netmap_obj_free_va(&(n)->pools[NETMAP_RING_POOL], (v))
-#define netmap_buf_malloc(n, _pos, _index)			\
-	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _pos, _index)
+#define netmap_buf_malloc(p, _index)			\
+	netmap_obj_malloc(p, (p)->_objsize, _index)
 
 
 #if 0 // XXX unused
@@ -888,6 +1236,8 @@ netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
     (netmap_obj_offset(&(n)->pools[NETMAP_BUF_POOL], (v)) / NETMAP_BDG_BUF_SIZE(n))
 #endif
 
+#define NM_BUFS_BATCH	64	/* buffers per netmap_obj_malloc_bulk() */
+
 /*
  * allocate extra buffers in a linked list.
  * returns the actual number.
@@ -896,22 +1246,28 @@ uint32_t
 netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
+	struct netmap_obj_pool *pool = netmap_na_bufpool(na);
+	uint32_t idx[NM_BUFS_BATCH];
+	uint32_t i = 0, k, m;
 
 	NMA_LOCK(nmd);
 
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
+	while (i < n) {
+		m = netmap_obj_malloc_bulk(pool, idx,
+			n - i < NM_BUFS_BATCH ? n - i : NM_BUFS_BATCH);
+		if (m == 0) {
 			D("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
 			break;
 		}
-		RD(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
+		for (k = 0; k < m; k++, i++) {
+			RD(5, "allocate buffer %d -> %d", idx[k], *head);
+			/* link to previous head */
+			*(uint32_t *)pool->lut[idx[k]].vaddr = *head;
+			*head = idx[k];
+		}
 	}
+	na->na_extra_bufs += i;
 
 	NMA_UNLOCK(nmd);
 
@@ -922,8 +1278,7 @@ static void
 netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 {
         struct lut_entry *lut = na->na_lut.lut;
-	struct netmap_mem_d *nmd = na->nm_mem;
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *p = netmap_na_bufpool(na);
 	uint32_t i, cur, *buf;
 
 	D("freeing the extra list");
@@ -935,6 +1290,7 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 		if (netmap_obj_free(p, cur))
 			break;
 	}
+	na->na_extra_bufs -= (i < na->na_extra_bufs) ? i : na->na_extra_bufs;
 	if (head != 0)
 		D("breaking with head %d", head);
 	D("freed %d buffers", i);
@@ -943,25 +1299,27 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
 
 /* Return nonzero on error */
 static int
-netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_new_bufs(struct netmap_obj_pool *p, struct netmap_slot *slot, u_int n)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t idx[NM_BUFS_BATCH];
 	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
+	u_int k, m;
 
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
+	while (i < n) {
+		m = netmap_obj_malloc_bulk(p, idx,
+			n - i < NM_BUFS_BATCH ? n - i : NM_BUFS_BATCH);
+		if (m == 0) {
 			D("no more buffers after %d of %d", i, n);
 			goto cleanup;
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
+		for (k = 0; k < m; k++, i++) {
+			slot[i].buf_idx = idx[k];
+			slot[i].len = p->_objsize;
+			slot[i].flags = 0;
+		}
 	}
 
-	ND("allocated %d buffers, %d available, first at %d", n, p->objfree, pos);
+	ND("allocated %d buffers, %d available", n, p->objfree);
 	return (0);
 
 cleanup:
@@ -974,9 +1332,8 @@ cleanup:
 }
 
 static void
-netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n, uint32_t index)
+netmap_mem_set_ring(struct netmap_obj_pool *p, struct netmap_slot *slot, u_int n, uint32_t index)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
 	u_int i;
 
 	for (i = 0; i < n; i++) {
@@ -988,9 +1345,8 @@ netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
 
 
 static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
+netmap_free_buf(struct netmap_obj_pool *p, uint32_t i)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
 
 	if (i < 2 || i >= p->objtotal) {
 		D("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
@@ -1001,13 +1357,13 @@ netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
 
 
 static void
-netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_free_bufs(struct netmap_obj_pool *p, struct netmap_slot *slot, u_int n)
 {
 	u_int i;
 
 	for (i = 0; i < n; i++) {
 		if (slot[i].buf_idx > 2)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+			netmap_free_buf(p, slot[i].buf_idx);
 	}
 }
 
@@ -1020,6 +1376,15 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	if (p->bitmap)
 		free(p->bitmap, M_NETMAP);
 	p->bitmap = NULL;
+	p->bitmap_hint = 0;
+	if (p->cache)
+		free(p->cache, M_NETMAP);
+	p->cache = NULL;
+	p->ncache = p->cachesize = 0;
+	if (p->clmap)
+		free(p->clmap, M_NETMAP);
+	p->clmap = NULL;
+	p->clmap_mask = 0;
 	if (p->lut) {
 		u_int i;
 
@@ -1029,11 +1394,11 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		 * addresses are stored at multiples of p->_clusterentries
 		 * in the lut.
 		 */
-		for (i = 0; i < p->objtotal; i += p->_clustentries) {
+		for (i = 0; i < p->objpop; i += p->_clustentries) {
 			if (p->lut[i].vaddr)
 				contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
 		}
-		bzero(p->lut, sizeof(struct lut_entry) * p->objtotal);
+		bzero(p->lut, sizeof(struct lut_entry) * p->lutsize);
 #ifdef linux
 		vfree(p->lut);
 #else
@@ -1041,7 +1406,9 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 #endif
 	}
 	p->lut = NULL;
+	p->lutsize = 0;
 	p->objtotal = 0;
+	p->objpop = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
 	p->objfree = 0;
@@ -1082,6 +1449,8 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
 	p->r_objsize = objsize;
+	p->r_huge = netmap_mem_hugepages;
+	p->_huge = 0;
 
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
 #define LINE_ROUND	NM_CACHE_ALIGN	// 64
@@ -1106,6 +1475,24 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	if (p->r_huge) {
+		/*
+		 * Each cluster is one hugepage. Objects must fill it
+		 * exactly (userspace needs the buffers to be contiguous,
+		 * and the next pool must start on a hugepage boundary),
+		 * so round the size up to a power of two.
+		 */
+		for (i = LINE_ROUND; i < (int)objsize; i <<= 1)
+			;
+		if (i <= (int)p->objmaxsize && i <= NM_HUGE_CLUSTSIZE) {
+			objsize = i;
+			clustentries = NM_HUGE_CLUSTSIZE / objsize;
+			p->_huge = 1;
+			goto done;
+		}
+		D("%s: %d bytes objects cannot fill a hugepage",
+			p->name, objsize);
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
@@ -1127,6 +1514,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 		D("unsupported allocation for %d bytes", objsize);
 		return EINVAL;
 	}
+done:
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
 	if (netmap_verbose)
@@ -1172,14 +1560,24 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	if (p->objtotal == 0) {
+		/* optional pool, not configured */
+		p->memtotal = 0;
+		p->objfree = 0;
+		return 0;
+	}
+
+	p->lutsize = p->objtotal;
+	if (p->r_objmax > p->lutsize)
+		p->lutsize = p->r_objmax;
+	p->lut = nm_alloc_lut(p->lutsize);
 	if (p->lut == NULL) {
 		D("Unable to create lookup table for '%s'", p->name);
 		goto clean;
 	}
 
 	/* Allocate the bitmap */
-	n = (p->objtotal + 31) / 32;
+	n = (p->lutsize + 31) / 32;
 	p->bitmap = malloc(sizeof(uint32_t) * n, M_NETMAP, M_NOWAIT | M_ZERO);
 	if (p->bitmap == NULL) {
 		D("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
@@ -1187,73 +1585,58 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		goto clean;
 	}
 	p->bitmap_slots = n;
+	p->bitmap_hint = 0;
+
+	/* the magazine starts empty, all objects are in the bitmap */
+	n = p->objtotal < NM_OBJ_CACHE ? p->objtotal : NM_OBJ_CACHE;
+	p->cache = malloc(sizeof(uint32_t) * n, M_NETMAP, M_NOWAIT | M_ZERO);
+	if (p->cache == NULL) {
+		D("Unable to create object cache for allocator '%s'", p->name);
+		goto clean;
+	}
+	p->cachesize = n;
+	p->ncache = 0;
 
 	/*
-	 * Allocate clusters, init pointers and bitmap
+	 * Allocate clusters, init pointers and bitmap. With r_prealloc
+	 * only the first clusters are allocated now, the others when
+	 * the pool runs low.
 	 */
-
-	n = p->_clustsize;
-	for (i = 0; i < (int)p->objtotal;) {
-		int lim = i + p->_clustentries;
-		char *clust;
-
+	p->objpop = p->objfree = 0;
+	n = p->objtotal;
+	if (p->r_prealloc && p->r_prealloc < n)
+		n = p->r_prealloc;
+	if (netmap_obj_populate(p, n)) {
 		/*
-		 * XXX Note, we only need contigmalloc() for buffers attached
-		 * to native interfaces. In all other cases (nifp, netmap rings
-		 * and even buffers for VALE ports or emulated interfaces) we
-		 * can live with standard malloc, because the hardware will not
-		 * access the pages directly.
-		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
-		if (clust == NULL) {
-			/*
-			 * If we get here, there is a severe memory shortage,
-			 * so halve the allocated memory to reclaim some.
-			 */
-			D("Unable to create cluster at %d for '%s' allocator",
-			    i, p->name);
-			if (i < 2) /* nothing to halve */
-				goto out;
-			lim = i / 2;
-			for (i--; i >= lim; i--) {
-				p->bitmap[ (i>>5) ] &=  ~( 1 << (i & 31) );
-				if (i % p->_clustentries == 0 && p->lut[i].vaddr)
-					contigfree(p->lut[i].vaddr,
-						n, M_NETMAP);
-				p->lut[i].vaddr = NULL;
-			}
-		out:
-			p->objtotal = i;
-			/* we may have stopped in the middle of a cluster */
-			p->numclusters = (i + p->_clustentries - 1) / p->_clustentries;
-			break;
-		}
-		/*
-		 * Set bitmap and lut state for all buffers in the current
-		 * cluster.
-		 *
-		 * [i, lim) is the set of buffer indexes that cover the
-		 * current cluster.
-		 *
-		 * 'clust' is really the address of the current buffer in
-		 * the current cluster as we index through it with a stride
-		 * of p->_objsize.
+		 * If we get here, there is a severe memory shortage,
+		 * so halve the allocated memory to reclaim some.
 		 */
-		for (; i < lim; i++, clust += p->_objsize) {
-			p->bitmap[ (i>>5) ] |=  ( 1 << (i & 31) );
-			p->lut[i].vaddr = clust;
-			p->lut[i].paddr = vtophys(clust);
+		i = p->objpop;
+		if (i < 2) /* nothing to halve */
+			goto out;
+		n = i / 2;
+		for (i--; i >= (int)n; i--) {
+			p->bitmap[ (i>>5) ] &=  ~( 1 << (i & 31) );
+			if (i % p->_clustentries == 0 && p->lut[i].vaddr)
+				contigfree(p->lut[i].vaddr,
+					p->_clustsize, M_NETMAP);
+			p->lut[i].vaddr = NULL;
 		}
+	out:
+		p->objtotal = p->objpop = p->objfree = i;
+		/* we may have stopped in the middle of a cluster */
+		p->numclusters = (i + p->_clustentries - 1) / p->_clustentries;
 	}
-	p->objfree = p->objtotal;
 	p->memtotal = p->numclusters * p->_clustsize;
 	if (p->objfree == 0)
 		goto clean;
+	/* unpopulated and room for growth: same as out of range indexes */
+	for (i = p->objpop; i < (int)p->lutsize; i++)
+		p->lut[i] = p->lut[0];
 	if (netmap_verbose)
-		D("Pre-allocated %d clusters (%d/%dKB) for '%s'",
-		    p->numclusters, p->_clustsize >> 10,
-		    p->memtotal >> 10, p->name);
+		D("Pre-allocated %d/%d clusters (%d/%dKB) for '%s'",
+		    p->objpop / p->_clustentries, p->numclusters,
+		    p->_clustsize >> 10, p->memtotal >> 10, p->name);
 
 	return 0;
 
@@ -1270,9 +1653,12 @@ netmap_memory_config_changed(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		if (nmd->pools[i].r_objsize != netmap_params[i].size ||
-		    nmd->pools[i].r_objtotal != netmap_params[i].num)
+		    nmd->pools[i].r_objtotal != netmap_params[i].num ||
+		    nmd->pools[i].r_huge != netmap_mem_hugepages)
 		    return 1;
 	}
+	if (nmd->pools[NETMAP_BUF_POOL].r_objmax != netmap_buf_max_num)
+		return 1;
 	return 0;
 }
 
@@ -1365,19 +1751,45 @@ static int
 netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 {
 	int i;
+	uint64_t t0;
+
 	if (nmd->flags & NETMAP_MEM_FINALIZED)
 		return 0;
+	t0 = nm_os_gettime_ns();
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
+	nmd->flags |= NETMAP_MEM_HUGE;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		nmd->pools[i].numa_node = nmd->nm_numa_node;
+		nmd->pools[i].r_prealloc = 0;
+#ifndef _WIN32	/* the windows user mapping needs all the clusters */
+		/* buffer pools can be populated on demand (+2 reserved) */
+		if (i >= NETMAP_BUF_POOL && netmap_buf_prealloc_num)
+			nmd->pools[i].r_prealloc = netmap_buf_prealloc_num + 2;
+#endif
 		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
 		if (nmd->lasterr)
 			goto error;
+		/* netmap_if and rings are freed and exported by address */
+		if (i < NETMAP_BUF_POOL && nmd->pools[i].memtotal) {
+			nmd->lasterr = netmap_obj_clmap_build(&nmd->pools[i]);
+			if (nmd->lasterr)
+				goto error;
+		}
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
+		/* the os can use large mappings only if all pools agree */
+		if (!nmd->pools[i]._huge && nmd->pools[i].memtotal)
+			nmd->flags &= ~NETMAP_MEM_HUGE;
+	}
+	/* buffers 0 and 1 are reserved in each class */
+	for (i = NETMAP_BUF_POOL; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		if (p->objpop < 2)
+			continue;
+		p->objfree -= 2;
+		p->bitmap[0] &= ~3U;
 	}
-	/* buffers 0 and 1 are reserved */
-	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
-	nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
 	nmd->flags |= NETMAP_MEM_FINALIZED;
 
 	/* expose info to the ptnetmap guest */
@@ -1394,6 +1806,9 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	if (netmap_verbose)
 		D("Free buffers: %d", nmd->pools[NETMAP_BUF_POOL].objfree);
 
+	netmap_mem_ready_us = (nm_os_gettime_ns() - t0) / 1000;
+	if (netmap_verbose)
+		D("region %d ready in %u us", nmd->nm_id, netmap_mem_ready_us);
 
 	return 0;
 error:
@@ -1455,13 +1870,15 @@ netmap_mem_private_deref(struct netmap_mem_d *nmd)
  */
 struct netmap_mem_d *
 netmap_mem_private_new(const char *name, u_int txr, u_int txd,
-	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes, int *perr)
+	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes, int numa_node,
+	int *perr)
 {
 	struct netmap_mem_d *d = NULL;
 	struct netmap_obj_params p[NETMAP_POOLS_NR];
 	int i, err;
-	u_int v, maxd;
+	u_int v, maxd, nports = netmap_priv_group;
 
+	nm_bound_var(&nports, 1, 1, NM_BDG_MAXPORTS, NULL);
 	d = malloc(sizeof(struct netmap_mem_d),
 			M_DEVBUF, M_NOWAIT | M_ZERO);
 	if (d == NULL) {
@@ -1475,6 +1892,13 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	if (err)
 		goto error;
 
+	if (numa_node >= 0 && !nm_numa_node_ok(numa_node)) {
+		D("%s: no NUMA node %d", name, numa_node);
+		err = EINVAL;
+		goto error;
+	}
+	d->nm_numa_node = numa_node;
+
 	/* account for the fake host rings */
 	txr++;
 	rxr++;
@@ -1482,13 +1906,20 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	/* copy the min values */
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		p[i] = netmap_min_priv_params[i];
+		/* in exact mode only the sizes below count */
+		if (netmap_priv_exact && p[i].num)
+			p[i].num = 1;
+	}
+	if (netmap_priv_exact) {
+		p[NETMAP_IF_POOL].size = 0;
+		p[NETMAP_RING_POOL].size = 0;
 	}
 
 	/* possibly increase them to fit user request */
 	v = sizeof(struct netmap_if) + sizeof(ssize_t) * (txr + rxr);
 	if (p[NETMAP_IF_POOL].size < v)
 		p[NETMAP_IF_POOL].size = v;
-	v = 2 + 4 * npipes;
+	v = nports * (2 + 4 * npipes);
 	if (p[NETMAP_IF_POOL].num < v)
 		p[NETMAP_IF_POOL].num = v;
 	maxd = (txd > rxd) ? txd : rxd;
@@ -1498,7 +1929,7 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 	/* each pipe endpoint needs two tx rings (1 normal + 1 host, fake)
          * and two rx rings (again, 1 normal and 1 fake host)
          */
-	v = txr + rxr + 8 * npipes;
+	v = nports * (txr + rxr + 8 * npipes);
 	if (p[NETMAP_RING_POOL].num < v)
 		p[NETMAP_RING_POOL].num = v;
 	/* for each pipe we only need the buffers for the 4 "real" rings.
@@ -1506,10 +1937,17 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
          * the parent port ring dimension. As a compromise, we allocate twice the
          * space actually needed if the pipe rings were the same size as the parent rings
          */
-	v = (4 * npipes + rxr) * rxd + (4 * npipes + txr) * txd + 2 + extra_bufs;
+	if (netmap_priv_exact) /* the 4 rings of each pipe, parent sizes */
+		v = (2 * npipes + rxr) * rxd + (2 * npipes + txr) * txd;
+	else
+		v = (4 * npipes + rxr) * rxd + (4 * npipes + txr) * txd;
+	v = nports * (v + extra_bufs) + 2;
 		/* the +2 is for the tx and rx fake buffers (indices 0 and 1) */
 	if (p[NETMAP_BUF_POOL].num < v)
 		p[NETMAP_BUF_POOL].num = v;
+	/* buffer class 1 is there only if priv_buf1_num asks for it */
+	if (p[NETMAP_BUF1_POOL].num && p[NETMAP_BUF1_POOL].num < v)
+		p[NETMAP_BUF1_POOL].num = v;
 
 	if (netmap_verbose)
 		D("req if %d*%d ring %d*%d buf %d*%d",
@@ -1543,15 +1981,83 @@ error:
 }
 
 
+/*
+ * Online growth of the buffer pool of the global region.
+ * When dev.netmap.buf_num is raised while the region is in use, we
+ * append clusters at the end of the region, up to the lut entries
+ * reserved by dev.netmap.buf_max_num. Existing buffers, offsets and
+ * na_lut copies do not change, and the datapath never takes the
+ * allocator lock, so it is not stalled. Processes that already
+ * mapped the region find the new size in nifp->ni_memsize and can
+ * extend their mapping with nm_remap().
+ *
+ * Only the last pool can grow without moving the others, so this
+ * is not possible when buffer class 1 is in use, and the ring pool
+ * cannot grow. Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_grow(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *ifp = &nmd->pools[NETMAP_IF_POOL];
+	u_int want = netmap_params[NETMAP_BUF_POOL].num;
+	u_int i, n0 = p->objtotal;
+
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED) || want <= p->r_objtotal)
+		return;
+	p->r_objtotal = want;	/* do not retry the same request */
+	if (nmd->pools[NETMAP_BUF1_POOL].memtotal != 0) {
+		D("%s is not at the end of the region, cannot grow", p->name);
+		return;
+	}
+	if (p->objtotal % p->_clustentries) {
+		/* a short allocation left a partial cluster at the end */
+		D("%s ends with a partial cluster, cannot grow", p->name);
+		return;
+	}
+	if (want > p->lutsize) {
+		D("%s limited to %u buffers, see buf_max_num",
+			p->name, p->lutsize);
+		want = p->lutsize;
+	}
+	/* extend the layout first, the memory comes later or on demand */
+	while (p->objtotal < want &&
+	    p->objtotal + p->_clustentries <= p->lutsize) {
+		p->objtotal += p->_clustentries;
+		p->numclusters++;
+		p->memtotal += p->_clustsize;
+		nmd->nm_totalsize += p->_clustsize;
+	}
+	if (p->r_prealloc == 0 &&
+	    netmap_obj_populate(p, p->objfree + p->objtotal - p->objpop))
+		D("out of memory after %u new buffers, the others on demand",
+			p->objpop - n0);
+	if (p->objtotal == n0)
+		return;
+
+	/* tell the processes that mapped the region */
+	for (i = 0; i < ifp->objtotal; i++) {
+		struct netmap_if *nifp = ifp->lut[i].vaddr;
+
+		if (ifp->bitmap[i >> 5] & (1U << (i & 31)))
+			continue; /* not in use */
+		*(uint32_t *)(uintptr_t)&nifp->ni_memsize = nmd->nm_totalsize;
+	}
+	D("%s grown from %u to %u buffers, region now %u bytes", p->name,
+		n0, p->objtotal, nmd->nm_totalsize);
+}
+
 /* call with lock held */
 static int
 netmap_mem_global_config(struct netmap_mem_d *nmd)
 {
 	int i;
 
-	if (nmd->active)
-		/* already in use, we cannot change the configuration */
+	if (nmd->active) {
+		/* already in use, we can only add buffers */
+		netmap_mem_grow(nmd);
 		goto out;
+	}
 
 	if (!netmap_memory_config_changed(nmd))
 		goto out;
@@ -1572,6 +2078,7 @@ netmap_mem_global_config(struct netmap_mem_d *nmd)
 		if (nmd->lasterr)
 			goto out;
 	}
+	nmd->pools[NETMAP_BUF_POOL].r_objmax = netmap_buf_max_num;
 
 out:
 
@@ -1615,10 +2122,145 @@ netmap_mem_global_delete(struct netmap_mem_d *nmd)
 	int i;
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-	    netmap_destroy_obj_allocator(&nm_mem.pools[i]);
+	    netmap_destroy_obj_allocator(&nmd->pools[i]);
 	}
 
-	NMA_LOCK_DESTROY(&nm_mem);
+	NMA_LOCK_DESTROY(nmd);
+	if (nmd != &nm_mem) {
+		nm_mem_release_id(nmd);
+		free(nmd, M_DEVBUF);
+	}
+}
+
+/*
+ * Global regions of the NUMA nodes, created on demand, with the
+ * same parameters as nm_mem. Each holds a reference until
+ * netmap_mem_fini(). Protected by NMA_LOCK(&nm_mem).
+ */
+#define NM_MEM_NUMA_MAX	64
+static struct netmap_mem_d *nm_mem_numa[NM_MEM_NUMA_MAX];
+
+/*
+ * Returns the global region to be used by a device on the given
+ * NUMA node: nm_mem unless dev.netmap.mem_numa is set.
+ * The caller gets its own reference with netmap_mem_get().
+ */
+struct netmap_mem_d *
+netmap_mem_global_node(int node)
+{
+	struct netmap_mem_d *d;
+	int i;
+
+	if (!netmap_mem_numa || node < 0 || node >= NM_MEM_NUMA_MAX ||
+	    !nm_numa_node_ok(node))
+		return &nm_mem;
+
+	NMA_LOCK(&nm_mem);
+	d = nm_mem_numa[node];
+	if (d != NULL)
+		goto out;
+	d = malloc(sizeof(*d), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (d == NULL)
+		goto out;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &d->pools[i];
+
+		snprintf(p->name, sizeof(p->name), "%s@%d",
+			nm_mem.pools[i].name, node);
+		p->objminsize = nm_mem.pools[i].objminsize;
+		p->objmaxsize = nm_mem.pools[i].objmaxsize;
+		p->nummin = nm_mem.pools[i].nummin;
+		p->nummax = nm_mem.pools[i].nummax;
+	}
+	d->nm_grp = -1;
+	d->nm_numa_node = node;
+	d->ops = &netmap_mem_global_ops;
+	if (nm_mem_assign_id_locked(d)) {
+		free(d, M_DEVBUF);
+		d = NULL;
+		goto out;
+	}
+	NMA_LOCK_INIT(d);
+	d->refcount = 1;	/* dropped in netmap_mem_fini() */
+	nm_mem_numa[node] = d;
+	if (netmap_verbose)
+		D("new global region %d for NUMA node %d", d->nm_id, node);
+out:
+	NMA_UNLOCK(&nm_mem);
+	return d ? d : &nm_mem;
+}
+
+int
+netmap_mem_get_numa_node(struct netmap_mem_d *nmd)
+{
+	return nmd->nm_numa_node;
+}
+
+uint16_t
+netmap_mem_get_id(struct netmap_mem_d *nmd)
+{
+	return nmd->nm_id;
+}
+
+/*
+ * Look up an allocator by id, used to put several ports in the
+ * same region. Returns it with a new reference, or NULL.
+ */
+struct netmap_mem_d *
+netmap_mem_find(nm_memid_t id)
+{
+	struct netmap_mem_d *nmd = NULL;
+	struct netmap_mem_d *scan;
+
+	NMA_LOCK(&nm_mem);
+	scan = netmap_last_mem_d;
+	do {
+		if (scan->nm_id == id) {
+			/* nm_mem is already locked */
+			if (scan != &nm_mem)
+				NMA_LOCK(scan);
+			if (scan->refcount > 0) { /* not being deleted */
+				nmd = scan;
+				nmd->refcount++;
+				NM_DBG_REFC(nmd, __FUNCTION__, __LINE__);
+			}
+			if (scan != &nm_mem)
+				NMA_UNLOCK(scan);
+			break;
+		}
+		scan = scan->next;
+	} while (scan != netmap_last_mem_d);
+	NMA_UNLOCK(&nm_mem);
+	return nmd;
+}
+
+/*
+ * Memory used by a port in its region, in bytes: rings and their
+ * buffers, extra buffers and one netmap_if per open file.
+ */
+u_int
+netmap_mem_port_size(struct netmap_adapter *na)
+{
+	struct netmap_mem_d *nmd = na->nm_mem;
+	struct netmap_obj_pool *bp = netmap_na_bufpool(na);
+	u_int sz = 0, i;
+	enum txrx t;
+
+	if (na->tx_rings == NULL) /* not open, e.g. a persistent port */
+		return 0;
+	for_rx_tx(t) {
+		for (i = 0; i < netmap_real_rings(na, t); i++) {
+			struct netmap_kring *kring = &NMR(na, t)[i];
+
+			if (kring->ring == NULL)
+				continue;
+			sz += nmd->pools[NETMAP_RING_POOL]._objsize +
+				kring->nkr_num_slots * bp->_objsize;
+		}
+	}
+	sz += na->na_extra_bufs * bp->_objsize;
+	sz += na->active_fds * nmd->pools[NETMAP_IF_POOL]._objsize;
+	return sz;
 }
 
 int
@@ -1632,6 +2274,14 @@ netmap_mem_init(void)
 void
 netmap_mem_fini(void)
 {
+	int i;
+
+	for (i = 0; i < NM_MEM_NUMA_MAX; i++) {
+		if (nm_mem_numa[i] == NULL)
+			continue;
+		netmap_mem_put(nm_mem_numa[i]);
+		nm_mem_numa[i] = NULL;
+	}
 	netmap_mem_put(&nm_mem);
 }
 
@@ -1648,7 +2298,8 @@ netmap_free_rings(struct netmap_adapter *na)
 
 			if (ring == NULL)
 				continue;
-			netmap_free_bufs(na->nm_mem, ring->slot, kring->nkr_num_slots);
+			netmap_free_bufs(netmap_na_bufpool(na), ring->slot,
+				kring->nkr_num_slots);
 			netmap_ring_free(na->nm_mem, ring);
 			kring->ring = NULL;
 		}
@@ -1665,10 +2316,15 @@ netmap_free_rings(struct netmap_adapter *na)
 static int
 netmap_mem2_rings_create(struct netmap_adapter *na)
 {
+	struct netmap_obj_pool *bp = netmap_na_bufpool(na);
+	ssize_t bofs = 0;	/* offset of the buffer pool in the region */
 	enum txrx t;
+	int j;
 
 	NMA_LOCK(na->nm_mem);
 
+	for (j = 0; j < NETMAP_BUF_POOL + (int)na->na_bufclass; j++)
+		bofs += na->nm_mem->pools[j].memtotal;
 	for_rx_tx(t) {
 		u_int i;
 
@@ -1693,28 +2349,26 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			kring->ring = ring;
 			*(uint32_t *)(uintptr_t)&ring->num_slots = ndesc;
 			*(int64_t *)(uintptr_t)&ring->buf_ofs =
-			    (na->nm_mem->pools[NETMAP_IF_POOL].memtotal +
-				na->nm_mem->pools[NETMAP_RING_POOL].memtotal) -
-				netmap_ring_offset(na->nm_mem, ring);
+			    bofs - netmap_ring_offset(na->nm_mem, ring);
 
 			/* copy values from kring */
 			ring->head = kring->rhead;
 			ring->cur = kring->rcur;
 			ring->tail = kring->rtail;
 			*(uint16_t *)(uintptr_t)&ring->nr_buf_size =
-				netmap_mem_bufsize(na->nm_mem);
+				bp->_objsize;
 			ND("%s h %d c %d t %d", kring->name,
 				ring->head, ring->cur, ring->tail);
 			ND("initializing slots for %s_ring", nm_txrx2str(txrx));
 			if (i != nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
 				/* this is a real ring */
-				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
+				if (netmap_new_bufs(bp, ring->slot, ndesc)) {
 					D("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
 					goto cleanup;
 				}
 			} else {
 				/* this is a fake ring, set all indices to 0 */
-				netmap_mem_set_ring(na->nm_mem, ring->slot, ndesc, 0);
+				netmap_mem_set_ring(bp, ring->slot, ndesc, 0);
 			}
 		        /* ring info */
 		        *(uint16_t *)(uintptr_t)&ring->ringid = kring->ring_id;
@@ -1785,6 +2439,7 @@ netmap_mem2_if_new(struct netmap_adapter *na)
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(uint32_t *)(uintptr_t)&nifp->ni_memsize = na->nm_mem->nm_totalsize;
 	strncpy(nifp->ni_name, na->name, (size_t)IFNAMSIZ);
 
 	/*
@@ -1931,11 +2586,12 @@ netmap_mem_pt_guest_read_shared_info(struct netmap_mem_d *nmd)
 }
 
 static int
-netmap_mem_pt_guest_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
+netmap_mem_pt_guest_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut,
+	u_int bufclass)
 {
 	struct netmap_mem_ptg *pv = (struct netmap_mem_ptg *)nmd;
 
-	if (!(nmd->flags & NETMAP_MEM_FINALIZED)) {
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED) || bufclass != 0) {
 		return EINVAL;
 	}
 
@@ -2188,6 +2844,7 @@ netmap_mem_pt_guest_create(nm_memid_t host_id)
 	}
 
 	pv->up.ops = &netmap_mem_pt_guest_ops;
+	pv->up.nm_numa_node = -1;
 	pv->nm_host_id = host_id;
 
         /* Assign new id in the guest (We have the lock) */
@@ -117,7 +117,7 @@
 
 extern struct netmap_mem_d nm_mem;
 
-int	   netmap_mem_get_lut(struct netmap_mem_d *, struct netmap_lut *);
+int	   netmap_mem_get_lut(struct netmap_mem_d *, struct netmap_lut *, u_int bufclass);
 vm_paddr_t netmap_mem_ofstophys(struct netmap_mem_d *, vm_ooffset_t);
 #ifdef _WIN32
 PMDL win32_build_user_vm_map(struct netmap_mem_d* nmd);
@@ -135,7 +135,12 @@ int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags,
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new(const char *name,
 	u_int txr, u_int txd, u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
-	int* error);
+	int numa_node, int* error);
+struct netmap_mem_d* netmap_mem_global_node(int numa_node);
+struct netmap_mem_d* netmap_mem_find(uint16_t id);
+uint16_t   netmap_mem_get_id(struct netmap_mem_d *);
+u_int	   netmap_mem_port_size(struct netmap_adapter *);
+int	   netmap_mem_get_numa_node(struct netmap_mem_d *);
 void	   netmap_mem_delete(struct netmap_mem_d *);
 
 //#define NM_DEBUG_MEM_PUTGET 1
@@ -170,6 +175,9 @@ struct netmap_mem_d* netmap_mem_pt_guest_attach(struct ptnetmap_memdev *, uint16
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
+#define NETMAP_MEM_HUGE		0x8	/* pools made of aligned hugepages */
+
+#define NM_HUGE_CLUSTSIZE	(1<<21)	/* 2 MB, cluster size with hugepages */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
 
@@ -778,6 +778,8 @@ netmap_get_monitor_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		 */
 		mna->up.nm_mem = pna->nm_mem;
 		mna->up.na_lut = pna->na_lut;
+		mna->up.na_bufclass = pna->na_bufclass;
+		mna->up.na_flags |= NAF_BUFCLASS_FIXED;
 	} else {
 		/* normal monitors are incompatible with zero copy ones */
 		for_rx_tx(t) {
@@ -59,21 +59,197 @@
 #include <dev/netmap/netmap_kern.h>
 
 
+/*
+ * Checksum helpers for the offloadings datapath.
+ *
+ * Sums are kept unfolded in 64 bits, in the native byte order of the
+ * 16 bit words in memory, so they can be stored back into a packet
+ * with no byte swapping. Data is summed as 32 bit words into the 64 bit
+ * accumulator, so carries never overflow for any frame size.
+ * See examples/testcsum.c for a comparison with the 16 bit loop of
+ * nm_os_csum_raw() on FreeBSD and with an AVX2 version, which is not
+ * used here because saving the FPU state in the kernel costs more
+ * than it saves on packet sized buffers.
+ * On Linux the architecture specific csum_partial() and
+ * csum_partial_copy_nocheck() replace the portable loops. The latter
+ * copies and sums in a single pass where the architecture has it
+ * (e.g. x86), and falls back to memcpy() and csum_partial() elsewhere.
+ */
+static inline uint16_t
+nm_csum_fold(uint64_t sum)	/* not complemented */
+{
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+/* sum of a block starting at an odd offset in the checksummed area */
+static inline uint64_t
+nm_csum_swap(uint64_t sum)
+{
+	uint16_t s = nm_csum_fold(sum);
+
+	return (uint16_t)((s << 8) | (s >> 8));
+}
+
+#ifdef linux
+static inline uint64_t
+nm_csum_partial(const uint8_t *p, u_int len, uint64_t sum)
+{
+	return sum + (uint32_t)nm_os_csum_raw((uint8_t *)p, len, 0);
+}
+
+static inline uint64_t
+nm_csum_copy(const uint8_t *src, uint8_t *dst, u_int len, uint64_t sum,
+	     int odd)
+{
+	uint64_t s;
+
+#ifdef NETMAP_LINUX_HAVE_CSUM_COPY_NOSUM
+	/* seeded with ~0, which is 0 in one's complement */
+	s = (uint32_t)csum_partial_copy_nocheck(src, dst, len);
+#else
+	s = (uint32_t)csum_partial_copy_nocheck(src, dst, len, 0);
+#endif
+	return sum + (odd ? nm_csum_swap(s) : s);
+}
+
+#else /* !linux */
+static inline uint64_t
+nm_csum_partial(const uint8_t *p, u_int len, uint64_t sum)
+{
+	uint32_t w[8];
+	uint16_t t = 0;
+
+	for (; len >= 32; len -= 32, p += 32) {
+		memcpy(w, p, 32);
+		sum += (uint64_t)w[0] + w[1] + w[2] + w[3] +
+			w[4] + w[5] + w[6] + w[7];
+	}
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(w, p, 4);
+		sum += w[0];
+	}
+	if (len >= 2) {
+		memcpy(&t, p, 2);
+		sum += t;
+		p += 2;
+		len -= 2;
+	}
+	if (len) {	/* odd byte, padded with zero */
+		t = 0;
+		memcpy(&t, p, 1);
+		sum += t;
+	}
+	return sum;
+}
+
+/*
+ * Copy 'len' bytes and add their sum to 'sum' in a single pass.
+ * 'odd' tells that the block starts at an odd offset from the
+ * beginning of the checksummed area.
+ */
+static inline uint64_t
+nm_csum_copy(const uint8_t *src, uint8_t *dst, u_int len, uint64_t sum,
+	     int odd)
+{
+	uint64_t w, s = 0;
+	uint16_t t;
+	u_int l = len;
+
+	for (; l >= 8; l -= 8, src += 8, dst += 8) {
+		memcpy(&w, src, 8);
+		memcpy(dst, &w, 8);
+		s += (w & 0xffffffff) + (w >> 32);
+	}
+	for (; l >= 2; l -= 2, src += 2, dst += 2) {
+		memcpy(&t, src, 2);
+		memcpy(dst, &t, 2);
+		s += t;
+	}
+	if (l) {
+		t = 0;
+		*dst = *src;
+		memcpy(&t, src, 1);
+		s += t;
+	}
+	return sum + (odd ? nm_csum_swap(s) : s);
+}
+#endif /* !linux */
+
+/* the 16 bit word at p, as summed by nm_csum_partial() */
+static inline uint64_t
+nm_csum_word(const void *p)
+{
+	uint16_t t;
+
+	memcpy(&t, p, 2);
+	return t;
+}
+
+/*
+ * Constant part of the checksums of the segments of a GSO packet,
+ * computed once from the original headers. Per-segment fields
+ * (lengths, IP id, TCP seq and flags, the checksums) are excluded
+ * and added back by gso_fix_segment().
+ */
+struct nm_gso_csum {
+	uint64_t	ip_base;	/* IPv4 header */
+	uint64_t	l4_base;	/* pseudo header + TCP/UDP header */
+};
+
+static void
+gso_csum_init(struct nm_gso_csum *c, const uint8_t *hdr, u_int tcp,
+	      u_int iphlen, u_int hdrlen)
+{
+	const uint8_t *ip = hdr + 14, *l4 = hdr + 14 + iphlen;
+	uint16_t proto = htobe16(tcp ? 6 : 17);
+
+	if (iphlen == 20) {
+		/* skip tot_len, id, check */
+		c->ip_base = nm_csum_partial(ip, 2, 0) +
+			nm_csum_partial(ip + 6, 4, 0) +
+			nm_csum_partial(ip + 12, 8, 0);
+		c->l4_base = nm_csum_partial(ip + 12, 8, 0);	/* addresses */
+	} else {
+		c->ip_base = 0;
+		c->l4_base = nm_csum_partial(ip + 8, 32, 0);
+	}
+	c->l4_base += nm_csum_word(&proto);
+	if (tcp) {
+		/* skip seq, offset/flags, check */
+		c->l4_base += nm_csum_partial(l4, 4, 0) +
+			nm_csum_partial(l4 + 8, 4, 0) +
+			nm_csum_partial(l4 + 14, 2, 0) +
+			nm_csum_partial(l4 + 18, hdrlen - 14 - iphlen - 18, 0);
+	} else {
+		/* skip len, check */
+		c->l4_base += nm_csum_partial(l4, 4, 0);
+	}
+}
+
 
 /* This routine is called by bdg_mismatch_datapath() when it finishes
  * accumulating bytes for a segment, in order to fix some fields in the
  * segment headers (which still contain the same content as the header
  * of the original GSO packet). 'buf' points to the beginning (e.g.
  * the ethernet header) of the segment, and 'len' is its length.
+ * 'c' holds the constant part of the checksums and 'payload_sum' the
+ * sum of the payload, accumulated while copying it, so the checksums
+ * are updated without reading the segment again.
  */
 static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 			    u_int segmented_bytes, u_int last_segment,
-			    u_int tcp, u_int iphlen)
+			    u_int tcp, u_int iphlen,
+			    const struct nm_gso_csum *c, uint64_t payload_sum)
 {
 	struct nm_iphdr *iph = (struct nm_iphdr *)(buf + 14);
 	struct nm_ipv6hdr *ip6h = (struct nm_ipv6hdr *)(buf + 14);
 	uint16_t *check = NULL;
-	uint8_t *check_data = NULL;
+	uint16_t l4len = htobe16(len-14-iphlen);
+	uint64_t sum = c->l4_base + payload_sum + nm_csum_word(&l4len);
 
 	if (iphlen == 20) {
 		/* Set the IPv4 "Total Length" field. */
@@ -84,9 +260,9 @@ static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 		iph->id = htobe16(be16toh(iph->id) + idx);
 		ND("ip identification %u", be16toh(iph->id));
 
-		/* Compute and insert the IPv4 header checksum. */
-		iph->check = 0;
-		iph->check = nm_os_csum_ipv4(iph);
+		/* Update the IPv4 header checksum. */
+		iph->check = ~nm_csum_fold(c->ip_base +
+			nm_csum_word(&iph->tot_len) + nm_csum_word(&iph->id));
 		ND("IP csum %x", be16toh(iph->check));
 	} else {/* if (iphlen == 40) */
 		/* Set the IPv6 "Payload Len" field. */
@@ -107,7 +283,8 @@ static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 		ND("last_segment %u", last_segment);
 
 		check = &tcph->check;
-		check_data = (uint8_t *)tcph;
+		sum += nm_csum_partial((uint8_t *)&tcph->seq, 4, 0) +
+			nm_csum_word(&tcph->doff);
 	} else { /* UDP */
 		struct nm_udphdr *udph = (struct nm_udphdr *)(buf + 14 + iphlen);
 
@@ -115,15 +292,13 @@ static void gso_fix_segment(uint8_t *buf, size_t len, u_int idx,
 		udph->len = htobe16(len-14-iphlen);
 
 		check = &udph->check;
-		check_data = (uint8_t *)udph;
+		sum += nm_csum_word(&udph->len);
 	}
 
-	/* Compute and insert TCP/UDP checksum. */
-	*check = 0;
-	if (iphlen == 20)
-		nm_os_csum_tcpudp_ipv4(iph, check_data, len-14-iphlen, check);
-	else
-		nm_os_csum_tcpudp_ipv6(ip6h, check_data, len-14-iphlen, check);
+	/* Insert the TCP/UDP checksum. */
+	*check = ~nm_csum_fold(sum);
+	if (!tcp && *check == 0)
+		*check = 0xffff;
 
 	ND("TCP/UDP csum %x", be16toh(*check));
 }
@@ -218,6 +393,10 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		/* Is this a TCP or an UDP GSO packet? */
 		u_int tcp = ((vh->gso_type & ~VIRTIO_NET_HDR_GSO_ECN)
 				== VIRTIO_NET_HDR_GSO_UDP) ? 0 : 1;
+		/* Constant part of the checksums, and sum of the payload
+		 * of the current segment. */
+		struct nm_gso_csum gso_csum;
+		uint64_t payload_sum = 0;
 
 		/* Segment the GSO packet contained into the input slots (frags). */
 		while (ft_p != ft_end) {
@@ -252,6 +431,8 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 
 				ND(3, "gso_hdr_len %u gso_mtu %d", gso_hdr_len,
 								dst_na->mfs);
+				gso_csum_init(&gso_csum, gso_hdr, tcp, iphlen,
+						gso_hdr_len);
 
 				/* Advance source pointers. */
 				src += gso_hdr_len;
@@ -276,7 +457,8 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 			copy = src_len;
 			if (gso_bytes + copy > dst_na->mfs)
 				copy = dst_na->mfs - gso_bytes;
-			memcpy(dst + gso_bytes, src, copy);
+			payload_sum = nm_csum_copy(src, dst + gso_bytes, copy,
+					payload_sum, (gso_bytes - gso_hdr_len) & 1);
 			gso_bytes += copy;
 			src += copy;
 			src_len -= copy;
@@ -291,7 +473,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				gso_fix_segment(dst, gso_bytes, gso_idx,
 						segmented_bytes,
 						src_len == 0 && ft_p + 1 == ft_end,
-						tcp, iphlen);
+						tcp, iphlen, &gso_csum, payload_sum);
 
 				ND("frame %u completed with %d bytes", gso_idx, (int)gso_bytes);
 				slot->len = gso_bytes;
@@ -306,6 +488,7 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 				dst = NMB(&dst_na->up, slot);
 
 				gso_bytes = 0;
+				payload_sum = 0;
 				gso_idx++;
 			}
 
@@ -323,8 +506,10 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	} else {
 		/* Address of a checksum field into a destination slot. */
 		uint16_t *check = NULL;
-		/* Accumulator for an unfolded checksum. */
-		rawsum_t csum = 0;
+		/* Accumulator for an unfolded checksum, and number of bytes
+		 * summed so far. */
+		uint64_t csum = 0;
+		u_int covered = 0;
 
 		/* Process a non-GSO packet. */
 
@@ -338,26 +523,30 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		while (ft_p != ft_end) {
-			/* Init/update the packet checksum if needed. */
-			if (vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-				if (!dst_slots)
-					csum = nm_os_csum_raw(src + vh->csum_start,
-								src_len - vh->csum_start, 0);
-				else
-					csum = nm_os_csum_raw(src, src_len, csum);
-			}
-
-			/* Round to a multiple of 64 */
-			src_len = (src_len + 63) & ~63;
+			/* The checksum starts at csum_start in the first
+			 * slot, and the data is summed while it is copied. */
+			u_int skip = (check && !dst_slots) ? vh->csum_start : 0;
 
 			if (ft_p->ft_flags & NS_INDIRECT) {
-				if (copyin(src, dst, src_len)) {
+				/* Round to a multiple of 64 */
+				if (copyin(src, dst, (src_len + 63) & ~63)) {
 					/* Invalid user pointer, pretend len is 0. */
 					dst_len = 0;
+				} else if (check) {
+					uint64_t s = nm_csum_partial(dst + skip,
+							src_len - skip, 0);
+
+					csum += (covered & 1) ? nm_csum_swap(s) : s;
 				}
+			} else if (check) {
+				memcpy(dst, src, skip);
+				csum = nm_csum_copy(src + skip, dst + skip,
+						src_len - skip, csum, covered & 1);
 			} else {
-				memcpy(dst, src, (int)src_len);
+				/* Round to a multiple of 64 */
+				memcpy(dst, src, (int)((src_len + 63) & ~63));
 			}
+			covered += src_len - skip;
 			slot->len = dst_len;
 
 			dst_slots++;
@@ -375,8 +564,8 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 		}
 
 		/* Finalize (fold) the checksum if needed. */
-		if (check && vh && (vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
-			*check = nm_os_csum_fold(csum);
+		if (check) {
+			*check = ~nm_csum_fold(csum);
 		}
 		ND(3, "using %u dst_slots", dst_slots);
 
@@ -399,3 +588,231 @@ void bdg_mismatch_datapath(struct netmap_vp_adapter *na,
 	}
 	*howmany -= dst_slots;
 }
+
+
+/*
+ * Receive side coalescing (GRO).
+ *
+ * Used by nm_bdg_flush() when a port without virtio-net header
+ * (typically a NIC) sends to a port with one, and bridge_gro is set.
+ * Consecutive in-order TCPv4 segments of the same flow, queued for the
+ * same destination in the current batch, are merged into a single
+ * frame with a VIRTIO_NET_HDR_GSO_TCPV4 header, spread on as many
+ * destination slots as needed. The receiver then sees one packet
+ * instead of up to 64KB / MSS.
+ *
+ * As in Linux GRO, segments are merged only if all their headers match
+ * except for the sequence number and the PSH flag, which ends a train,
+ * and only plain data segments (ACK, optionally PSH) are considered.
+ * A broadcast in the batch also ends a train, so that the destination
+ * gets the packets in the order they were sent.
+ * The TCP checksum of each segment is verified before merging, the
+ * merged frame carries the pseudo-header sum and NEEDS_CSUM.
+ */
+
+struct nm_gro_seg {
+	uint8_t	*buf;		/* ethernet header */
+	u_int	hlen;		/* ethernet + IPv4 + TCP headers */
+	u_int	plen;		/* TCP payload */
+};
+
+/* TCP pseudo-header sum for the given TCP length */
+static uint64_t
+gro_pseudo_sum(struct nm_iphdr *iph, u_int tcplen)
+{
+	uint8_t ph[12];
+
+	memcpy(ph, &iph->saddr, 4);
+	memcpy(ph + 4, &iph->daddr, 4);
+	ph[8] = 0;
+	ph[9] = 6;	/* TCP */
+	ph[10] = tcplen >> 8;
+	ph[11] = tcplen;
+	return nm_csum_partial(ph, sizeof(ph), 0);
+}
+
+/* Return 1 if ft_p is a TCPv4 segment that can be coalesced. */
+static int
+gro_parse(struct nm_bdg_fwd *ft_p, struct nm_gro_seg *s)
+{
+	uint8_t *buf = ft_p->ft_buf;
+	struct nm_iphdr *iph;
+	struct nm_tcphdr *tcph;
+	u_int iplen, thlen;
+
+	if (ft_p->ft_frags != 1 || (ft_p->ft_flags & NS_INDIRECT) ||
+	    ft_p->ft_len < 14 + 20 + 20 ||
+	    be16toh(*(uint16_t *)(buf + 12)) != 0x0800)
+		return 0;
+	iph = (struct nm_iphdr *)(buf + 14);
+	iplen = be16toh(iph->tot_len);
+	if (iph->version_ihl != 0x45 || iph->protocol != 6 ||
+	    (be16toh(iph->frag_off) & 0x3fff) ||	/* MF or offset */
+	    14 + iplen > ft_p->ft_len)
+		return 0;
+	tcph = (struct nm_tcphdr *)(buf + 14 + 20);
+	thlen = (tcph->doff >> 4) << 2;
+	if (thlen < 20 || 20 + thlen >= iplen ||	/* no payload */
+	    (tcph->doff & 0x0f) ||
+	    (tcph->flags & ~0x08) != 0x10)	/* only ACK and PSH */
+		return 0;
+	if (nm_csum_fold(nm_csum_partial((uint8_t *)iph, 20, 0)) != 0xffff ||
+	    nm_csum_fold(nm_csum_partial((uint8_t *)tcph, iplen - 20,
+			gro_pseudo_sum(iph, iplen - 20))) != 0xffff) {
+		RD(5, "bad checksum, not coalesced");
+		return 0;
+	}
+	s->buf = buf;
+	s->hlen = 14 + 20 + thlen;
+	s->plen = iplen - 20 - thlen;
+	return 1;
+}
+
+/* Return 1 if s is the next segment of the flow started by f. */
+static int
+gro_match(const struct nm_gro_seg *f, const struct nm_gro_seg *s,
+	  uint32_t seq)
+{
+	const uint8_t *a = f->buf, *b = s->buf;
+	const struct nm_tcphdr *ta = (const struct nm_tcphdr *)(a + 34);
+	const struct nm_tcphdr *tb = (const struct nm_tcphdr *)(b + 34);
+
+	return f->hlen == s->hlen && be32toh(tb->seq) == seq &&
+		!memcmp(a, b, 12) &&			/* MAC addresses */
+		a[15] == b[15] &&			/* tos */
+		a[22] == b[22] &&			/* ttl */
+		!memcmp(a + 26, b + 26, 8) &&		/* addresses */
+		ta->source == tb->source && ta->dest == tb->dest &&
+		ta->ack_seq == tb->ack_seq && ta->window == tb->window &&
+		!memcmp(ta + 1, tb + 1, f->hlen - 54);	/* options */
+}
+
+/*
+ * Try to coalesce the packet ft_p with the ones following it in the
+ * destination list, whose head is *next, up to the one at index stop
+ * (the next broadcast to the same destination, or NM_FT_NULL).
+ * On success the merged frame is written at slot *j, *next, *j and
+ * *howmany are updated and the number of merged segments is returned.
+ * If there is nothing to merge the function returns 0 and the packet
+ * must take the usual path.
+ */
+u_int
+bdg_gro_datapath(struct netmap_vp_adapter *na,
+		 struct netmap_vp_adapter *dst_na,
+		 struct nm_bdg_fwd *ft, struct nm_bdg_fwd *ft_p,
+		 u_int *next, u_int stop, struct netmap_ring *ring,
+		 u_int *j, u_int lim, u_int *howmany)
+{
+	u_int bufsz = NETMAP_BUF_SIZE(&dst_na->up);
+	u_int vhl = dst_na->virt_hdr_len;
+	struct nm_gro_seg first, s;
+	struct nm_vnet_hdr *vh;
+	struct nm_iphdr *iph;
+	struct nm_tcphdr *tcph;
+	struct netmap_slot *slot;
+	struct nm_bdg_fwd *cur;
+	u_int total, nsegs = 1, k, off, used = 1, j_start = *j;
+	uint8_t psh, *dst, *dst0;
+	uint32_t seq;
+	u_int n;
+
+	(void)na;
+	if (!gro_parse(ft_p, &first) ||
+	    vhl + first.hlen + first.plen > bufsz ||
+	    (first.buf[34 + 13] & 0x08))	/* PSH, nothing follows */
+		return 0;
+	total = first.plen;
+	psh = 0;
+	seq = be32toh(((struct nm_tcphdr *)(first.buf + 34))->seq) + first.plen;
+	/* NM_FT_NULL is above any index, see nm_bdg_flush() */
+	for (n = *next; n < stop && !psh; n = ft[n].ft_next) {
+		if (!gro_parse(ft + n, &s) || !gro_match(&first, &s, seq) ||
+		    s.plen > first.plen ||
+		    first.hlen - 14 + total + s.plen > 65535 ||
+		    (vhl + first.hlen + total + s.plen + bufsz - 1) / bufsz >
+				*howmany)
+			break;
+		total += s.plen;
+		seq += s.plen;
+		nsegs++;
+		psh = s.buf[34 + 13] & 0x08;
+		if (s.plen < first.plen)	/* short segment ends a train */
+			psh |= 0x80;
+	}
+	if (nsegs < 2)
+		return 0;
+
+	/* first segment with its headers, after a zeroed vnet header */
+	slot = &ring->slot[*j];
+	dst0 = dst = NMB(&dst_na->up, slot);
+	bzero(dst, vhl);
+	memcpy(dst + vhl, first.buf, first.hlen + first.plen);
+	off = vhl + first.hlen + first.plen;
+
+	/* then the payload of the others */
+	cur = ft_p;
+	for (k = 1; k < nsegs; k++) {
+		uint8_t *src;
+		u_int left;
+
+		cur = ft + cur->ft_next;
+		src = (uint8_t *)cur->ft_buf + first.hlen;
+		left = be16toh(((struct nm_iphdr *)((uint8_t *)cur->ft_buf + 14))->tot_len)
+			+ 14 - first.hlen;
+		while (left > 0) {
+			u_int copy;
+
+			if (off == bufsz) {
+				slot->len = off;
+				*j = nm_next(*j, lim);
+				slot = &ring->slot[*j];
+				dst = NMB(&dst_na->up, slot);
+				off = 0;
+				used++;
+			}
+			copy = bufsz - off;
+			if (copy > left)
+				copy = left;
+			memcpy(dst + off, src, copy);
+			off += copy;
+			src += copy;
+			left -= copy;
+		}
+	}
+	slot->len = off;
+	*j = nm_next(*j, lim);
+	*next = cur->ft_next;
+
+	/* fix the headers of the merged frame */
+	iph = (struct nm_iphdr *)(dst0 + vhl + 14);
+	tcph = (struct nm_tcphdr *)(dst0 + vhl + 34);
+	iph->tot_len = htobe16(first.hlen - 14 + total);
+	iph->check = 0;
+	iph->check = ~nm_csum_fold(nm_csum_partial((uint8_t *)iph, 20, 0));
+	tcph->flags |= psh & 0x08;
+	tcph->check = nm_csum_fold(gro_pseudo_sum(iph, first.hlen - 34 + total));
+	vh = (struct nm_vnet_hdr *)dst0;
+	vh->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+	vh->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+	vh->hdr_len = first.hlen;
+	vh->gso_size = first.plen;
+	vh->csum_start = 34;
+	vh->csum_offset = 16;	/* offsetof(struct nm_tcphdr, check) */
+	if (vhl >= sizeof(*vh) + 2) {
+		/* num_buffers of virtio_net_hdr_mrg_rxbuf, the slots */
+		uint16_t nbufs = used;
+
+		memcpy(dst0 + sizeof(*vh), &nbufs, sizeof(nbufs));
+	}
+	ND(3, "merged %u segments, %u bytes in %u slots", nsegs, total, used);
+
+	/* slot flags, as in bdg_mismatch_datapath() */
+	while (j_start != *j) {
+		slot = &ring->slot[j_start];
+		slot->flags = (used << 8) | NS_MOREFRAG;
+		j_start = nm_next(j_start, lim);
+	}
+	slot->flags = (used << 8);
+	*howmany -= used;
+	return nsegs;
+}
@@ -604,6 +604,8 @@ netmap_get_pipe_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	mna->up.nm_krings_delete = netmap_pipe_krings_delete;
 	mna->up.nm_mem = pna->nm_mem;
 	mna->up.na_lut = pna->na_lut;
+	mna->up.na_bufclass = pna->na_bufclass;
+	mna->up.na_flags |= NAF_BUFCLASS_FIXED;
 
 	mna->up.num_tx_rings = 1;
 	mna->up.num_rx_rings = 1;
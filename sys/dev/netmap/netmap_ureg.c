@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * User memory regions for NS_INDIRECT slots on VALE ports.
+ *
+ * An indirect slot carries the user address of the payload, and
+ * nm_bdg_flush() normally reads it with copyin(), which checks the
+ * address and may fault at every packet. Applications with their own
+ * buffer pools can instead register the pools with the port
+ * (NIOCBDGCONF, struct nm_ureg_req): the pages are pinned and mapped
+ * in the kernel once, and nm_bdg_preflush() translates the indirect
+ * slots that fall in a region into kernel addresses with
+ * nm_ureg_kva(), a scan of at most NM_UREG_MAX entries. Those slots
+ * are then copied like netmap buffers.
+ *
+ * Pinning and mapping may sleep, so netmap_bdg_svc_config() calls
+ * netmap_ureg_prepare() before taking the bridge lock,
+ * netmap_ureg_config() with the lock held to install or remove the
+ * region, and netmap_ureg_release() after dropping it to unpin what
+ * was not installed or was removed.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+/* called without locks, pin the region of an NM_UREG_ADD in r */
+int
+netmap_ureg_prepare(struct nm_ifreq *ifr, struct nm_ureg *r)
+{
+	struct nm_ureg_req *req = (struct nm_ureg_req *)ifr->data;
+	int error;
+
+	bzero(r, sizeof(*r));
+	if (req->nur_cmd != NM_UREG_ADD)
+		return 0;
+	if (req->nur_addr == 0 || req->nur_len == 0 ||
+	    req->nur_len > NM_UREG_MAXLEN ||
+	    (uintptr_t)req->nur_addr != req->nur_addr ||
+	    (uintptr_t)(req->nur_addr + req->nur_len) < req->nur_addr)
+		return EINVAL;
+	error = nm_os_upin(req->nur_addr, req->nur_len, &r->pin, &r->kva);
+	if (error)
+		return error;
+	r->uaddr = req->nur_addr;
+	r->len = req->nur_len;
+	return 0;
+}
+
+
+/* called without locks, unpin what is left in r */
+void
+netmap_ureg_release(struct nm_ureg *r)
+{
+	if (r->pin == NULL)
+		return;
+	nm_os_uunpin(r->pin);
+	bzero(r, sizeof(*r));
+}
+
+
+/* free the regions of a port that left the switch */
+void
+netmap_ureg_free(struct nm_uregs *u)
+{
+	u_int i;
+
+	if (u == NULL)
+		return;
+	for (i = 0; i < u->n; i++)
+		netmap_ureg_release(&u->r[i]);
+	free(u, M_DEVBUF);
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() with the
+ * bridge write-locked. NM_UREG_ADD moves the region in r to the
+ * port, NM_UREG_DEL moves the region out of the port to r.
+ * Both are only accepted on the file (priv) bound to the port,
+ * the one whose process sends from the region.
+ */
+int
+netmap_ureg_config(struct nm_ifreq *ifr, struct nm_ureg *r,
+	struct netmap_priv_d *priv)
+{
+	struct nm_ureg_req *req = (struct nm_ureg_req *)ifr->data;
+	struct netmap_vp_adapter *vpna;
+	struct nm_uregs *u;
+	u_int i;
+
+	vpna = netmap_bdg_port_byname(ifr->nifr_name);
+	if (vpna == NULL)
+		return ENXIO;
+	u = vpna->uregs;
+	if (req->nur_cmd != NM_UREG_GET &&
+	    (priv == NULL || priv->np_na != &vpna->up))
+		return EPERM;
+
+	switch (req->nur_cmd) {
+	case NM_UREG_ADD:
+		if (u == NULL) {
+			u = malloc(sizeof(*u), M_DEVBUF, M_NOWAIT | M_ZERO);
+			if (u == NULL)
+				return ENOMEM;
+			vpna->uregs = u;
+		}
+		for (i = 0; i < NM_UREG_MAX && u->r[i].uaddr != 0; i++)
+			;
+		if (i == NM_UREG_MAX)
+			return ENOSPC;
+		u->r[i] = *r;
+		bzero(r, sizeof(*r));
+		if (i >= u->n)
+			u->n = i + 1;
+		req->nur_id = i;
+		break;
+
+	case NM_UREG_DEL:
+		if (u == NULL || req->nur_id >= u->n ||
+		    u->r[req->nur_id].uaddr == 0)
+			return ENOENT;
+		*r = u->r[req->nur_id];
+		bzero(&u->r[req->nur_id], sizeof(u->r[0]));
+		while (u->n > 0 && u->r[u->n - 1].uaddr == 0)
+			u->n--;
+		break;
+
+	case NM_UREG_GET:
+		bzero(req->nur_regions, sizeof(req->nur_regions));
+		req->nur_count = 0;
+		req->nur_misses = 0;
+		if (u == NULL)
+			break;
+		req->nur_misses = u->misses;
+		for (i = 0; i < u->n; i++) {
+			req->nur_regions[i].addr = u->r[i].uaddr;
+			req->nur_regions[i].len = u->r[i].len;
+			if (u->r[i].uaddr != 0)
+				req->nur_count++;
+		}
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+#endif /* WITH_VALE */
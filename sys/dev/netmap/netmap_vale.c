@@ -141,12 +141,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_MAXSLOTS		4096	/* XXX same as above */
 #define NM_BRIDGE_RINGSIZE	1024	/* in the device */
 #define NM_BDG_HASH		1024	/* forwarding table entries */
-#define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
-#define NM_MULTISEG		64	/* max size of a chain of bufs */
-/* actual size of the tables */
-#define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
-/* NM_FT_NULL terminates a list of slots in the ft */
-#define NM_FT_NULL		NM_BDG_BATCH_MAX
+#define NM_BDG_REPLIES		8	/* ARP/ND replies per batch */
+/* destination queues per batch: broadcast, one per packet, one per port */
+#define NM_BDG_DSTQ		(1 + NM_BDG_BATCH_MAX + NM_BDG_MAXPORTS)
+#define NM_DQ_NULL		0xffff	/* no destination queue */
 #define	NM_BRIDGES		8	/* number of bridges */
 
 
@@ -156,9 +154,65 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/*
+ * With bridge_batch_adaptive set, each tx ring picks its own batch
+ * between bridge_batch_min and bridge_batch, see nm_bdg_batch_adapt().
+ * bridge_batch_idle is the idle time (us) after which a ring is
+ * considered to carry sparse traffic and restarts from the minimum.
+ */
+static int bridge_batch_adaptive = 0;
+static int bridge_batch_min = 16;
+static int bridge_batch_idle = 50;
+/*
+ * With bridge_gro set, TCP segments sent by ports without virtio-net
+ * header to ports with one are coalesced, see bdg_gro_datapath().
+ * The receiver must accept TSO frames (VIRTIO_NET_F_GUEST_TSO4).
+ */
+static int bridge_gro = 0;
+/*
+ * With bridge_bwrap_threads set, NICs attached afterwards forward
+ * from their rx rings in one kthread per ring (pinned to cpu
+ * ring % ncpus) instead of the interrupt/notify context.
+ * Each poll moves at most bridge_bwrap_budget slots, the per-port
+ * value can be changed with NETMAP_BDG_P_BUDGET.
+ */
+static int bridge_bwrap_threads = 0;
+static int bridge_bwrap_budget = 256;
+/*
+ * Default doorbell coalescing of the NICs attached to a switch:
+ * the hw txsync is deferred until bridge_bwrap_tx_thresh slots are
+ * pending or bridge_bwrap_tx_delay us have passed. Either 0 disables
+ * it. Per port values are set with NETMAP_BDG_P_TXTHRESH/TXDELAY.
+ */
+static int bridge_bwrap_tx_thresh = 0;
+static int bridge_bwrap_tx_delay = 0;
+/*
+ * With bridge_learn_log set, changes to the forwarding table are
+ * queued in per-cpu logs and applied at the end of each batch,
+ * see nm_bdg_learn().
+ */
+static int bridge_learn_log = 1;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_adaptive, CTLFLAG_RW,
+    &bridge_batch_adaptive, 0 , "Adapt the batch size per tx ring");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_min, CTLFLAG_RW,
+    &bridge_batch_min, 0 , "Minimum adaptive batch size");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_idle, CTLFLAG_RW,
+    &bridge_batch_idle, 0 , "Idle time (us) that resets the batch");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_gro, CTLFLAG_RW, &bridge_gro, 0 ,
+    "Coalesce TCP segments toward ports with virtio-net header");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_bwrap_threads, CTLFLAG_RW,
+    &bridge_bwrap_threads, 0 , "Forward from NIC rx rings in kthreads");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_bwrap_budget, CTLFLAG_RW,
+    &bridge_bwrap_budget, 0 , "Default slots per bwrap kthread poll");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_bwrap_tx_thresh, CTLFLAG_RW,
+    &bridge_bwrap_tx_thresh, 0 , "Default NIC doorbell threshold (slots)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_bwrap_tx_delay, CTLFLAG_RW,
+    &bridge_bwrap_tx_delay, 0 , "Default NIC doorbell max delay (us)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_learn_log, CTLFLAG_RW,
+    &bridge_learn_log, 0 , "Defer forwarding table updates per cpu");
 SYSEND;
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *, struct netmap_vp_adapter **);
@@ -169,10 +223,15 @@ static int netmap_bwrap_register(struct netmap_adapter *, int onoff);
  * For each output interface, nm_bdg_q is used to construct a list.
  * bq_len is the number of output buffers (we can have coalescing
  * during the copy).
+ * Queues are only created for the destinations used in a batch,
+ * bq_dst is the port:ring index and bq_next links the queues
+ * for the other rings of the same port.
  */
 struct nm_bdg_q {
 	uint16_t bq_head;
 	uint16_t bq_tail;
+	uint16_t bq_dst;	/* port * NM_BDG_MAXRINGS + ring */
+	uint16_t bq_next;	/* next queue for the same port */
 	uint32_t bq_len;	/* number of buffers */
 };
 
@@ -182,6 +241,77 @@ struct nm_hash_ent {
 	uint64_t	ports;
 };
 
+/*
+ * Pending updates of the forwarding table, one log per cpu.
+ * busy is a trylock, the log may be used from a different cpu
+ * after a migration, or reentered from an interrupt.
+ * Each change also records the entry it replaces, and is dropped
+ * if the entry changed before the log is applied.
+ * NM_LEARN_LOG keeps the structure within 512 bytes.
+ */
+#define NM_LEARN_LOG	20
+struct nm_learn_log {
+	NM_ATOMIC_T	busy;
+	u_int		n;
+	struct {
+		uint64_t	mac;
+		uint64_t	omac;	/* the entry being replaced */
+		uint16_t	sh;
+		uint16_t	port;
+		uint16_t	oport;
+	} e[NM_LEARN_LOG];
+};
+
+#ifdef WITH_VALE_PROF
+/*
+ * Cycles spent by a port in each phase of nm_bdg_preflush() and
+ * nm_bdg_flush(), accumulated per cpu so that the rings of a port
+ * do not share the counters. They are read with NETMAP_BDG_GETPARAM
+ * without locks, so the sums are approximate.
+ * Without WITH_VALE_PROF the NM_PROF_* macros expand to nothing.
+ */
+enum {
+	NM_PH_SCAN = 0, NM_PH_LOOKUP, NM_PH_LEASE, NM_PH_COPY, NM_PH_DONE,
+	NM_PH_NOTIFY, NM_PH_MAX
+};
+
+struct nm_bdg_prof {
+	uint64_t	pkts;
+	uint64_t	cyc[NM_PH_MAX];
+	uint64_t	spare;		/* one cache line per cpu */
+};
+
+static inline struct nm_bdg_prof *
+nm_bdg_prof(struct netmap_vp_adapter *na)
+{
+	return na->prof + nm_os_curcpu() % na->nprof;
+}
+
+/* charge the cycles since *t to phase ph, and restart */
+static inline void
+nm_bdg_prof_add(struct netmap_vp_adapter *na, u_int ph, uint64_t *t)
+{
+	uint64_t now = nm_os_cycles();
+
+	if (likely(na->prof != NULL))
+		nm_bdg_prof(na)->cyc[ph] += now - *t;
+	*t = now;
+}
+
+#define NM_PROF_DECL		uint64_t prof_t;
+#define NM_PROF_START()		prof_t = nm_os_cycles()
+#define NM_PROF_ADD(na, ph)	nm_bdg_prof_add(na, ph, &prof_t)
+#define NM_PROF_PKTS(na, n)	do {				\
+	if (likely((na)->prof != NULL))				\
+		nm_bdg_prof(na)->pkts += (n);			\
+} while (0)
+#else /* !WITH_VALE_PROF */
+#define NM_PROF_DECL
+#define NM_PROF_START()
+#define NM_PROF_ADD(na, ph)
+#define NM_PROF_PKTS(na, n)
+#endif /* !WITH_VALE_PROF */
+
 /*
  * nm_bridge is a descriptor for a VALE switch.
  * Interfaces for a bridge are all in bdg_ports[].
@@ -227,6 +357,20 @@ struct nm_bridge {
 	 */
 	struct nm_hash_ent ht[NM_BDG_HASH];
 
+	/* deferred learning, see nm_bdg_learn() */
+	struct nm_learn_log **bdg_learn;
+	u_int bdg_nlearn;
+	volatile u_int bdg_learn_pending;	/* logs with changes */
+
+	/* link aggregation groups, see netmap_lag.c */
+	struct nm_lag *bdg_lags[NM_LAG_MAX];
+
+	/* IGMP/MLD snooping, see netmap_mcast.c */
+	struct nm_mcast *bdg_mcast;
+
+	/* ARP/ND suppression, see netmap_arp.c */
+	struct nm_arp *bdg_arp;
+
 #ifdef CONFIG_NET_NS
 	struct net *ns;
 #endif /* CONFIG_NET_NS */
@@ -344,6 +488,9 @@ nm_find_bridge(const char *name, int create)
 		b->bdg_ops.lookup = netmap_bdg_learning;
 		/* reset the MAC address table */
 		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
+		for (i = 0; i < b->bdg_nlearn; i++)
+			b->bdg_learn[i]->n = 0;
+		b->bdg_learn_pending = 0;
 		NM_BNS_GET(b);
 	}
 	return b;
@@ -368,30 +515,67 @@ nm_free_bdgfwd(struct netmap_adapter *na)
 			kring[i].nkr_ft = NULL; /* protect from freeing twice */
 		}
 	}
+#ifdef WITH_VALE_PROF
+	{
+		struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)na;
+
+		if (vpna->prof != NULL) {
+			free(vpna->prof, M_DEVBUF);
+			vpna->prof = NULL;
+		}
+	}
+#endif /* WITH_VALE_PROF */
 }
 
 
+/*
+ * Return the queue for port:ring in the scratch area of a batch,
+ * appending a new one to dq if the destination is not in use yet.
+ * A port has a few rings at most, so the chain is short.
+ */
+static inline struct nm_bdg_q *
+nm_bdg_dstq(struct nm_bdg_q *dq, uint16_t *qidx, u_int *nq,
+	u_int port, u_int ring)
+{
+	u_int q, d_i = port * NM_BDG_MAXRINGS + ring;
+	struct nm_bdg_q *d;
+
+	for (q = qidx[port]; q != NM_DQ_NULL; q = dq[q].bq_next) {
+		if (dq[q].bq_dst == d_i)
+			return dq + q;
+	}
+	q = (*nq)++;
+	d = dq + q;
+	d->bq_head = d->bq_tail = NM_FT_NULL;
+	d->bq_len = 0;
+	d->bq_dst = d_i;
+	d->bq_next = qidx[port];
+	qidx[port] = q;
+	return d;
+}
+
 /*
  * Allocate the forwarding tables for the rings attached to the bridge ports.
  */
 static int
 nm_alloc_bdgfwd(struct netmap_adapter *na)
 {
-	int nrings, l, i, num_dstq;
+	int nrings, l, i;
 	struct netmap_kring *kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	/* see nm_bdg_flush() for the layout */
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
-	l += sizeof(struct nm_bdg_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	l += NM_ARP_REPLY_SIZE * NM_BDG_REPLIES;
+	l += sizeof(struct nm_bdg_q) * NM_BDG_DSTQ;
+	l += sizeof(uint16_t) * NM_BDG_MAXPORTS;
 
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
 	for (i = 0; i < nrings; i++) {
 		struct nm_bdg_fwd *ft;
 		struct nm_bdg_q *dstq;
+		uint16_t *qidx;
 		int j;
 
 		ft = malloc(l, M_DEVBUF, M_NOWAIT | M_ZERO);
@@ -399,13 +583,29 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 			nm_free_bdgfwd(na);
 			return ENOMEM;
 		}
-		dstq = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-		for (j = 0; j < num_dstq; j++) {
-			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
-			dstq[j].bq_len = 0;
-		}
+		dstq = (struct nm_bdg_q *)((char *)(ft + NM_BDG_BATCH_MAX) +
+			NM_ARP_REPLY_SIZE * NM_BDG_REPLIES);
+		/* the broadcast queue, the others are set up on demand */
+		dstq[0].bq_head = dstq[0].bq_tail = NM_FT_NULL;
+		dstq[0].bq_dst = NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
+		dstq[0].bq_next = NM_DQ_NULL;
+		qidx = (uint16_t *)(dstq + NM_BDG_DSTQ);
+		for (j = 0; j < NM_BDG_MAXPORTS; j++)
+			qidx[j] = NM_DQ_NULL;
 		kring[i].nkr_ft = ft;
 	}
+#ifdef WITH_VALE_PROF
+	{
+		struct netmap_vp_adapter *vpna = (struct netmap_vp_adapter *)na;
+
+		/* not fatal, the port is just not profiled */
+		vpna->nprof = nm_os_ncpus();
+		if (vpna->nprof < 1)
+			vpna->nprof = 1;
+		vpna->prof = malloc(sizeof(struct nm_bdg_prof) * vpna->nprof,
+			M_DEVBUF, M_NOWAIT | M_ZERO);
+	}
+#endif /* WITH_VALE_PROF */
 	return 0;
 }
 
@@ -419,6 +619,7 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
 	uint8_t tmp[NM_BDG_MAXPORTS];
+	struct nm_uregs *uregs;
 
 	/*
 	New algorithm:
@@ -460,13 +661,29 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 	BDG_WLOCK(b);
 	if (b->bdg_ops.dtor)
 		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
+	netmap_vtep_free(b->bdg_ports[s_hw]);
+	netmap_lag_free(b->bdg_ports[s_hw]);
+	netmap_mcast_port_gone(b->bdg_mcast, s_hw);
+	netmap_arp_port_gone(b->bdg_arp, s_hw);
+	/* unpinned below, it may sleep */
+	uregs = b->bdg_ports[s_hw]->uregs;
+	b->bdg_ports[s_hw]->uregs = NULL;
 	b->bdg_ports[s_hw] = NULL;
 	if (s_sw >= 0) {
+		netmap_mcast_port_gone(b->bdg_mcast, s_sw);
+		netmap_arp_port_gone(b->bdg_arp, s_sw);
 		b->bdg_ports[s_sw] = NULL;
 	}
 	memcpy(b->bdg_port_index, tmp, sizeof(tmp));
 	b->bdg_active_ports = lim;
+	if (lim == 0) {
+		netmap_mcast_free(b->bdg_mcast);
+		b->bdg_mcast = NULL;
+		netmap_arp_free(b->bdg_arp);
+		b->bdg_arp = NULL;
+	}
 	BDG_WUNLOCK(b);
+	netmap_ureg_free(uregs);
 
 	ND("now %d active ports", lim);
 	if (lim == 0) {
@@ -807,6 +1024,148 @@ unlock_exit:
 }
 
 
+/* Process NETMAP_BDG_SETPARAM and NETMAP_BDG_GETPARAM.
+ * The parameter is in nr_arg1, the value in nr_arg3.
+ */
+static int
+netmap_vp_param(struct netmap_vp_adapter *vpna, struct nmreq *nmr, int set)
+{
+	struct netmap_kring *kring;
+	struct netmap_bwrap_adapter *bna;
+	struct nm_bwrap_worker *w;
+	struct nm_bwrap_txq *q;
+	u_int ring_nr;
+
+	NMG_LOCK_ASSERT();
+	switch (nmr->nr_arg1) {
+	case NETMAP_BDG_P_LATENCY:
+		if (!set) {
+			nmr->nr_arg3 = vpna->lat_budget;
+			break;
+		}
+		if (nmr->nr_arg3 > 1000000) /* at most 1s */
+			return EINVAL;
+		vpna->lat_budget = nmr->nr_arg3;
+		break;
+
+	case NETMAP_BDG_P_BATCH:
+		if (set)
+			return EINVAL;
+		ring_nr = nmr->nr_ringid & NETMAP_RING_MASK;
+		if (ring_nr >= vpna->up.num_tx_rings || vpna->up.tx_rings == NULL)
+			return EINVAL;
+		kring = &vpna->up.tx_rings[ring_nr];
+		nmr->nr_arg3 = (bridge_batch_adaptive && kring->nkr_bdg_batch) ?
+			kring->nkr_bdg_batch : bridge_batch;
+		break;
+
+	case NETMAP_BDG_P_BUDGET:
+		if (vpna->up.nm_register != netmap_bwrap_register)
+			return EINVAL;
+		bna = (struct netmap_bwrap_adapter *)vpna;
+		if (!set) {
+			nmr->nr_arg3 = bna->budget;
+			break;
+		}
+		bna->budget = nmr->nr_arg3;
+		break;
+
+	case NETMAP_BDG_P_TXTHRESH:
+	case NETMAP_BDG_P_TXDELAY:
+		if (vpna->up.nm_register != netmap_bwrap_register)
+			return EINVAL;
+		bna = (struct netmap_bwrap_adapter *)vpna;
+		if (!set) {
+			nmr->nr_arg3 = nmr->nr_arg1 == NETMAP_BDG_P_TXTHRESH ?
+				bna->tx_thresh : bna->tx_delay;
+			break;
+		}
+		if (nmr->nr_arg1 == NETMAP_BDG_P_TXTHRESH) {
+			bna->tx_thresh = nmr->nr_arg3;
+		} else {
+			if (nmr->nr_arg3 > 1000000) /* at most 1s */
+				return EINVAL;
+			bna->tx_delay = nmr->nr_arg3;
+		}
+		break;
+
+	case NETMAP_BDG_P_DOORBELLS:
+	case NETMAP_BDG_P_DEFERRED:
+	case NETMAP_BDG_P_TXTIMER:
+		if (set || vpna->up.nm_register != netmap_bwrap_register)
+			return EINVAL;
+		bna = (struct netmap_bwrap_adapter *)vpna;
+		ring_nr = nmr->nr_ringid & NETMAP_RING_MASK;
+		if (bna->txqs == NULL || ring_nr >= bna->num_txqs)
+			return EINVAL;
+		q = &bna->txqs[ring_nr];
+		/* low 32 bits, as below */
+		nmr->nr_arg3 =
+		    nmr->nr_arg1 == NETMAP_BDG_P_DOORBELLS ? q->doorbells :
+		    nmr->nr_arg1 == NETMAP_BDG_P_DEFERRED ? q->deferred :
+		    q->timer_doorbells;
+		break;
+
+	case NETMAP_BDG_P_WAKEUPS:
+	case NETMAP_BDG_P_POLLS:
+	case NETMAP_BDG_P_SLOTS:
+	case NETMAP_BDG_P_EXHAUSTED:
+		if (set || vpna->up.nm_register != netmap_bwrap_register)
+			return EINVAL;
+		bna = (struct netmap_bwrap_adapter *)vpna;
+		ring_nr = nmr->nr_ringid & NETMAP_RING_MASK;
+		if (bna->workers == NULL || ring_nr >= bna->num_workers ||
+		    bna->workers[ring_nr].nmk == NULL)
+			return EINVAL;
+		w = &bna->workers[ring_nr];
+		/* the counters are 64 bit, report the low 32 bits */
+		nmr->nr_arg3 =
+		    nmr->nr_arg1 == NETMAP_BDG_P_WAKEUPS ? w->wakeups :
+		    nmr->nr_arg1 == NETMAP_BDG_P_POLLS ? w->polls :
+		    nmr->nr_arg1 == NETMAP_BDG_P_SLOTS ? w->slots :
+		    w->exhausted;
+		break;
+
+	case NETMAP_BDG_P_MEM:
+		if (set)
+			return EINVAL;
+		nmr->nr_arg3 = netmap_mem_port_size(&vpna->up) >> 10;
+		break;
+
+#ifdef WITH_VALE_PROF
+	case NETMAP_BDG_P_CYC_SCAN:
+	case NETMAP_BDG_P_CYC_LOOKUP:
+	case NETMAP_BDG_P_CYC_LEASE:
+	case NETMAP_BDG_P_CYC_COPY:
+	case NETMAP_BDG_P_CYC_DONE:
+	case NETMAP_BDG_P_CYC_NOTIFY:
+	    {
+		u_int c, ph = nmr->nr_arg1 - NETMAP_BDG_P_CYC_SCAN;
+		uint64_t pkts = 0, cyc = 0;
+
+		if (vpna->prof == NULL)
+			return EINVAL;
+		if (set) {
+			bzero(vpna->prof,
+				sizeof(struct nm_bdg_prof) * vpna->nprof);
+			break;
+		}
+		for (c = 0; c < vpna->nprof; c++) {
+			pkts += vpna->prof[c].pkts;
+			cyc += vpna->prof[c].cyc[ph];
+		}
+		nmr->nr_arg3 = pkts ? cyc / pkts : 0;
+		break;
+	    }
+#endif /* WITH_VALE_PROF */
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+
 /* Called by either user's context (netmap_ioctl())
  * or external kernel modules (e.g., Openvswitch).
  * Operation is indicated in nmr->nr_cmd.
@@ -929,6 +1288,20 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		NMG_UNLOCK();
 		break;
 
+	case NETMAP_BDG_SETPARAM:
+	case NETMAP_BDG_GETPARAM:
+		NMG_LOCK();
+		error = netmap_get_bdg_na(nmr, &na, 0);
+		if (na && !error) {
+			error = netmap_vp_param((struct netmap_vp_adapter *)na,
+				nmr, cmd == NETMAP_BDG_SETPARAM);
+			netmap_adapter_put(na);
+		} else if (!error) {
+			error = EINVAL; /* not a VALE port */
+		}
+		NMG_UNLOCK();
+		break;
+
 	case NETMAP_BDG_VNET_HDR:
 		/* Valid lengths for the virtio-net header are 0 (no header),
 		   10 and 12. */
@@ -941,11 +1314,28 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		NMG_LOCK();
 		error = netmap_get_bdg_na(nmr, &na, 0);
 		if (na && !error) {
+			struct nm_bridge *b;
+
 			vpna = (struct netmap_vp_adapter *)na;
-			vpna->virt_hdr_len = nmr->nr_arg1;
-			if (vpna->virt_hdr_len)
-				vpna->mfs = NETMAP_BUF_SIZE(na);
-			D("Using vnet_hdr_len %d for %p", vpna->virt_hdr_len, vpna);
+			/* vtep is set under the bridge lock, see netmap_vtep.c */
+			b = vpna->na_bdg;
+			if (b)
+				BDG_WLOCK(b);
+			if (vpna->vtep != NULL && nmr->nr_arg1 != 0) {
+				/* nm_vtep_encap/decap put the tunnel
+				 * header at the start of the frame */
+				D("%s is a VTEP port, no virtio-net header",
+					na->name);
+				error = EINVAL;
+			} else {
+				vpna->virt_hdr_len = nmr->nr_arg1;
+				if (vpna->virt_hdr_len)
+					vpna->mfs = NETMAP_BUF_SIZE(na);
+				D("Using vnet_hdr_len %d for %p",
+					vpna->virt_hdr_len, vpna);
+			}
+			if (b)
+				BDG_WUNLOCK(b);
 			netmap_adapter_put(na);
 		}
 		NMG_UNLOCK();
@@ -959,21 +1349,39 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 	return error;
 }
 
+/* NIOCCONFIG, the request belongs to the config() callback */
 int
 netmap_bdg_config(struct nmreq *nmr)
 {
 	struct nm_bridge *b;
 	int error = EINVAL;
 
+again:
 	NMG_LOCK();
 	b = nm_find_bridge(nmr->nr_name, 0);
 	if (!b) {
 		NMG_UNLOCK();
 		return error;
 	}
+	if (b->bdg_ops.config == netmap_acl_bdg_ops.config) {
+		/* The ACL replaces the tables used by lookup(), so
+		 * the forwarding path is kept out, and looks up ports
+		 * by name, which needs NMG_LOCK(). See netmap_acl.c
+		 */
+		BDG_WLOCK(b);
+		error = netmap_acl_bdg_ops.config((struct nm_ifreq *)nmr);
+		BDG_WUNLOCK(b);
+		NMG_UNLOCK();
+		return error;
+	}
 	NMG_UNLOCK();
 	/* Don't call config() with NMG_LOCK() held */
 	BDG_RLOCK(b);
+	if (b->bdg_ops.config == netmap_acl_bdg_ops.config) {
+		/* NM_ACL_ON in the meantime */
+		BDG_RUNLOCK(b);
+		goto again;
+	}
 	if (b->bdg_ops.config != NULL)
 		error = b->bdg_ops.config((struct nm_ifreq *)nmr);
 	BDG_RUNLOCK(b);
@@ -981,6 +1389,276 @@ netmap_bdg_config(struct nmreq *nmr)
 }
 
 
+/*
+ * The requests are copied in and out of the fixed nm_ifreq.data,
+ * on the kernel stack in the ioctl glue, so they must fit in it.
+ */
+#define NM_IFRDATA_FITS(_s) \
+	typedef char _s##_fits_ifrdata[sizeof(struct _s) <= NM_IFRDATA_LEN ? 1 : -1]
+NM_IFRDATA_FITS(nm_acl_req);
+NM_IFRDATA_FITS(nm_vtep_req);
+NM_IFRDATA_FITS(nm_lag_req);
+NM_IFRDATA_FITS(nm_mcast_req);
+NM_IFRDATA_FITS(nm_arp_req);
+NM_IFRDATA_FITS(nm_ureg_req);
+NM_IFRDATA_FITS(nm_bench_req);
+#undef NM_IFRDATA_FITS
+
+/*
+ * Services built into VALE, configured with NIOCBDGCONF.
+ * Each one registers the sub-commands it handles (the leading
+ * 16 bits of nm_ifreq.data, see the nm_*_req in net/netmap.h,
+ * 0-terminated list) in netmap_bdg_svcs[].
+ * config() is called with NMG_LOCK() held and the bridge of
+ * nifr_name write-locked, so the forwarding path is kept out,
+ * unless NM_SVC_UNLOCKED is set: then it does its own locking.
+ */
+struct netmap_bdg_svc {
+	const uint16_t	*cmds;
+	u_int		flags;
+#define NM_SVC_UNLOCKED		1	/* called without locks */
+#define NM_SVC_NOBRIDGE		2	/* b is NULL, the bridge may not exist */
+	int (*config)(struct nm_ifreq *, struct nm_bridge *,
+		struct netmap_priv_d *);
+};
+
+/* VXLAN tunnel endpoints, see netmap_vtep.c */
+static const uint16_t nm_vtep_cmds[] = {
+	NM_VTEP_SET, NM_VTEP_CLEAR, NM_VTEP_GET, 0
+};
+
+static int
+nm_vtep_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	return netmap_vtep_config(ifr);
+}
+
+/* link aggregation, see netmap_lag.c */
+static const uint16_t nm_lag_cmds[] = {
+	NM_LAG_ADD, NM_LAG_REMOVE, NM_LAG_UP, NM_LAG_DOWN, NM_LAG_GET, 0
+};
+
+static int
+nm_lag_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	return netmap_lag_config(ifr, b->bdg_lags);
+}
+
+/* IGMP/MLD snooping, see netmap_mcast.c */
+static const uint16_t nm_mcast_cmds[] = {
+	NM_MCAST_ON, NM_MCAST_OFF, NM_MCAST_ROUTER, NM_MCAST_GET, 0
+};
+
+static int
+nm_mcast_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	return netmap_mcast_config(ifr, &b->bdg_mcast);
+}
+
+/* ARP/ND suppression, see netmap_arp.c */
+static const uint16_t nm_arp_cmds[] = {
+	NM_ARP_ON, NM_ARP_OFF, NM_ARP_GET, 0
+};
+
+static int
+nm_arp_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	return netmap_arp_config(ifr, &b->bdg_arp);
+}
+
+/* user memory regions, see netmap_ureg.c */
+static const uint16_t nm_ureg_cmds[] = {
+	NM_UREG_ADD, NM_UREG_DEL, NM_UREG_GET, 0
+};
+
+/* pinning may sleep, so it is done out of the bridge lock */
+static int
+nm_ureg_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	struct nm_ureg r;
+	int error;
+
+	error = netmap_ureg_prepare(ifr, &r);
+	if (error)
+		return error;
+	NMG_LOCK();
+	BDG_WLOCK(b);
+	error = netmap_ureg_config(ifr, &r, priv);
+	BDG_WUNLOCK(b);
+	NMG_UNLOCK();
+	netmap_ureg_release(&r);
+	return error;
+}
+
+/* ACL classifier, see netmap_acl.c */
+static const uint16_t nm_acl_cmds[] = {
+	NM_ACL_ON, NM_ACL_OFF, 0
+};
+
+/*
+ * It only replaces the default ops, it falls back to learning
+ * until a port has rules.
+ */
+static int
+nm_acl_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	uint16_t cmd;
+	u_int i;
+
+	memcpy(&cmd, ifr->data, sizeof(cmd));
+	if (cmd == NM_ACL_ON) {
+		if (b->bdg_ops.lookup == netmap_acl_bdg_ops.lookup)
+			return 0;
+		if (b->bdg_ops.lookup != netmap_bdg_learning ||
+		    b->bdg_ops.config != NULL || b->bdg_ops.dtor != NULL)
+			return EBUSY;	/* custom bdg_ops */
+		b->bdg_ops = netmap_acl_bdg_ops;
+		return 0;
+	}
+	/* NM_ACL_OFF */
+	if (b->bdg_ops.lookup != netmap_acl_bdg_ops.lookup)
+		return ENOENT;
+	for (i = 0; i < b->bdg_active_ports; i++)
+		netmap_acl_bdg_ops.dtor(b->bdg_ports[b->bdg_port_index[i]]);
+	bzero(&b->bdg_ops, sizeof(b->bdg_ops));
+	b->bdg_ops.lookup = netmap_bdg_learning;
+	return 0;
+}
+
+/* benchmark ports, they create the port and the bridge,
+ * see netmap_bench.c
+ */
+static const uint16_t nm_bench_cmds[] = {
+	NM_BENCH_SOURCE, NM_BENCH_SINK, NM_BENCH_STOP, NM_BENCH_GET, 0
+};
+
+static int
+nm_bench_svc_config(struct nm_ifreq *ifr, struct nm_bridge *b,
+	struct netmap_priv_d *priv)
+{
+	return netmap_bench_config(ifr);
+}
+
+static const struct netmap_bdg_svc netmap_bdg_svcs[] = {
+	{ nm_acl_cmds, 0, nm_acl_svc_config },
+	{ nm_vtep_cmds, 0, nm_vtep_svc_config },
+	{ nm_lag_cmds, 0, nm_lag_svc_config },
+	{ nm_mcast_cmds, 0, nm_mcast_svc_config },
+	{ nm_arp_cmds, 0, nm_arp_svc_config },
+	{ nm_ureg_cmds, NM_SVC_UNLOCKED, nm_ureg_svc_config },
+	{ nm_bench_cmds, NM_SVC_UNLOCKED | NM_SVC_NOBRIDGE,
+		nm_bench_svc_config },
+};
+
+static const struct netmap_bdg_svc *
+netmap_bdg_svc_find(uint16_t cmd)
+{
+	const uint16_t *c;
+	u_int i;
+
+	for (i = 0; i < sizeof(netmap_bdg_svcs) / sizeof(netmap_bdg_svcs[0]); i++) {
+		for (c = netmap_bdg_svcs[i].cmds; *c != 0; c++) {
+			if (*c == cmd)
+				return &netmap_bdg_svcs[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * NIOCBDGCONF, services built into VALE. The leading 16 bits
+ * of data select the command and the service.
+ */
+int
+netmap_bdg_svc_config(struct nmreq *nmr, struct netmap_priv_d *priv)
+{
+	struct nm_ifreq *ifr = (struct nm_ifreq *)nmr;
+	const struct netmap_bdg_svc *svc;
+	struct nm_bridge *b = NULL;
+	int error;
+	uint16_t cmd;
+
+	memcpy(&cmd, ifr->data, sizeof(cmd));
+	svc = netmap_bdg_svc_find(cmd);
+	if (svc == NULL)
+		return EINVAL;
+	NMG_LOCK();
+	if (!(svc->flags & NM_SVC_NOBRIDGE)) {
+		b = nm_find_bridge(nmr->nr_name, 0);
+		if (b == NULL) {
+			NMG_UNLOCK();
+			return EINVAL;
+		}
+	}
+	if (svc->flags & NM_SVC_UNLOCKED) {
+		NMG_UNLOCK();
+		return svc->config(ifr, b, priv);
+	}
+	BDG_WLOCK(b);
+	error = svc->config(ifr, b, priv);
+	BDG_WUNLOCK(b);
+	NMG_UNLOCK();
+	return error;
+}
+
+
+/*
+ * Return the port called 'name', or NULL.
+ * Called with NMG_LOCK() held, which protects the list of bridges,
+ * and the bridge of the port locked, as it happens for the
+ * NIOCBDGCONF services and the ACL config().
+ */
+struct netmap_vp_adapter *
+netmap_bdg_port_byname(const char *name)
+{
+	struct nm_bridge *bridges;
+	u_int num_bridges, i;
+	int j;
+
+	NMG_LOCK_ASSERT();
+
+	netmap_bns_getbridges(&bridges, &num_bridges);
+	for (i = 0; i < num_bridges; i++) {
+		struct nm_bridge *b = bridges + i;
+
+		if (b->bdg_active_ports == 0 ||
+		    strncmp(name, b->bdg_basename, b->bdg_namelen) ||
+		    name[b->bdg_namelen] != ':')
+			continue;
+		for (j = 0; j < b->bdg_active_ports; j++) {
+			struct netmap_vp_adapter *vpna =
+				b->bdg_ports[b->bdg_port_index[j]];
+
+			if (vpna != NULL && !strcmp(vpna->up.name, name))
+				return vpna;
+		}
+	}
+	return NULL;
+}
+
+
+/*
+ * Wait until the forwarding in progress on the bridge of vpna is
+ * over, e.g. before freeing the state used by a notify callback.
+ */
+void
+netmap_bdg_drain(struct netmap_vp_adapter *vpna)
+{
+	struct nm_bridge *b = vpna->na_bdg;
+
+	if (b != NULL) {
+		BDG_WLOCK(b);
+		BDG_WUNLOCK(b);
+	}
+}
+
+
 /* nm_krings_create callback for VALE ports.
  * Calls the standard netmap_krings_create, then adds leases on rx
  * rings and bdgfwd on tx rings.
@@ -1033,6 +1711,49 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
 	struct netmap_vp_adapter *na, u_int ring_nr);
 
 
+/*
+ * Choose the batch size for the next preflush on a tx kring.
+ * 'pending' is the number of slots to be forwarded, 'now' the
+ * current time in ns.
+ * The batch doubles when the ring has a backlog of more than two
+ * batches and halves when the backlog is below a quarter of a batch.
+ * A ring idle for more than bridge_batch_idle restarts from the
+ * minimum, which keeps latency low for sparse traffic.
+ * If the port has a latency budget the batch is also capped so that
+ * batch * (measured cost per slot) does not exceed the budget.
+ */
+static u_int
+nm_bdg_batch_adapt(struct netmap_kring *kring, u_int pending, uint64_t now)
+{
+	struct netmap_vp_adapter *na = (struct netmap_vp_adapter *)kring->na;
+	u_int lo = bridge_batch_min > 0 ? bridge_batch_min : 1;
+	u_int hi = bridge_batch, batch = kring->nkr_bdg_batch;
+
+	if (lo > hi)
+		lo = hi;
+	if (batch == 0)
+		batch = hi;
+	if (pending > 2 * batch)
+		batch *= 2;
+	else if (now - kring->nkr_bdg_last > (uint64_t)bridge_batch_idle * 1000)
+		batch = lo;
+	else if (pending < batch / 4)
+		batch /= 2;
+	if (na->lat_budget && kring->nkr_bdg_pktcost) {
+		u_int cap = na->lat_budget * 1000 / kring->nkr_bdg_pktcost;
+
+		if (batch > cap)
+			batch = cap;
+	}
+	if (batch < lo)
+		batch = lo;
+	else if (batch > hi)
+		batch = hi;
+	kring->nkr_bdg_batch = batch;
+	return batch;
+}
+
+
 /*
  * main dispatch routine for the bridge.
  * Grab packets from a kring, move them into the ft structure
@@ -1040,7 +1761,7 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
  * filtered on input (ioctl, poll or XXX).
  * Returns the next position in the ring.
  */
-static int
+int
 nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 {
 	struct netmap_vp_adapter *na =
@@ -1052,6 +1773,9 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
 	struct nm_bridge *b = na->na_bdg;
+	u_int batch = bridge_batch, n = 0;
+	uint64_t t0 = 0;
+	NM_PROF_DECL
 
 	/* To protect against modifications to the bridge we acquire a
 	 * shared lock, waiting if we can sleep (if the source port is
@@ -1063,8 +1787,15 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 	else if (!BDG_RTRYLOCK(b))
 		return 0;
 	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	NM_PROF_START();
 	ft = kring->nkr_ft;
 
+	if (bridge_batch_adaptive) {
+		n = ((j > end ? lim+1 : 0) + end) - j;
+		t0 = nm_os_gettime_ns();
+		batch = nm_bdg_batch_adapt(kring, n, t0);
+	}
+
 	for (; likely(j != end); j = nm_next(j, lim)) {
 		struct netmap_slot *slot = &ring->slot[j];
 		char *buf;
@@ -1088,6 +1819,15 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 			ft[ft_i].ft_len = 0;
 			ft[ft_i].ft_flags = 0;
 		}
+		if (unlikely(slot->flags & NS_INDIRECT) && na->uregs != NULL) {
+			/* in a pinned region, copy from the kernel mapping */
+			char *kva = nm_ureg_kva(na->uregs, slot->ptr, slot->len);
+
+			if (kva != NULL) {
+				buf = ft[ft_i].ft_buf = kva;
+				ft[ft_i].ft_flags &= ~NS_INDIRECT;
+			}
+		}
 		__builtin_prefetch(buf);
 		++ft_i;
 		if (slot->flags & NS_MOREFRAG) {
@@ -1098,8 +1838,11 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 			RD(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
-		if (unlikely((int)ft_i >= bridge_batch))
+		if (unlikely(ft_i >= batch)) {
+			NM_PROF_ADD(na, NM_PH_SCAN);
 			ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
+			NM_PROF_START();
+		}
 	}
 	if (frags > 1) {
 		D("truncate incomplete fragment at %d (%d frags)", ft_i, frags);
@@ -1107,9 +1850,20 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - 1].ft_frags &= ~NS_MOREFRAG;
 		ft[ft_i - frags].ft_frags = frags - 1;
 	}
+	NM_PROF_ADD(na, NM_PH_SCAN);
 	if (ft_i)
 		ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
 	BDG_RUNLOCK(b);
+	if (bridge_batch_adaptive) {
+		/* update the smoothed cost per slot */
+		kring->nkr_bdg_last = nm_os_gettime_ns();
+		if (n) {
+			u_int cost = (u_int)(kring->nkr_bdg_last - t0) / n;
+
+			kring->nkr_bdg_pktcost = kring->nkr_bdg_pktcost ?
+				(3 * kring->nkr_bdg_pktcost + cost) / 4 : cost;
+		}
+	}
 	return j;
 }
 
@@ -1182,6 +1936,169 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 }
 
 
+/*
+ * Source learning.
+ * The forwarding table is shared by all the senders of a bridge,
+ * so writing to it, even the same values, moves its cache lines
+ * among the cpus. netmap_bdg_learning() only calls nm_bdg_learn()
+ * when an entry must change, which happens when a host shows up
+ * or moves, or when two hosts collide on the same entry. In the
+ * last case the entry may flip at every packet, so the changes are
+ * queued in the log of the current cpu, collapsing the ones to the
+ * same entry, and applied at most once per batch by
+ * nm_bdg_learn_flush(). A log that cannot be used is bypassed.
+ * A change that is only queued is not remembered in last_smac, so
+ * the sender checks the entry again until the change is applied
+ * (or dropped because the entry changed meanwhile).
+ */
+static void
+nm_bdg_learn_init(struct nm_bridge *b)
+{
+	u_int i, n = nm_os_ncpus();
+
+	b->bdg_learn = malloc(n * sizeof(*b->bdg_learn), M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	if (b->bdg_learn == NULL)
+		return;
+	for (i = 0; i < n; i++) {
+		/* one allocation per log, no false sharing */
+		b->bdg_learn[i] = malloc(sizeof(struct nm_learn_log),
+			M_DEVBUF, M_NOWAIT | M_ZERO);
+		if (b->bdg_learn[i] == NULL)
+			break;
+	}
+	b->bdg_nlearn = i;
+}
+
+static void
+nm_bdg_learn_fini(struct nm_bridge *b)
+{
+	u_int i;
+
+	if (b->bdg_learn == NULL)
+		return;
+	for (i = 0; i < b->bdg_nlearn; i++)
+		free(b->bdg_learn[i], M_DEVBUF);
+	free(b->bdg_learn, M_DEVBUF);
+	b->bdg_learn = NULL;
+	b->bdg_nlearn = 0;
+}
+
+/*
+ * Apply the changes in a nonempty log we own. A change is dropped
+ * if the entry is not the one it replaced, i.e. something newer
+ * was written in the meantime.
+ */
+static void
+nm_bdg_learn_merge(struct nm_bridge *b, struct nm_learn_log *l)
+{
+	struct nm_hash_ent *ht = b->ht;
+	u_int i;
+
+	for (i = 0; i < l->n; i++) {
+		struct nm_hash_ent *h = &ht[l->e[i].sh];
+
+		if (h->mac == l->e[i].omac && h->ports == l->e[i].oport) {
+			h->mac = l->e[i].mac;
+			h->ports = l->e[i].port;
+		}
+	}
+	l->n = 0;
+	refcount_release(&b->bdg_learn_pending);
+}
+
+/*
+ * Set entry sh to mac on port. Return 1 if the table has been
+ * written, 0 if the change is queued.
+ */
+static int
+nm_bdg_learn(struct nm_bridge *b, uint32_t sh, uint64_t mac, u_int port)
+{
+	struct nm_hash_ent *h = &b->ht[sh];
+	struct nm_learn_log *l;
+	u_int i;
+
+	if (!bridge_learn_log || b->bdg_nlearn == 0)
+		goto direct;
+	l = b->bdg_learn[nm_os_curcpu() % b->bdg_nlearn];
+	if (NM_ATOMIC_TEST_AND_SET(&l->busy))
+		goto direct;
+	for (i = 0; i < l->n; i++) {
+		if (l->e[i].sh == sh)
+			break;
+	}
+	if (i == NM_LEARN_LOG) {
+		nm_bdg_learn_merge(b, l);
+		i = 0;
+	}
+	l->e[i].mac = mac;
+	l->e[i].sh = sh;
+	l->e[i].port = port;
+	l->e[i].omac = h->mac;
+	l->e[i].oport = h->ports;
+	if (i == l->n && l->n++ == 0)
+		refcount_acquire(&b->bdg_learn_pending);
+	NM_ATOMIC_CLEAR(&l->busy);
+	return 0;
+
+direct:
+	h->mac = mac;
+	h->ports = port;
+	return 1;
+}
+
+/*
+ * Called at the end of a batch. The changes of the batch may be
+ * in the log of another cpu after a migration, so all the logs
+ * with changes are applied. A busy log is being filled or applied
+ * by another batch, which will flush it in turn.
+ */
+static inline void
+nm_bdg_learn_flush(struct nm_bridge *b)
+{
+	struct nm_learn_log *l;
+	u_int i;
+
+	if (likely(b->bdg_learn_pending == 0))
+		return;
+	for (i = 0; i < b->bdg_nlearn; i++) {
+		l = b->bdg_learn[i];
+		if (l->n == 0 || NM_ATOMIC_TEST_AND_SET(&l->busy))
+			continue;
+		if (l->n > 0)
+			nm_bdg_learn_merge(b, l);
+		NM_ATOMIC_CLEAR(&l->busy);
+	}
+}
+
+
+/*
+ * Move the forwarding entries of port from to port to, e.g. when
+ * the port where a LAG is learned changes. Called with the bridge
+ * write-locked, so no log is in use.
+ */
+void
+netmap_bdg_relearn(struct nm_bridge *b, u_int from, u_int to)
+{
+	u_int i, j;
+
+	for (i = 0; i < NM_BDG_HASH; i++) {
+		if (b->ht[i].ports == from)
+			b->ht[i].ports = to;
+	}
+	for (i = 0; i < b->bdg_nlearn; i++) {
+		struct nm_learn_log *l = b->bdg_learn[i];
+
+		for (j = 0; j < l->n; j++) {
+			if (l->e[j].port == from)
+				l->e[j].port = to;
+			if (l->e[j].oport == from)
+				l->e[j].oport = to;
+		}
+	}
+}
+
+
 /*
  * Lookup function for a learning bridge.
  * Update the hash table with the source address,
@@ -1199,6 +2116,10 @@ netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 	u_int dst, mysrc = na->bdg_port;
 	uint64_t smac, dmac;
 
+	/* all the members of a LAG are learned as one port */
+	if (unlikely(na->lag != NULL))
+		mysrc = nm_lag_port(na);
+
 	/* safety check, unfortunately we have many cases */
 	if (buf_len >= 14 + na->virt_hdr_len) {
 		/* virthdr + mac_hdr in the same slot */
@@ -1224,12 +2145,17 @@ netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
 		uint8_t *s = buf+6;
 		sh = nm_bridge_rthash(s); // XXX hash of source
-		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
-		if (netmap_verbose)
-		    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
-			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+		/* update source port forwarding entry, if it changed */
+		if (unlikely(ht[sh].mac != smac || ht[sh].ports != mysrc)) {
+			/* XXX expire ? */
+			if (nm_bdg_learn(na->na_bdg, sh, smac, mysrc))
+				na->last_smac = smac;
+			if (netmap_verbose)
+			    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
+				s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
+		} else {
+			na->last_smac = smac;
+		}
 	}
 	dst = NM_BDG_BROADCAST;
 	if ((buf[0] & 1) == 0) { /* unicast */
@@ -1323,24 +2249,42 @@ int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		u_int ring_nr)
 {
-	struct nm_bdg_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
+	struct nm_bdg_q *dq, *brddst;
+	uint16_t *qidx;
+	u_int num_dsts = 1;	/* dq[0] is the broadcast queue */
 	struct nm_bridge *b = na->na_bdg;
 	u_int i, me = na->bdg_port;
+	struct nm_mcast *mcast = b->bdg_mcast;
+	/* with snooping, the ports that want some of the broadcasts */
+	uint32_t mmask[(NM_BDG_MAXPORTS + 31) / 32];
+	int mflood = 0;
+	struct nm_arp *arp = b->bdg_arp;
+	char *reply;	/* room for ARP/ND replies */
+	u_int nreplies = 0;
+	NM_PROF_DECL
+
+	NM_PROF_START();
+	NM_PROF_PKTS(na, n);
 
 	/*
-	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * The work area (pointed by ft) is followed by room for the
+	 * ARP/ND replies built by the switch, then by the queues of the
+	 * destinations used in this batch, dq, in the order they are
+	 * found; dq[0] is the broadcast queue. Last, qidx maps each
+	 * port to its first queue, so the cost of a batch depends on
+	 * the destinations in use, not on the size of the switch.
 	 */
-	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
+	reply = (char *)(ft + NM_BDG_BATCH_MAX);
+	dq = (struct nm_bdg_q *)(reply + NM_ARP_REPLY_SIZE * NM_BDG_REPLIES);
+	qidx = (uint16_t *)(dq + NM_BDG_DSTQ);
+	brddst = dq;
+	if (unlikely(mcast != NULL))
+		bzero(mmask, sizeof(mmask));
 
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
 		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
+		uint16_t dst_port;
 		struct nm_bdg_q *d;
 
 		ND("slot %d frags %d", i, ft[i].ft_frags);
@@ -1348,29 +2292,51 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		   fragment nor at the very beginning of the second. */
 		if (unlikely(na->virt_hdr_len > ft[i].ft_len))
 			continue;
+		/* packets from a VXLAN tunnel endpoint are decapsulated */
+		if (unlikely(na->vtep != NULL) && nm_vtep_decap(na, &ft[i]))
+			continue;
 		dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port == NM_BDG_NOPORT)
+		if (unlikely(arp != NULL) && dst_port != NM_BDG_NOPORT &&
+		    nm_arp_input(arp, &ft[i], na,
+		    dst_port == NM_BDG_BROADCAST && nreplies < NM_BDG_REPLIES ?
+		    reply + nreplies * NM_ARP_REPLY_SIZE : NULL)) {
+			/* answered by the switch, the reply goes back */
+			nreplies++;
+			dst_port = me;
+		} else if (dst_port == NM_BDG_NOPORT)
 			continue; /* this packet is identified to be dropped */
 		else if (unlikely(dst_port > NM_BDG_MAXPORTS))
 			continue;
-		else if (dst_port == NM_BDG_BROADCAST)
+		else if (dst_port == NM_BDG_BROADCAST) {
 			dst_ring = 0; /* broadcasts always go to ring 0 */
+			if (unlikely(mcast != NULL)) {
+				ft[i].ft_mgrp = nm_mcast_classify(mcast, &ft[i],
+					na, mmask);
+				if (ft[i].ft_mgrp == 0)
+					mflood = 1;
+			}
+		}
 		else if (unlikely(dst_port == me ||
 		    !b->bdg_ports[dst_port]))
 			continue;
+		else if (unlikely(b->bdg_ports[dst_port]->lag != NULL)) {
+			/* a LAG, choose the member */
+			dst_port = nm_lag_pick(b->bdg_ports[dst_port], &ft[i], na);
+			if (dst_port == NM_BDG_NOPORT)
+				continue;
+		}
 
 		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
+		if (dst_port == NM_BDG_BROADCAST)
+			d = brddst;
+		else
+			d = nm_bdg_dstq(dq, qidx, &num_dsts, dst_port, dst_ring);
 
 		/* append the first fragment to the list */
 		if (d->bq_head == NM_FT_NULL) { /* new destination */
 			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
 		} else {
 			ft[d->bq_tail].ft_next = i;
 			d->bq_tail = i;
@@ -1380,42 +2346,53 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 
 	/*
 	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * So we need to add these rings to the list of ports to scan,
+	 * with an empty queue unless the port already has one.
+	 * Only the active ports are visited.
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
 	if (brddst->bq_head != NM_FT_NULL) {
 		u_int j;
 		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
 			i = b->bdg_port_index[j];
 			if (unlikely(i == me))
 				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
+			/* only one member of a LAG gets broadcasts */
+			if (unlikely(b->bdg_ports[i]->lag != NULL) &&
+			    !nm_lag_brd(b->bdg_ports[i], na))
+				continue;
+			/* with snooping, only ports that want a packet */
+			if (unlikely(mcast != NULL) && !mflood) {
+				u_int p = b->bdg_ports[i]->lag == NULL ? i :
+					nm_lag_port(b->bdg_ports[i]);
+
+				if (!(mmask[p >> 5] & (1U << (p & 31))))
+					continue;
+			}
+			nm_bdg_dstq(dq, qidx, &num_dsts, i, 0);
 		}
 	}
 
+	/* source addresses learned in this batch */
+	nm_bdg_learn_flush(b);
+	NM_PROF_ADD(na, NM_PH_LOOKUP);
+
 	ND(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
 	/* second pass: scan destinations */
-	for (i = 0; i < num_dsts; i++) {
+	for (i = 1; i < num_dsts; i++) {
 		struct netmap_vp_adapter *dst_na;
 		struct netmap_kring *kring;
 		struct netmap_ring *ring;
 		u_int dst_nr, lim, j, d_i, next, brd_next;
-		u_int needed, howmany;
+		u_int needed, howmany, mport;
 		int retry = netmap_txsync_retry;
 		struct nm_bdg_q *d;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
-		int virt_hdr_mismatch = 0;
+		int virt_hdr_mismatch = 0, vtep = 0, gro = 0;
 
-		d_i = dsts[i];
+		d = dq + i;
+		d_i = d->bq_dst;
 		ND("second pass %d port %d", i, d_i);
-		d = dst_ents + d_i;
 		// XXX fix the division
 		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
 		/* protect from the lookup function returning an inactive
@@ -1434,6 +2411,10 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 			ND("not in netmap mode!");
 			goto cleanup;
 		}
+		/* port for the multicast groups, a LAG is one port */
+		mport = d_i / NM_BDG_MAXRINGS;
+		if (unlikely(dst_na->lag != NULL))
+			mport = nm_lag_port(dst_na);
 
 		/* there is at least one either unicast or broadcast packet */
 		brd_next = brddst->bq_head;
@@ -1447,13 +2428,19 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 */
 		needed = d->bq_len + brddst->bq_len;
 
-		if (unlikely(dst_na->virt_hdr_len != na->virt_hdr_len)) {
+		if (unlikely(dst_na->vtep != NULL)) {
+			/* encapsulation adds no slots, the outer
+			 * header goes in front of the first fragment.
+			 */
+			vtep = 1;
+		} else if (unlikely(dst_na->virt_hdr_len != na->virt_hdr_len)) {
 			RD(3, "virt_hdr_mismatch, src %d dst %d", na->virt_hdr_len, dst_na->virt_hdr_len);
 			/* There is a virtio-net header/offloadings mismatch between
 			 * source and destination. The slower mismatch datapath will
 			 * be used to cope with all the mismatches.
 			 */
 			virt_hdr_mismatch = 1;
+			gro = bridge_gro && !na->virt_hdr_len;
 			if (dst_na->mfs < na->mfs) {
 				/* We may need to do segmentation offloadings, and so
 				 * we may need a number of destination slots greater
@@ -1506,6 +2493,7 @@ retry:
 			howmany = needed;
 		lease_idx = nm_kr_lease(kring, howmany, 1);
 		mtx_unlock(&kring->q_lock);
+		NM_PROF_ADD(na, NM_PH_LEASE);
 
 		/* only retry if we need more than available slots */
 		if (retry && needed <= howmany)
@@ -1526,9 +2514,26 @@ retry:
 			if (next < brd_next) {
 				ft_p = ft + next;
 				next = ft_p->ft_next;
+				/* only unicast packets are coalesced */
+				if (unlikely(gro) && bdg_gro_datapath(na, dst_na,
+				    ft, ft_p, &next, brd_next, ring, &j, lim,
+				    &howmany)) {
+					if (next == NM_FT_NULL &&
+					    brd_next == NM_FT_NULL)
+						break;
+					continue;
+				}
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
 				brd_next = ft_p->ft_next;
+				/* multicast for a group this port is not in */
+				if (unlikely(mcast != NULL) && ft_p->ft_mgrp &&
+				    !nm_mcast_member(mcast, ft_p->ft_mgrp, mport)) {
+					if (next == NM_FT_NULL &&
+					    brd_next == NM_FT_NULL)
+						break;
+					continue;
+				}
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
 			if (unlikely(cnt > howmany))
@@ -1536,7 +2541,9 @@ retry:
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
-			if (unlikely(virt_hdr_mismatch)) {
+			if (unlikely(vtep)) {
+				nm_vtep_encap(na, dst_na, ft_p, ring, &j, lim, &howmany);
+			} else if (unlikely(virt_hdr_mismatch)) {
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
 				howmany -= cnt;
@@ -1579,6 +2586,7 @@ retry:
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
 				break;
 		}
+		NM_PROF_ADD(na, NM_PH_COPY);
 		{
 		    /* current position */
 		    uint32_t *p = kring->nkr_leases; /* shorthand */
@@ -1626,7 +2634,9 @@ retry:
 				kring->nr_hwtail = j;
 				still_locked = 0;
 				mtx_unlock(&kring->q_lock);
+				NM_PROF_ADD(na, NM_PH_DONE);
 				kring->nm_notify(kring, 0);
+				NM_PROF_ADD(na, NM_PH_NOTIFY);
 				/* this is netmap_notify for VALE ports and
 				 * netmap_bwrap_notify for bwrap. The latter will
 				 * trigger a txsync on the underlying hwna
@@ -1639,12 +2649,14 @@ retry:
 				}
 			}
 		    }
-		    if (still_locked)
+		    if (still_locked) {
 			mtx_unlock(&kring->q_lock);
+			NM_PROF_ADD(na, NM_PH_DONE);
+		    }
 		}
 cleanup:
-		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
-		d->bq_len = 0;
+		/* queues are rebuilt on the next batch, forget the port */
+		qidx[d_i / NM_BDG_MAXRINGS] = NM_DQ_NULL;
 	}
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
@@ -1774,7 +2786,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 {
 	struct netmap_vp_adapter *vpna;
 	struct netmap_adapter *na;
-	int error;
+	int error, shared = 0;
 	u_int npipes = 0;
 
 	vpna = malloc(sizeof(*vpna), M_DEVBUF, M_NOWAIT | M_ZERO);
@@ -1800,10 +2812,14 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 			1, NM_BDG_MAXSLOTS, NULL);
 	/* validate number of pipes. We want at least 1,
 	 * but probably can do with some more.
-	 * So let's use 2 as default (when 0 is supplied)
+	 * So let's use 2 as default (when 0 is supplied).
+	 * With exact sizing 0 means no pipes.
 	 */
 	npipes = nmr->nr_arg1;
-	nm_bound_var(&npipes, 2, 1, NM_MAXPIPES, NULL);
+	if (netmap_priv_exact)
+		nm_bound_var(&npipes, 0, 0, NM_MAXPIPES, NULL);
+	else
+		nm_bound_var(&npipes, 2, 1, NM_MAXPIPES, NULL);
 	nmr->nr_arg1 = npipes;	/* write back */
 	/* validate extra bufs */
 	nm_bound_var(&nmr->nr_arg3, 0, 0,
@@ -1829,23 +2845,41 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	na->nm_krings_create = netmap_vp_krings_create;
 	na->nm_krings_delete = netmap_vp_krings_delete;
 	na->nm_dtor = netmap_vp_dtor;
-	na->nm_mem = netmap_mem_private_new(na->name,
+	if (nmr->nr_arg2) {
+		/* share the region of another port, sized for
+		 * the whole group with dev.netmap.priv_group
+		 */
+		na->nm_mem = netmap_mem_find(nmr->nr_arg2);
+		if (na->nm_mem == NULL) {
+			error = EINVAL;
+			goto err;
+		}
+		shared = 1;
+	} else {
+		na->nm_mem = netmap_mem_private_new(na->name,
 			na->num_tx_rings, na->num_tx_desc,
 			na->num_rx_rings, na->num_rx_desc,
-			nmr->nr_arg3, npipes, &error);
-	if (na->nm_mem == NULL)
-		goto err;
+			nmr->nr_arg3, npipes, (int)nmr->nr_numa - 1, &error);
+		if (na->nm_mem == NULL)
+			goto err;
+	}
 	na->nm_bdg_attach = netmap_vp_bdg_attach;
 	/* other nmd fields are set in the common routine */
 	error = netmap_attach_common(na);
 	if (error)
 		goto err;
+	if (shared) /* drop the netmap_mem_find() reference */
+		netmap_mem_put(na->nm_mem);
 	*ret = vpna;
 	return 0;
 
 err:
-	if (na->nm_mem != NULL)
-		netmap_mem_delete(na->nm_mem);
+	if (na->nm_mem != NULL) {
+		if (shared)
+			netmap_mem_put(na->nm_mem);
+		else
+			netmap_mem_delete(na->nm_mem);
+	}
 	free(vpna, M_DEVBUF);
 	return error;
 }
@@ -1907,9 +2941,9 @@ netmap_bwrap_dtor(struct netmap_adapter *na)
 
 
 /*
- * Intr callback for NICs connected to a bridge.
+ * Pass received packets from a nic rx ring to the bridge, at most
+ * 'budget' slots if not 0. *done returns the number of slots.
  * Simply ignore tx interrupts (maybe we could try to recover space ?)
- * and pass received packets from nic to the bridge.
  *
  * XXX TODO check locking: this is called from the interrupt
  * handler so we should make sure that the interface is not
@@ -1920,23 +2954,24 @@ netmap_bwrap_dtor(struct netmap_adapter *na)
  * and head/cur/tail are set from the kring as needed
  * (part as a receive ring, part as a transmit ring).
  *
- * callback that overwrites the hwna notify callback.
+ * Called by the callback that overwrites the hwna notify callback,
+ * or by the ring worker in threaded mode.
  * Packets come from the outside or from the host stack and are put on an hwna rx ring.
  * The bridge wrapper then sends the packets through the bridge.
  */
 static int
-netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
+netmap_bwrap_forward(struct netmap_kring *kring, int flags, u_int budget,
+	u_int *done)
 {
 	struct netmap_adapter *na = kring->na;
 	struct netmap_bwrap_adapter *bna = na->na_private;
 	struct netmap_kring *bkring;
 	struct netmap_vp_adapter *vpna = &bna->up;
 	u_int ring_nr = kring->ring_id;
+	u_int head, n;
 	int error = 0;
 
-	if (netmap_verbose)
-	    D("%s %s 0x%x", na->name, kring->name, flags);
-
+	*done = 0;
 	if (!nm_netmap_on(na))
 		return 0;
 
@@ -1964,16 +2999,28 @@ netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
 
 	/* new packets are kring->rcur to kring->nr_hwtail, and the bkring
 	 * had hwcur == bkring->rhead. So advance bkring->rhead to kring->nr_hwtail
-	 * to push all packets out.
+	 * to push all packets out, or only 'budget' of them if set.
 	 */
-	bkring->rhead = bkring->rcur = kring->nr_hwtail;
+	head = kring->nr_hwtail;
+	n = head - kring->nr_hwcur;
+	if ((int)n < 0)
+		n += kring->nkr_num_slots;
+	if (budget && n > budget) {
+		n = budget;
+		head = kring->nr_hwcur + n;
+		if (head >= kring->nkr_num_slots)
+			head -= kring->nkr_num_slots;
+	}
+	bkring->rhead = bkring->rcur = head;
 
 	netmap_vp_txsync(bkring, flags);
 
-	/* mark all buffers as released on this ring */
-	kring->rhead = kring->rcur = kring->rtail = kring->nr_hwtail;
+	/* mark the forwarded buffers as released on this ring */
+	kring->rhead = kring->rcur = head;
+	kring->rtail = kring->nr_hwtail;
 	/* another call to actually release the buffers */
 	error = kring->nm_sync(kring, 0);
+	*done = n;
 
 put_out:
 	nm_kr_put(kring);
@@ -1981,6 +3028,221 @@ put_out:
 }
 
 
+#ifndef _WIN32 /* no kthreads on windows */
+/*
+ * Body of the kthread serving a hw rx ring in threaded mode.
+ * Like a NAPI poll, it forwards at most bna->budget slots and then
+ * reschedules itself if the ring still has packets, so that a busy
+ * ring does not monopolize the cpu.
+ */
+static void
+netmap_bwrap_worker(void *data)
+{
+	struct nm_bwrap_worker *w = data;
+	struct netmap_kring *kring = w->kring;
+	u_int budget = w->bna->budget;
+	u_int done;
+
+	w->polls++;
+	if (netmap_bwrap_forward(kring, 0, budget, &done))
+		return;
+	w->slots += done;
+	if (budget && done == budget &&
+	    kring->nr_hwcur != kring->nr_hwtail) {
+		w->exhausted++;
+		nm_os_kthread_wakeup_worker(w->nmk);
+	}
+}
+#endif /* !_WIN32 */
+
+
+/*
+ * Intr callback for NICs connected to a bridge.
+ * In threaded mode it only wakes up the worker of the ring,
+ * otherwise the packets are forwarded in the caller context.
+ */
+static int
+netmap_bwrap_intr_notify(struct netmap_kring *kring, int flags)
+{
+	struct netmap_adapter *na = kring->na;
+	struct netmap_bwrap_adapter *bna = na->na_private;
+	u_int done;
+
+	if (netmap_verbose)
+	    D("%s %s 0x%x", na->name, kring->name, flags);
+
+#ifndef _WIN32
+	/* the ring lock keeps netmap_bwrap_workers_stop() from
+	 * freeing the workers under us
+	 */
+	mtx_lock(&kring->q_lock);
+	if (bna->workers != NULL && kring->ring_id < bna->num_workers &&
+	    bna->workers[kring->ring_id].nmk != NULL) {
+		struct nm_bwrap_worker *w = &bna->workers[kring->ring_id];
+
+		w->wakeups++;
+		nm_os_kthread_wakeup_worker(w->nmk);
+		mtx_unlock(&kring->q_lock);
+		return 0;
+	}
+	mtx_unlock(&kring->q_lock);
+#endif /* !_WIN32 */
+	return netmap_bwrap_forward(kring, flags, 0, &done);
+}
+
+
+#ifndef _WIN32
+/*
+ * Stop and free the rx ring workers of a bwrap, logging their counters.
+ * Must be called after the hwna notify callbacks have been restored.
+ * Running netmap_bwrap_intr_notify() calls are drained through the
+ * ring locks, then the kthreads are stopped and only then freed.
+ */
+static void
+netmap_bwrap_workers_stop(struct netmap_bwrap_adapter *bna)
+{
+	struct nm_bwrap_worker *w = bna->workers;
+	u_int i;
+
+	if (w == NULL)
+		return;
+	bna->workers = NULL;
+	mb();
+	for (i = 0; i < bna->num_workers; i++) {
+		struct netmap_kring *kring = &bna->hwna->rx_rings[i];
+
+		mtx_lock(&kring->q_lock);
+		mtx_unlock(&kring->q_lock);
+	}
+	for (i = 0; i < bna->num_workers; i++) {
+		if (w[i].nmk == NULL)
+			continue;
+		D("%s ring %d: %llu wakeups %llu polls %llu slots %llu exhausted",
+			bna->up.up.name, i,
+			(unsigned long long)w[i].wakeups,
+			(unsigned long long)w[i].polls,
+			(unsigned long long)w[i].slots,
+			(unsigned long long)w[i].exhausted);
+		nm_os_kthread_delete(w[i].nmk);
+	}
+	free(w, M_DEVBUF);
+	bna->num_workers = 0;
+}
+
+/*
+ * Create and start the rx ring workers of a bwrap. On failure
+ * the rings are left to netmap_bwrap_intr_notify().
+ */
+static void
+netmap_bwrap_workers_start(struct netmap_bwrap_adapter *bna, u_int nrings)
+{
+	struct netmap_adapter *hwna = bna->hwna;
+	struct nm_bwrap_worker *w;
+	struct nm_kthread_cfg cfg;
+	int ncpus = nm_os_ncpus();
+	u_int i;
+
+	w = malloc(sizeof(*w) * nrings, M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (w == NULL) {
+		D("%s: no memory for the workers", bna->up.up.name);
+		return;
+	}
+	bzero(&cfg, sizeof(cfg));
+	cfg.worker_fn = netmap_bwrap_worker;
+	for (i = 0; i < nrings; i++) {
+		w[i].kring = &hwna->rx_rings[i];
+		w[i].bna = bna;
+		cfg.type = i;
+		cfg.worker_private = &w[i];
+		w[i].nmk = nm_os_kthread_create(&cfg);
+		if (w[i].nmk == NULL)
+			break;
+		nm_os_kthread_set_affinity(w[i].nmk, ncpus > 0 ? i % ncpus : -1);
+		if (nm_os_kthread_start(w[i].nmk)) {
+			nm_os_kthread_delete(w[i].nmk);
+			w[i].nmk = NULL;
+			break;
+		}
+	}
+	bna->workers = w;
+	bna->num_workers = nrings;
+	if (i < nrings) {
+		D("%s: cannot start the workers, forwarding from notify",
+			bna->up.up.name);
+		netmap_bwrap_workers_stop(bna);
+	}
+}
+#else /* _WIN32 */
+#define netmap_bwrap_workers_stop(bna)
+#define netmap_bwrap_workers_start(bna, n)
+#endif /* _WIN32 */
+
+
+static void netmap_bwrap_tx_timer(void *);
+
+/*
+ * Stop the doorbell timers of a bwrap and free the ring state.
+ * The txqs are only used under the lock of the hw tx ring, so once
+ * the pointer is cleared and the locks cycled no notify can arm a
+ * timer; the timers are then cancelled, waiting for a running
+ * callback, and only then freed.
+ */
+static void
+netmap_bwrap_txqs_stop(struct netmap_bwrap_adapter *bna)
+{
+	struct nm_bwrap_txq *q = bna->txqs;
+	u_int i;
+
+	if (q == NULL)
+		return;
+	bna->txqs = NULL;
+	mb();
+	for (i = 0; i < bna->num_txqs; i++) {
+		struct netmap_kring *hw_kring = &bna->hwna->tx_rings[i];
+
+		mtx_lock(&hw_kring->q_lock);
+		mtx_unlock(&hw_kring->q_lock);
+	}
+	for (i = 0; i < bna->num_txqs; i++) {
+		if (q[i].deferred) {
+			D("%s ring %d: %llu doorbells %llu deferred %llu by timer",
+				bna->up.up.name, i,
+				(unsigned long long)q[i].doorbells,
+				(unsigned long long)q[i].deferred,
+				(unsigned long long)q[i].timer_doorbells);
+		}
+		nm_os_timer_delete(q[i].timer);
+	}
+	free(q, M_DEVBUF);
+	bna->num_txqs = 0;
+}
+
+/*
+ * Allocate the doorbell state of the hw tx rings (and host ring,
+ * if any). Without a timer a ring rings the doorbell at every notify.
+ */
+static void
+netmap_bwrap_txqs_start(struct netmap_bwrap_adapter *bna)
+{
+	struct netmap_adapter *na = &bna->up.up;
+	struct nm_bwrap_txq *q;
+	u_int i, n = na->num_rx_rings;
+
+	if (na->na_flags & NAF_HOST_RINGS)
+		n++;
+
+	q = malloc(sizeof(*q) * n, M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (q == NULL)
+		return;
+	for (i = 0; i < n; i++) {
+		q[i].kring = &na->rx_rings[i];
+		q[i].timer = nm_os_timer_create(netmap_bwrap_tx_timer, &q[i]);
+	}
+	bna->num_txqs = n;
+	bna->txqs = q;
+}
+
+
 /* nm_register callback for bwrap */
 static int
 netmap_bwrap_register(struct netmap_adapter *na, int onoff)
@@ -1993,6 +3255,20 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 
 	ND("%s %s", na->name, onoff ? "on" : "off");
 
+	if (!onoff) {
+		u_int i;
+
+		/* reset all notify callbacks (including host ring),
+		 * then no more forwarding from the workers and the timers
+		 */
+		for (i = 0; i <= hwna->num_rx_rings; i++) {
+			hwna->rx_rings[i].nm_notify = hwna->rx_rings[i].save_notify;
+			hwna->rx_rings[i].save_notify = NULL;
+		}
+		netmap_bwrap_workers_stop(bna);
+		netmap_bwrap_txqs_stop(bna);
+	}
+
 	if (onoff) {
 		/* netmap_do_regif has been called on the bwrap na.
 		 * We need to pass the information about the
@@ -2000,6 +3276,7 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 		 * putting it in netmap mode
 		 */
 		hwna->na_lut = na->na_lut;
+		hwna->na_bufclass = na->na_bufclass;
 
 		if (hostna->na_bdg) {
 			/* if the host rings have been attached to switch,
@@ -2007,6 +3284,7 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 			 * in the hostna also
 			 */
 			hostna->up.na_lut = na->na_lut;
+			hostna->up.na_bufclass = na->na_bufclass;
 		}
 
 	}
@@ -2023,6 +3301,12 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 
 	if (onoff) {
 		u_int i;
+
+		if (bridge_bwrap_threads) {
+			netmap_bwrap_workers_start(bna, hwna->num_rx_rings +
+				(hostna->na_bdg ? 1 : 0));
+		}
+		netmap_bwrap_txqs_start(bna);
 		/* intercept the hwna nm_nofify callback on the hw rings */
 		for (i = 0; i < hwna->num_rx_rings; i++) {
 			hwna->rx_rings[i].save_notify = hwna->rx_rings[i].nm_notify;
@@ -2036,12 +3320,6 @@ netmap_bwrap_register(struct netmap_adapter *na, int onoff)
 			hwna->rx_rings[i].nm_notify = netmap_bwrap_intr_notify;
 		}
 	} else {
-		u_int i;
-		/* reset all notify callbacks (including host ring) */
-		for (i = 0; i <= hwna->num_rx_rings; i++) {
-			hwna->rx_rings[i].nm_notify = hwna->rx_rings[i].save_notify;
-			hwna->rx_rings[i].save_notify = NULL;
-		}
 		hwna->na_lut.lut = NULL;
 		hwna->na_lut.objtotal = 0;
 		hwna->na_lut.objsize = 0;
@@ -2148,9 +3426,9 @@ netmap_bwrap_krings_delete(struct netmap_adapter *na)
 }
 
 
-/* notify method for the bridge-->hwna direction */
+/* push the slots of a bwrap rx ring to the hw tx ring (doorbell) */
 static int
-netmap_bwrap_notify(struct netmap_kring *kring, int flags)
+netmap_bwrap_doorbell(struct netmap_kring *kring, int flags)
 {
 	struct netmap_adapter *na = kring->na;
 	struct netmap_bwrap_adapter *bna = na->na_private;
@@ -2170,7 +3448,7 @@ netmap_bwrap_notify(struct netmap_kring *kring, int flags)
 		return 0;
 
 	if (!nm_netmap_on(hwna))
-		return 0;
+		goto out;
 	/* first step: simulate a user wakeup on the rx ring */
 	netmap_vp_rxsync(kring, flags);
 	ND("%s[%d] PRE rx(c%3d t%3d l%3d) ring(h%3d c%3d t%3d) tx(c%3d ht%3d t%3d)",
@@ -2203,6 +3481,95 @@ out:
 }
 
 
+
+/*
+ * Called by the timer armed at the first deferral of a ring,
+ * rings the doorbell unless a notify already did it.
+ * q stays valid until netmap_bwrap_txqs_stop() has cancelled us.
+ */
+static void
+netmap_bwrap_tx_timer(void *arg)
+{
+	struct nm_bwrap_txq *q = arg;
+	struct netmap_kring *kring = q->kring;
+	struct netmap_bwrap_adapter *bna = kring->na->na_private;
+	struct netmap_kring *hw_kring = &bna->hwna->tx_rings[kring->ring_id];
+
+	mtx_lock(&hw_kring->q_lock);
+	if (bna->txqs == NULL || q->deferred_since == 0) {
+		mtx_unlock(&hw_kring->q_lock);
+		return;
+	}
+	q->deferred_since = 0;
+	q->doorbells++;
+	q->timer_doorbells++;
+	mtx_unlock(&hw_kring->q_lock);
+	netmap_bwrap_doorbell(kring, 0);
+}
+
+
+/*
+ * Returns 1 if the hw txsync for the slots pending on kring can wait:
+ * less than tx_thresh of them are ready and the first deferred one
+ * is younger than tx_delay. The first deferral arms the timer.
+ * Called with the hw tx ring lock held.
+ */
+static int
+netmap_bwrap_tx_defer(struct netmap_bwrap_adapter *bna,
+	struct nm_bwrap_txq *q)
+{
+	struct netmap_kring *kring = q->kring;
+	struct netmap_kring *hw_kring = &bna->hwna->tx_rings[kring->ring_id];
+	u_int thresh = bna->tx_thresh;
+	uint64_t now;
+	int pending;
+
+	/* do not keep more than half of the ring from the senders */
+	if (thresh > kring->nkr_num_slots / 2)
+		thresh = kring->nkr_num_slots / 2;
+	/* nm_bdg_flush() has already advanced nr_hwtail */
+	pending = kring->nr_hwtail - hw_kring->nr_hwcur;
+	if (pending < 0)
+		pending += kring->nkr_num_slots;
+	if (pending >= thresh)
+		return 0;
+	now = nm_os_gettime_ns();
+	if (q->deferred_since == 0) {
+		q->deferred_since = now;
+		nm_os_timer_start(q->timer, bna->tx_delay);
+	} else if (now - q->deferred_since >= bna->tx_delay * 1000ULL) {
+		return 0;
+	}
+	q->deferred++;
+	return 1;
+}
+
+
+/* notify method for the bridge-->hwna direction */
+static int
+netmap_bwrap_notify(struct netmap_kring *kring, int flags)
+{
+	struct netmap_bwrap_adapter *bna = kring->na->na_private;
+	struct netmap_kring *hw_kring = &bna->hwna->tx_rings[kring->ring_id];
+	struct nm_bwrap_txq *q;
+
+	mtx_lock(&hw_kring->q_lock);
+	q = bna->txqs;
+	if (q != NULL && kring->ring_id < bna->num_txqs) {
+		q += kring->ring_id;
+		if (bna->tx_thresh && bna->tx_delay && q->timer != NULL &&
+		    netmap_bwrap_tx_defer(bna, q)) {
+			mtx_unlock(&hw_kring->q_lock);
+			return 0;
+		}
+		q->deferred_since = 0;
+		q->doorbells++;
+	}
+	mtx_unlock(&hw_kring->q_lock);
+	return netmap_bwrap_doorbell(kring, flags);
+}
+
+
 /* nm_bdg_ctl callback for the bwrap.
  * Called on bridge-attach and detach, as an effect of vale-ctl -[ahd].
  * On attach, it needs to provide a fake netmap_priv_d structure and
@@ -2316,6 +3683,9 @@ netmap_bwrap_attach(const char *nr_name, struct netmap_adapter *hwna)
 	bna->up.retry = 1; /* XXX maybe this should depend on the hwna */
 
 	bna->hwna = hwna;
+	bna->budget = bridge_bwrap_budget;
+	bna->tx_thresh = bridge_bwrap_tx_thresh;
+	bna->tx_delay = bridge_bwrap_tx_delay;
 	netmap_adapter_get(hwna);
 	hwna->na_private = bna; /* weak reference */
 	hwna->na_vp = &bna->up;
@@ -2380,8 +3750,10 @@ netmap_init_bridges2(u_int n)
 		M_NOWAIT | M_ZERO);
 	if (b == NULL)
 		return NULL;
-	for (i = 0; i < n; i++)
+	for (i = 0; i < n; i++) {
 		BDG_RWINIT(&b[i]);
+		nm_bdg_learn_init(&b[i]);
+	}
 	return b;
 }
 
@@ -2393,8 +3765,10 @@ netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
 	if (b == NULL)
 		return;
 
-	for (i = 0; i < n; i++)
+	for (i = 0; i < n; i++) {
+		nm_bdg_learn_fini(&b[i]);
 		BDG_RWDESTROY(&b[i]);
+	}
 	free(b, M_DEVBUF);
 }
 
@@ -2414,6 +3788,7 @@ netmap_init_bridges(void)
 void
 netmap_uninit_bridges(void)
 {
+	netmap_bench_fini();
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
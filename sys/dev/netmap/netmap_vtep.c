@@ -0,0 +1,378 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* $FreeBSD$ */
+
+/*
+ * VXLAN tunnel endpoints (RFC 7348) on VALE ports.
+ *
+ * Any port of a VALE switch (an ephemeral port or an attached NIC)
+ * can be turned into a VTEP with NIOCBDGCONF, see struct nm_vtep_req.
+ * nm_bdg_flush() then calls
+ *
+ *   nm_vtep_decap() on the packets sent by the VTEP port, before the
+ *	lookup. The outer headers are validated and skipped by just
+ *	moving the ft_buf pointer, so the inner frame is learned and
+ *	forwarded with no extra copy;
+ *
+ *   nm_vtep_encap() instead of the plain copy, for the packets sent
+ *	to the VTEP port. The outer Ethernet/IPv4/UDP/VXLAN header is
+ *	a template built at configuration time, the per-packet work is
+ *	a 50 bytes copy, the length fields, the UDP source port (a hash
+ *	of the inner MAC addresses, for ECMP) and the IPv4 checksum,
+ *	updated incrementally from the precomputed sum of the template.
+ *	The UDP checksum is zero, as allowed for VXLAN over IPv4.
+ *
+ * Two local switches can be connected through a tunnel, e.g.
+ *
+ *	vale-ctl -T vale0:t,vni=7,lip=10.0.0.1,lmac=02:00:00:00:00:01,\
+ *		rip=10.0.0.2,rmac=02:00:00:00:00:02
+ *	vale-ctl -T vale1:t,vni=7,lip=10.0.0.2,lmac=02:00:00:00:00:02,\
+ *		rip=10.0.0.1,rmac=02:00:00:00:00:01
+ *	bridge -i vale0:t -i vale1:t
+ *
+ * No ARP is done for the remote VTEP, and outer IPv4 fragments are not
+ * reassembled. Sources using virtio-net offloads (checksum or GSO) are
+ * not supported and their packets are dropped.
+ * Configuration runs with the bridge write-locked, so the datapath
+ * sees either the old or the new state.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <sys/endian.h>
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#elif defined(_WIN32)
+#include "win_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_VTEP_IPOFF	14
+#define NM_VTEP_UDPOFF	(NM_VTEP_IPOFF + 20)
+#define NM_VTEP_VXOFF	(NM_VTEP_UDPOFF + 8)
+#define NM_VTEP_HLEN	(NM_VTEP_VXOFF + 8)	/* 50 */
+
+struct nm_vtep {
+	uint8_t		hdr[NM_VTEP_HLEN];	/* outer header template */
+	uint32_t	ip_sum;		/* raw sum of the template IP header */
+	uint32_t	vni;		/* network order, as in the header */
+	uint32_t	local_ip;
+	uint16_t	udp_port;
+	struct nm_vtep_req cfg;	/* as set, also holds the counters */
+};
+
+
+/* 16 bit one's complement sum in host order, not folded */
+static uint32_t
+nm_vtep_sum(const uint8_t *p, u_int len)
+{
+	uint32_t sum = 0;
+	u_int i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (p[i] << 8) | p[i + 1];
+	return sum;
+}
+
+
+static void
+nm_vtep_build(struct nm_vtep *v, const struct nm_vtep_req *req)
+{
+	uint8_t *h = v->hdr;
+	struct nm_iphdr *iph = (struct nm_iphdr *)(h + NM_VTEP_IPOFF);
+	struct nm_udphdr *udph = (struct nm_udphdr *)(h + NM_VTEP_UDPOFF);
+	uint8_t *vxh = h + NM_VTEP_VXOFF;
+
+	bzero(h, sizeof(v->hdr));
+	memcpy(h, req->nvr_remote_mac, 6);
+	memcpy(h + 6, req->nvr_local_mac, 6);
+	h[12] = 0x08;			/* IPv4 */
+	iph->version_ihl = 0x45;
+	iph->frag_off = htobe16(0x4000);	/* DF */
+	iph->ttl = 64;
+	iph->protocol = 17;		/* UDP */
+	iph->saddr = req->nvr_local_ip;
+	iph->daddr = req->nvr_remote_ip;
+	/* tot_len and check are filled per packet */
+	v->ip_sum = nm_vtep_sum((uint8_t *)iph, 20);
+
+	udph->dest = req->nvr_udp_port;
+	vxh[0] = 0x08;			/* I flag, VNI valid */
+	vxh[4] = req->nvr_vni >> 16;
+	vxh[5] = req->nvr_vni >> 8;
+	vxh[6] = req->nvr_vni;
+	memcpy(&v->vni, vxh + 4, 4);
+
+	v->local_ip = req->nvr_local_ip;
+	v->udp_port = req->nvr_udp_port;
+}
+
+
+void
+netmap_vtep_free(struct netmap_vp_adapter *vpna)
+{
+	if (vpna->vtep == NULL)
+		return;
+	free(vpna->vtep, M_DEVBUF);
+	vpna->vtep = NULL;
+}
+
+
+/*
+ * NIOCBDGCONF handler, invoked by netmap_bdg_svc_config() with the
+ * bridge write-locked.
+ */
+int
+netmap_vtep_config(struct nm_ifreq *ifr)
+{
+	struct nm_vtep_req *req = (struct nm_vtep_req *)ifr->data;
+	struct netmap_vp_adapter *vpna;
+	struct nm_vtep *v;
+
+	vpna = netmap_bdg_port_byname(ifr->nifr_name);
+	if (vpna == NULL)
+		return ENXIO;
+	v = vpna->vtep;
+
+	switch (req->nvr_cmd) {
+	case NM_VTEP_SET:
+		if (req->nvr_vni >= (1 << 24) ||
+		    (req->nvr_remote_mac[0] & 1) || (req->nvr_local_mac[0] & 1))
+			return EINVAL;
+		if (vpna->virt_hdr_len != 0) {
+			D("%s: VTEP ports cannot use virtio-net headers",
+				vpna->up.name);
+			return EINVAL;
+		}
+		if (req->nvr_udp_port == 0)
+			req->nvr_udp_port = htobe16(NM_VTEP_UDP_PORT);
+		if (v == NULL) {
+			v = malloc(sizeof(*v), M_DEVBUF, M_NOWAIT | M_ZERO);
+			if (v == NULL)
+				return ENOMEM;
+		}
+		nm_vtep_build(v, req);
+		/* the counters are preserved on reconfiguration */
+		memcpy(&v->cfg, req, offsetof(struct nm_vtep_req, nvr_tx));
+		vpna->vtep = v;
+		D("%s: VNI %u", vpna->up.name, req->nvr_vni);
+		break;
+
+	case NM_VTEP_CLEAR:
+		if (v == NULL)
+			return ENOENT;
+		netmap_vtep_free(vpna);
+		break;
+
+	case NM_VTEP_GET:
+		if (v == NULL)
+			return ENOENT;
+		*req = v->cfg;
+		break;
+
+	default:
+		return EINVAL;
+	}
+	return 0;
+}
+
+
+/*
+ * Strip the outer headers from a packet sent by a VTEP port.
+ * Returns 0 if ft now points to the inner frame, 1 if the packet
+ * must be dropped.
+ */
+int
+nm_vtep_decap(struct netmap_vp_adapter *na, struct nm_bdg_fwd *ft)
+{
+	struct nm_vtep *v = na->vtep;
+	uint8_t *buf = ft->ft_buf;
+	struct nm_iphdr *iph;
+	struct nm_udphdr *udph;
+	u_int iphlen, off;
+
+	if (unlikely(ft->ft_flags & NS_INDIRECT ||
+	    ft->ft_len < NM_VTEP_HLEN + 14 ||
+	    buf[12] != 0x08 || buf[13] != 0x00))
+		goto drop;
+	iph = (struct nm_iphdr *)(buf + 14);
+	iphlen = (iph->version_ihl & 0x0f) << 2;
+	off = 14 + iphlen + 16;	/* after the VXLAN header */
+	if (unlikely((iph->version_ihl >> 4) != 4 || iphlen < 20 ||
+	    ft->ft_len < off + 14 ||
+	    iph->protocol != 17 || iph->daddr != v->local_ip ||
+	    (iph->frag_off & htobe16(0x3fff))))	/* MF or offset */
+		goto drop;
+	udph = (struct nm_udphdr *)(buf + 14 + iphlen);
+	if (unlikely(udph->dest != v->udp_port ||
+	    !(buf[off - 8] & 0x08) ||
+	    memcmp(buf + off - 4, &v->vni, 3)))
+		goto drop;
+
+	ft->ft_buf = buf + off;
+	ft->ft_len -= off;
+	v->cfg.nvr_rx++;
+	return 0;
+
+drop:
+	RD(5, "%s: not a VXLAN packet for us", na->up.name);
+	v->cfg.nvr_rx_drop++;
+	return 1;
+}
+
+
+/*
+ * Copy one packet (ft_p->ft_frags source slots) into the rx ring of
+ * a VTEP port, starting at slot *j, with the outer headers in front.
+ * Same interface as bdg_mismatch_datapath(): *j and *howmany are
+ * updated with the slots used. Dropped packets use no slots.
+ */
+void
+nm_vtep_encap(struct netmap_vp_adapter *na, struct netmap_vp_adapter *dst_na,
+	struct nm_bdg_fwd *ft_p, struct netmap_ring *ring,
+	u_int *j, u_int lim, u_int *howmany)
+{
+	struct nm_vtep *v = dst_na->vtep;
+	struct nm_bdg_fwd *f, *ft_end = ft_p + ft_p->ft_frags;
+	u_int bufsz = NETMAP_BUF_SIZE(&dst_na->up);
+	u_int skip = na->virt_hdr_len;	/* only in the first slot */
+	u_int inner_len = 0, dst_off, used = 0;
+	struct netmap_slot *slot;
+	struct nm_iphdr *iph;
+	struct nm_udphdr *udph;
+	uint8_t *dst, *hdr;
+	uint32_t sum;
+
+	if (skip) {
+		struct nm_vnet_hdr *vh = ft_p->ft_buf;
+
+		if (ft_p->ft_flags & NS_INDIRECT ||
+		    vh->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM ||
+		    vh->gso_type != VIRTIO_NET_HDR_GSO_NONE)
+			goto drop;
+	}
+	/* check that everything fits before writing anything */
+	for (f = ft_p; f != ft_end; f++) {
+		u_int l = f->ft_len - (f == ft_p ? skip : 0);
+
+		if (l > bufsz - (f == ft_p ? NM_VTEP_HLEN : 0))
+			goto drop;
+		inner_len += l;
+	}
+	if (unlikely(inner_len < 14 ||
+	    inner_len + NM_VTEP_HLEN - 14 > 0xffff))
+		goto drop;
+
+	slot = &ring->slot[*j];
+	hdr = dst = NMB(&dst_na->up, slot);
+	dst_off = NM_VTEP_HLEN;
+	for (f = ft_p; f != ft_end; f++) {
+		uint8_t *src = (uint8_t *)f->ft_buf;
+		u_int l = f->ft_len;
+
+		if (f == ft_p) {
+			src += skip;
+			l -= skip;
+		} else if (l == 0) {
+			continue;
+		} else {
+			/* close the current slot, move to the next one */
+			slot->len = dst_off;
+			slot->flags = NS_MOREFRAG;
+			used++;
+			*j = nm_next(*j, lim);
+			slot = &ring->slot[*j];
+			dst = NMB(&dst_na->up, slot);
+			dst_off = 0;
+		}
+		if (f->ft_flags & NS_INDIRECT) {
+			if (copyin(src, dst + dst_off, l))
+				l = 0;	/* as in nm_bdg_flush() */
+		} else {
+			memcpy(dst + dst_off, src, l);
+		}
+		dst_off += l;
+	}
+	slot->len = dst_off;
+	slot->flags = 0;
+	used++;
+	*j = nm_next(*j, lim);
+	*howmany -= used;
+
+	/* now the outer header, in the first slot */
+	memcpy(hdr, v->hdr, NM_VTEP_HLEN);
+	iph = (struct nm_iphdr *)(hdr + NM_VTEP_IPOFF);
+	udph = (struct nm_udphdr *)(hdr + NM_VTEP_UDPOFF);
+	iph->tot_len = htobe16(inner_len + NM_VTEP_HLEN - 14);
+	sum = v->ip_sum + inner_len + NM_VTEP_HLEN - 14;
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	iph->check = htobe16(~sum & 0xffff);
+	udph->len = htobe16(inner_len + 16);
+	sum = 0;
+	if (ft_p->ft_len - skip >= 12)	/* inner MAC addresses */
+		sum = nm_vtep_sum(hdr + NM_VTEP_HLEN, 12);
+	sum ^= sum >> 16;
+	udph->source = htobe16(0xc000 | (sum & 0x3fff));	/* 49152-65535 */
+	v->cfg.nvr_tx++;
+	return;
+
+drop:
+	RD(5, "%s: cannot encapsulate %d bytes", dst_na->up.name,
+		ft_p->ft_len);
+	v->cfg.nvr_tx_drop++;
+}
+
+#endif /* WITH_VALE */
@@ -1099,6 +1099,7 @@ nm_pt_host_register(struct netmap_adapter *na, int onoff)
          * putting it in netmap mode
          */
         parent->na_lut = na->na_lut;
+        parent->na_bufclass = na->na_bufclass;
     }
 
     /* forward the request to the parent */
@@ -191,6 +191,7 @@ struct netmap_slot {
  	/*
 	 * (VALE tx rings only) data is in a userspace buffer,
 	 * whose address is in the 'ptr' field in the slot.
+	 * See struct nm_ureg_req to avoid a copyin() per slot.
 	 */
 
 #define	NS_MOREFRAG	0x0020	/* packet has more fragments */
@@ -332,7 +333,12 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	/*
+	 * Current size of the memory region. It grows when buffers
+	 * are added at runtime (dev.netmap.buf_num, see nm_remap()).
+	 */
+	const uint32_t	ni_memsize;
+	uint32_t	ni_spare1[4];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
@@ -502,14 +508,49 @@ struct nmreq {
 #define NETMAP_BDG_DELIF	7	/* destroy a virtual port */
 #define NETMAP_PT_HOST_CREATE	8	/* create ptnetmap kthreads */
 #define NETMAP_PT_HOST_DELETE	9	/* delete ptnetmap kthreads */
+#define NETMAP_BDG_SETPARAM	10	/* set a port parameter */
+#define NETMAP_BDG_GETPARAM	11	/* get a port parameter (NIOCGINFO) */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
 
-	uint16_t	nr_arg2;
+	/* port parameters for NETMAP_BDG_[SG]ETPARAM, value in nr_arg3 */
+#define NETMAP_BDG_P_LATENCY	1	/* latency budget of a batch, us */
+#define NETMAP_BDG_P_BATCH	2	/* batch of tx ring nr_ringid (ro) */
+#define NETMAP_BDG_P_BUDGET	3	/* slots per poll of the NIC workers */
+	/* NIC rx ring nr_ringid worker counters, low 32 bits (ro) */
+#define NETMAP_BDG_P_WAKEUPS	4	/* notifications */
+#define NETMAP_BDG_P_POLLS	5	/* worker runs */
+#define NETMAP_BDG_P_SLOTS	6	/* slots forwarded */
+#define NETMAP_BDG_P_EXHAUSTED	7	/* polls that used the whole budget */
+#define NETMAP_BDG_P_TXTHRESH	8	/* NIC doorbell threshold, slots */
+#define NETMAP_BDG_P_TXDELAY	9	/* NIC doorbell max delay, us */
+	/* NIC tx ring nr_ringid doorbell counters, low 32 bits (ro) */
+#define NETMAP_BDG_P_DOORBELLS	10	/* hw txsyncs */
+#define NETMAP_BDG_P_DEFERRED	11	/* notifications deferred */
+#define NETMAP_BDG_P_TXTIMER	12	/* doorbells rung by the timer */
+	/* cycles per packet sent by the port in each forwarding phase,
+	 * kernels built with WITH_VALE_PROF only. Setting any of them
+	 * (to 0) clears the counters.
+	 */
+#define NETMAP_BDG_P_CYC_SCAN	13	/* tx slots into the batch */
+#define NETMAP_BDG_P_CYC_LOOKUP	14	/* destination lookup */
+#define NETMAP_BDG_P_CYC_LEASE	15	/* q_lock and slot reservation */
+#define NETMAP_BDG_P_CYC_COPY	16	/* copy to the destinations */
+#define NETMAP_BDG_P_CYC_DONE	17	/* completion of the leases */
+#define NETMAP_BDG_P_CYC_NOTIFY	18	/* nm_notify of the destinations */
+#define NETMAP_BDG_P_MEM	19	/* memory used by the port, KB (ro) */
+
+	uint16_t	nr_arg2;	/* memory region id, see NIOCREGIF */
 	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
 	uint32_t	nr_flags;
 	/* various modes, extends nr_ringid */
-	uint32_t	spare2[1];
+	/*
+	 * NUMA node of the memory region plus one, 0 meaning any.
+	 * NIOCREGIF honors it when it creates a VALE port, NIOCGINFO
+	 * and NIOCREGIF return the node of the region in use.
+	 */
+	uint16_t	nr_numa;
+	uint16_t	spare2[1];
 };
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
@@ -530,6 +571,15 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
 /* request ptnetmap host support */
 #define NR_PASSTHROUGH_HOST	NR_PTNETMAP_HOST /* deprecated */
 #define NR_PTNETMAP_HOST	0x1000
+/*
+ * rings take their buffers from the second buffer class of the
+ * memory region (dev.netmap.buf1_size, buf1_num). Honored by the
+ * first registration of a port; later registrations (and those of
+ * pipes and monitors of the port) fail with EBUSY if they do not ask
+ * for the class in use. ring->nr_buf_size and buf_ofs describe the
+ * class, so NETMAP_BUF() works unchanged.
+ */
+#define NR_BUF_CLASS1		0x2000
 
 
 /*
@@ -585,6 +635,7 @@ typedef struct _POLL_REQUEST_DATA {
 #define NIOCTXSYNC	_IO('i', 148) /* sync tx queues */
 #define NIOCRXSYNC	_IO('i', 149) /* sync rx queues */
 #define NIOCCONFIG	_IOWR('i',150, struct nm_ifreq) /* for ext. modules */
+#define NIOCBDGCONF	_IOWR('i',151, struct nm_ifreq) /* VALE services */
 #endif /* !NIOCREGIF */
 
 
@@ -605,6 +656,9 @@ nm_ring_empty(struct netmap_ring *ring)
  * Opaque structure that is passed to an external kernel
  * module via ioctl(fd, NIOCCONFIG, req) for a user-owned
  * bridge port (at this point ephemeral VALE interface).
+ * The services built into VALE below take the same structure
+ * with ioctl(fd, NIOCBDGCONF, req) instead, so they never
+ * interpret data meant for the config() of a module.
  */
 #define NM_IFRDATA_LEN 256
 struct nm_ifreq {
@@ -612,6 +666,241 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * ACL classifier for VALE ports. NM_ACL_ON, sent with NIOCBDGCONF
+ * to the switch (e.g. "vale0:"), installs it on a bridge that runs
+ * the default learning lookup (EBUSY otherwise), and NM_ACL_OFF
+ * removes it with all the rules. The other commands are sent with
+ * NIOCCONFIG, nifr_name is the port and data a struct nm_acl_req.
+ * Rules are loaded into a staging set with NM_ACL_BEGIN and NM_ACL_ADD,
+ * and atomically replace the active set on NM_ACL_COMMIT.
+ * The first matching rule wins, and packets matching no rule get
+ * the default action given with NM_ACL_BEGIN.
+ * Only IPv4 packets are classified, other traffic is not filtered.
+ */
+#define NM_ACL_MAXRULES		4096
+
+struct nm_acl_rule {
+	uint32_t	src, src_mask;	/* IPv4 prefix, network order */
+	uint32_t	dst, dst_mask;
+	uint16_t	sport_lo, sport_hi; /* inclusive range, host order */
+	uint16_t	dport_lo, dport_hi;
+	uint8_t		proto;		/* IP protocol, 0 matches any */
+	uint8_t		action;
+#define NM_ACL_PASS		0
+#define NM_ACL_DROP		1
+	uint16_t	spare;
+};
+
+#define NM_ACL_REQ_RULES	8
+#define NM_ACL_REQ_HITS		31
+struct nm_acl_req {
+	uint16_t	nar_cmd;
+#define NM_ACL_BEGIN		1	/* new staging set, nar_arg is the default action */
+#define NM_ACL_ADD		2	/* append nar_count rules to the staging set */
+#define NM_ACL_COMMIT		3	/* make the staging set active */
+#define NM_ACL_CLEAR		4	/* remove the active set */
+#define NM_ACL_STATS		5	/* get hit counters starting from rule nar_arg */
+#define NM_ACL_ON		64	/* NIOCBDGCONF, use the classifier */
+#define NM_ACL_OFF		65	/* NIOCBDGCONF, back to learning */
+	uint16_t	nar_count;
+	uint32_t	nar_arg;
+	union {
+		struct nm_acl_rule	rules[NM_ACL_REQ_RULES];
+		/* hits[nrules] counts the default action */
+		uint64_t		hits[NM_ACL_REQ_HITS];
+	} nar_u;
+};
+
+/*
+ * VXLAN tunnel endpoint on a VALE port, configured with NIOCBDGCONF.
+ * nifr_name is the port (ephemeral or attached NIC), data contains
+ * a struct nm_vtep_req. Frames forwarded to the port are encapsulated
+ * toward the remote VTEP, and VXLAN packets for the local address and
+ * VNI received from the port are decapsulated into the switch; other
+ * packets received from the port are dropped.
+ * The leading 16 bits of data select the command, for this and the
+ * other NIOCBDGCONF requests; the values are unique across them.
+ * Addresses and the UDP port are in network byte order.
+ */
+#define NM_VTEP_UDP_PORT	4789	/* IANA */
+struct nm_vtep_req {
+	uint16_t	nvr_cmd;
+#define NM_VTEP_SET		16	/* make the port a VTEP */
+#define NM_VTEP_CLEAR		17	/* back to a plain port */
+#define NM_VTEP_GET		18	/* read configuration and counters */
+	uint16_t	nvr_udp_port;	/* 0 means NM_VTEP_UDP_PORT */
+	uint32_t	nvr_vni;	/* 24 bits, host order */
+	uint32_t	nvr_local_ip;
+	uint32_t	nvr_remote_ip;
+	uint8_t		nvr_local_mac[6];
+	uint8_t		nvr_remote_mac[6];
+	/* counters, filled by NM_VTEP_GET */
+	uint64_t	nvr_tx;		/* encapsulated */
+	uint64_t	nvr_rx;		/* decapsulated */
+	uint64_t	nvr_tx_drop;	/* too long or with offloads */
+	uint64_t	nvr_rx_drop;	/* not for this VTEP */
+};
+
+/*
+ * Link aggregation on a VALE switch, configured with NIOCBDGCONF.
+ * nifr_name is a port (usually an attached NIC), data contains a
+ * struct nm_lag_req. The members of a LAG are seen as a single port:
+ * frames received from any of them are learned on the LAG, frames for
+ * the LAG leave from one member chosen by a hash of the MAC and IP
+ * addresses and TCP/UDP ports, and broadcasts from a member never go
+ * back to the LAG. Members that are down, or not in netmap mode, are
+ * skipped and their flows are spread over the others.
+ * The leading 16 bits of data select the command, as for nm_vtep_req.
+ */
+#define NM_LAG_MAX		8	/* LAGs per switch */
+#define NM_LAG_MAXMEMBERS	6	/* ports per LAG */
+struct nm_lag_req {
+	uint16_t	nlr_cmd;
+#define NM_LAG_ADD		24	/* add the port to LAG nlr_id */
+#define NM_LAG_REMOVE		25	/* remove the port from its LAG */
+#define NM_LAG_UP		26	/* use the member again */
+#define NM_LAG_DOWN		27	/* do not send through the member */
+#define NM_LAG_GET		28	/* read the LAG of the port */
+	uint16_t	nlr_id;		/* 0 .. NM_LAG_MAX - 1 */
+	uint16_t	nlr_count;	/* members, filled by NM_LAG_GET */
+	uint16_t	nlr_spare;
+	struct nm_lag_member {
+		char		name[IFNAMSIZ];
+		uint16_t	port;	/* index in the switch */
+		uint16_t	up;
+		uint32_t	spare;
+		uint64_t	tx;	/* packets sent through the member */
+	} nlr_members[NM_LAG_MAXMEMBERS];
+};
+
+/*
+ * IGMP/MLD snooping on a VALE switch, configured with NIOCBDGCONF.
+ * When enabled, multicast frames are only forwarded to the ports
+ * that joined the group (learned from IGMP and MLD reports) and to
+ * the multicast router ports (learned from queries, or set with
+ * NM_MCAST_ROUTER). Frames for unknown groups go to the router ports
+ * only; broadcasts, link-local groups and IGMP/MLD messages are
+ * flooded as usual. Groups are kept per MAC address.
+ * nifr_name is the switch (e.g. "vale0:"), or the port for
+ * NM_MCAST_ROUTER. The leading 16 bits of data select the command,
+ * as for nm_vtep_req.
+ */
+#define NM_MCAST_REQ_GROUPS	16
+struct nm_mcast_req {
+	uint16_t	nmc_cmd;
+#define NM_MCAST_ON		32	/* enable snooping */
+#define NM_MCAST_OFF		33	/* disable, flood all multicast */
+#define NM_MCAST_ROUTER		34	/* nmc_arg 1: static router port */
+#define NM_MCAST_GET		35	/* groups from index nmc_arg on */
+	uint16_t	nmc_arg;
+	uint16_t	nmc_count;	/* groups returned by NM_MCAST_GET */
+	uint16_t	nmc_next;	/* index to continue from, 0 at end */
+	uint64_t	nmc_reports;	/* IGMP/MLD reports seen */
+	uint64_t	nmc_queries;	/* IGMP/MLD queries seen */
+	struct nm_mcast_group {
+		uint8_t		mac[6];
+		uint16_t	nports;	/* ports that joined */
+	} nmc_groups[NM_MCAST_REQ_GROUPS];
+};
+
+/*
+ * ARP/ND suppression on a VALE switch, configured with NIOCBDGCONF.
+ * When enabled, the switch learns IP to MAC bindings from ARP replies,
+ * gratuitous ARPs and neighbor advertisements, and answers ARP
+ * requests and neighbor solicitations for known addresses itself,
+ * instead of flooding them to all ports.
+ * nifr_name is the switch (e.g. "vale0:"). The leading 16 bits of
+ * data select the command, as for nm_vtep_req.
+ */
+#define NM_ARP_REQ_BINDINGS	8	/* must fit in NM_IFRDATA_LEN */
+struct nm_arp_req {
+	uint16_t	nar_cmd;
+#define NM_ARP_ON		40	/* enable suppression */
+#define NM_ARP_OFF		41	/* disable, flush the table */
+#define NM_ARP_GET		42	/* bindings from index nar_arg on */
+	uint16_t	nar_arg;
+	uint16_t	nar_count;	/* bindings returned by NM_ARP_GET */
+	uint16_t	nar_next;	/* index to continue from, 0 at end */
+	uint64_t	nar_replies;	/* requests answered by the switch */
+	uint64_t	nar_learned;	/* bindings learned or refreshed */
+	struct nm_arp_binding {
+		uint8_t		ip[16];	/* IPv4 as ::ffff:a.b.c.d */
+		uint8_t		mac[6];
+		uint16_t	port;	/* learned on this port */
+		uint32_t	age;	/* seconds since last refresh */
+	} nar_bindings[NM_ARP_REQ_BINDINGS];
+};
+
+/*
+ * User memory regions for NS_INDIRECT slots, configured with
+ * NIOCBDGCONF on a VALE port (nifr_name, e.g. "vale0:p1").
+ * NM_UREG_ADD pins nur_len bytes at nur_addr in the memory of the
+ * calling process and maps them in the kernel, returning the region
+ * index in nur_id. NM_UREG_ADD and NM_UREG_DEL must be issued on the
+ * file descriptor bound to the port. Indirect slots whose 'ptr' and 'len' fall in a
+ * region are then copied from the kernel mapping, without the
+ * per-packet copyin(); other indirect slots still use copyin().
+ * The memory stays pinned until NM_UREG_DEL or until the port
+ * leaves the switch. The leading 16 bits of data select the command,
+ * as for nm_vtep_req.
+ */
+#define NM_UREG_MAX		8
+#define NM_UREG_MAXLEN		(1ULL << 30)
+struct nm_ureg_req {
+	uint16_t	nur_cmd;
+#define NM_UREG_ADD		48	/* pin a region, return nur_id */
+#define NM_UREG_DEL		49	/* unpin region nur_id */
+#define NM_UREG_GET		50	/* list the regions */
+	uint16_t	nur_id;
+	uint16_t	nur_count;	/* regions returned by NM_UREG_GET */
+	uint16_t	nur_spare;
+	uint64_t	nur_addr;	/* NM_UREG_ADD */
+	uint64_t	nur_len;	/* NM_UREG_ADD */
+	uint64_t	nur_misses;	/* indirect slots out of the regions */
+	struct nm_ureg_region {
+		uint64_t	addr;	/* 0 for unused entries */
+		uint64_t	len;
+	} nur_regions[NM_UREG_MAX];
+};
+
+/*
+ * In-kernel traffic source and sink ports on a VALE switch, for
+ * benchmarking, configured with NIOCBDGCONF. nifr_name is a new port
+ * (e.g. "vale0:src"), created with one ring pair and owned by the
+ * kernel until NM_BENCH_STOP.
+ * A source sends UDP frames of nbr_len bytes from the nbr_nsrc
+ * addresses starting at nbr_src_mac/nbr_src_ip to the nbr_ndst
+ * addresses starting at nbr_dst_mac/nbr_dst_ip, at nbr_pps packets
+ * per second or as fast as possible. A sink drops what it receives.
+ * nbr_ns is the time spent in the switch for a source, and the time
+ * between the first and the last packet received for a sink, so
+ * nbr_ns / nbr_packets is the cost of a packet.
+ * The leading 16 bits of data select the command, as for nm_vtep_req.
+ */
+struct nm_bench_req {
+	uint16_t	nbr_cmd;
+#define NM_BENCH_SOURCE		56	/* create a source port */
+#define NM_BENCH_SINK		57	/* create a sink port */
+#define NM_BENCH_STOP		58	/* read the counters, destroy the port */
+#define NM_BENCH_GET		59	/* read the counters */
+	uint16_t	nbr_len;	/* frame length without CRC, 0 means 60 */
+	uint16_t	nbr_nsrc;	/* 0 means 1 */
+	uint16_t	nbr_ndst;	/* 0 means 1 */
+	uint64_t	nbr_pps;	/* 0 means no limit */
+	uint8_t		nbr_src_mac[6];
+	uint8_t		nbr_dst_mac[6];
+	uint32_t	nbr_src_ip;	/* network order */
+	uint32_t	nbr_dst_ip;
+	uint16_t	nbr_mode;	/* NM_BENCH_SOURCE or NM_BENCH_SINK */
+	uint16_t	nbr_spare;
+	/* counters, filled by NM_BENCH_GET and NM_BENCH_STOP */
+	uint64_t	nbr_packets;	/* sent or received */
+	uint64_t	nbr_bytes;
+	uint64_t	nbr_ns;
+	uint64_t	nbr_elapsed;	/* ns since the port was created */
+};
+
 /*
  * netmap kernel thread configuration
  */
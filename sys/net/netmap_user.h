@@ -211,6 +211,7 @@ struct nm_stat {	/* same as pcap_stat	*/
 };
 
 #define NM_ERRBUF_SIZE	512
+#define NM_HUGEPAGE_SIZE	(1<<21)	/* alignment of the mmap region */
 
 struct nm_desc {
 	struct nm_desc *self; /* point to self if netmap. */
@@ -307,12 +308,15 @@ typedef void (*nm_cb_t)(u_char *, const struct nm_pkthdr *, const u_char *d);
  *		-NN		bind individual NIC ring pair
  *		{NN		bind master side of pipe NN
  *		}NN		bind slave side of pipe NN
+ *		@NN		use memory region NN (nr_arg2), may follow
+ *				a ring suffix
  *		a suffix starting with + and the following flags,
  *		in any order:
  *		x		exclusive access
  *		z		zero copy monitor
  *		t		monitor tx side
  *		r		monitor rx side
+ *		b		use buffer class 1 (see NR_BUF_CLASS1)
  *
  * req		provides the initial values of nmreq before parsing ifname.
  *		Remember that the ifname parsing will override the ring
@@ -358,6 +362,15 @@ static int nm_close(struct nm_desc *);
 
 static int nm_mmap(struct nm_desc *, const struct nm_desc *);
 
+/*
+ * nm_remap()	extends the mapping when the kernel has added buffers
+ *		to the region (nifp->ni_memsize larger than d->memsize).
+ *		Returns 0 if nothing changed or the mapping now covers
+ *		the whole region, an errno otherwise.
+ */
+
+static int nm_remap(struct nm_desc *);
+
 /*
  * nm_inject() is the same as pcap_inject()
  * nm_dispatch() is the same as pcap_dispatch()
@@ -474,6 +487,7 @@ win_nm_ioctl_internal(HANDLE h, int32_t ctlCode, void *arg)
 		szOut = sizeof(struct nmreq);
 		break;
 	case NIOCCONFIG:
+	case NIOCBDGCONF:
 		D("unsupported NIOCCONFIG!");
 		return -1;
 
@@ -577,10 +591,11 @@ nm_open(const char *ifname, const struct nmreq *req,
 	const struct nm_desc *parent = arg;
 	u_int namelen;
 	uint32_t nr_ringid = 0, nr_flags, nr_reg;
+	uint16_t nr_arg2 = 0;
 	const char *port = NULL;
 #define MAXERRMSG 80
 	char errmsg[MAXERRMSG] = "";
-	enum { P_START, P_RNGSFXOK, P_GETNUM, P_FLAGS, P_FLAGSOK } p_state;
+	enum { P_START, P_RNGSFXOK, P_GETNUM, P_MEMID, P_FLAGS, P_FLAGSOK } p_state;
 	long num;
 
 	if (strncmp(ifname, "netmap:", 7) && strncmp(ifname, "vale", 4)) {
@@ -590,7 +605,7 @@ nm_open(const char *ifname, const struct nmreq *req,
 	if (ifname[0] == 'n')
 		ifname += 7;
 	/* scan for a separator */
-	for (port = ifname; *port && !index("-*^{}/", *port); port++)
+	for (port = ifname; *port && !index("-*^{}@/", *port); port++)
 		;
 	namelen = port - ifname;
 	if (namelen >= sizeof(d->req.nr_name)) {
@@ -623,6 +638,9 @@ nm_open(const char *ifname, const struct nmreq *req,
 				nr_flags = NR_REG_PIPE_SLAVE;
 				p_state = P_GETNUM;
 				break;
+			case '@': /* memory region */
+				p_state = P_MEMID;
+				break;
 			case '/': /* start of flags */
 				p_state = P_FLAGS;
 				break;
@@ -637,6 +655,12 @@ nm_open(const char *ifname, const struct nmreq *req,
 			case '/':
 				p_state = P_FLAGS;
 				break;
+			case '@':
+				if (nr_arg2 == 0) {
+					p_state = P_MEMID;
+					break;
+				}
+				/* fallthrough */
 			default:
 				snprintf(errmsg, MAXERRMSG, "unexpected character: '%c'", *port);
 				goto fail;
@@ -653,6 +677,16 @@ nm_open(const char *ifname, const struct nmreq *req,
 			nr_ringid = num & NETMAP_RING_MASK;
 			p_state = P_RNGSFXOK;
 			break;
+		case P_MEMID:
+			num = strtol(port, (char **)&port, 10);
+			if (num <= 0 || num > 0xffff) {
+				snprintf(errmsg, MAXERRMSG, "invalid memory region '%ld'",
+						num);
+				goto fail;
+			}
+			nr_arg2 = num;
+			p_state = P_RNGSFXOK;
+			break;
 		case P_FLAGS:
 		case P_FLAGSOK:
 			switch (*port) {
@@ -668,6 +702,9 @@ nm_open(const char *ifname, const struct nmreq *req,
 			case 'r':
 				nr_flags |= NR_MONITOR_RX;
 				break;
+			case 'b':
+				nr_flags |= NR_BUF_CLASS1;
+				break;
 			default:
 				snprintf(errmsg, MAXERRMSG, "unrecognized flag: '%c'", *port);
 				goto fail;
@@ -743,6 +780,9 @@ nm_open(const char *ifname, const struct nmreq *req,
 			d->req.nr_flags = parent->req.nr_flags;
 		}
 	}
+	/* a region named in ifname wins over the one from parent */
+	if (nr_arg2)
+		d->req.nr_arg2 = nr_arg2;
 	/* add the *XPOLL flags */
 	d->req.nr_ringid |= new_flags & (NETMAP_NO_TX_POLL | NETMAP_DO_RX_POLL);
 
@@ -820,7 +860,8 @@ nm_close(struct nm_desc *d)
 	 */
 	static void *__xxzt[] __attribute__ ((unused))  =
 		{ (void *)nm_open, (void *)nm_inject,
-		  (void *)nm_dispatch, (void *)nm_nextpkt } ;
+		  (void *)nm_dispatch, (void *)nm_nextpkt,
+		  (void *)nm_remap } ;
 
 	if (d == NULL || d->self != d)
 		return EINVAL;
@@ -851,8 +892,39 @@ nm_mmap(struct nm_desc *d, const struct nm_desc *parent)
 		d->memsize = parent->memsize;
 		d->mem = parent->mem;
 	} else {
+		void *addr = 0;
+
 		/* XXX TODO: check if memsize is too large (or there is overflow) */
 		d->memsize = d->req.nr_memsize;
+#if !defined(_WIN32) && defined(MAP_ANON)
+		/*
+		 * Place the region at a hugepage boundary, so that the
+		 * kernel can use large mappings if the allocator is made
+		 * of hugepages (dev.netmap.mem_hugepages). We reserve a
+		 * slightly larger range and trim it after the mmap.
+		 */
+		if (d->memsize >= NM_HUGEPAGE_SIZE) {
+			size_t rsize = d->memsize + NM_HUGEPAGE_SIZE;
+			char *r = mmap(0, rsize, PROT_NONE,
+				MAP_PRIVATE | MAP_ANON, -1, 0);
+
+			if (r != MAP_FAILED) {
+				char *a = (char *)(((uintptr_t)r + NM_HUGEPAGE_SIZE - 1) &
+					~(uintptr_t)(NM_HUGEPAGE_SIZE - 1));
+				d->mem = mmap(a, d->memsize, PROT_WRITE | PROT_READ,
+					MAP_SHARED | MAP_FIXED, d->fd, 0);
+				if (d->mem == MAP_FAILED) {
+					munmap(r, rsize);
+					goto fail;
+				}
+				if (a > r)
+					munmap(r, a - r);
+				munmap(a + d->memsize, r + rsize - (a + d->memsize));
+				addr = d->mem;
+			}
+		}
+		if (addr == 0)
+#endif /* !_WIN32 && MAP_ANON */
 		d->mem = mmap(0, d->memsize, PROT_WRITE | PROT_READ, MAP_SHARED,
 				d->fd, 0);
 		if (d->mem == MAP_FAILED) {
@@ -877,6 +949,43 @@ fail:
 	return EINVAL;
 }
 
+
+static int
+nm_remap(struct nm_desc *d)
+{
+	uint32_t newsize = d->nifp->ni_memsize;
+	char *want, *p;
+
+	if (newsize <= d->memsize)
+		return 0;
+	if (!d->done_mmap)
+		return EINVAL; /* the parent owns the mapping */
+#ifdef _WIN32
+	return EOPNOTSUPP;
+#else
+	/*
+	 * New buffers are appended to the region, so we only need
+	 * to map the tail right after the current mapping.
+	 */
+	want = (char *)d->mem + d->memsize;
+	p = mmap(want, newsize - d->memsize, PROT_WRITE | PROT_READ,
+#ifdef MAP_FIXED_NOREPLACE
+		MAP_FIXED_NOREPLACE |
+#endif
+		MAP_SHARED, d->fd, d->memsize);
+	if (p == MAP_FAILED)
+		return errno;
+	if (p != want) {
+		/* the hint was not honored, something else is there */
+		munmap(p, newsize - d->memsize);
+		return ENOMEM;
+	}
+	d->memsize = newsize;
+	*(void **)(uintptr_t)&d->buf_end = (char *)d->mem + d->memsize;
+	return 0;
+#endif /* !_WIN32 */
+}
+
 /*
  * Same prototype as pcap_inject(), only need to cast.
  */